@@ -0,0 +1,253 @@
+#pragma once
+
+#include <vector>
+#include <variant>
+#include <algorithm>
+#include <bit>
+#include <sstream>
+#include "util.h"
+#include "memory_usage.hh"
+#include "linear_probing.hh"
+#include "pbs_epsilon_8.hh"
+#include "pbs_bit_tricks.hh"
+
+
+// Pages of sorted vectors, each holding the elements in one aligned range
+// of 2^log_width keys. The page width is chosen at run time, which is what
+// lets AdaptivePBS pick it from the data.
+struct SortedVectorPages {
+
+    using VEC = std::vector<u64>;
+
+    u64 log_width;
+    LinearProbing<VEC*> table;
+
+    SortedVectorPages(u64 log_width) : log_width(log_width) {}
+
+    ~SortedVectorPages(){
+        table.for_each([](auto& entry){ delete entry.value; });
+    }
+
+    SortedVectorPages(const SortedVectorPages& other) = delete;
+    SortedVectorPages& operator=(const SortedVectorPages& other) = delete;
+
+    inline void insert(u64 x){
+        VEC *&page = table.try_emplace(x >> log_width, nullptr)->value;
+        if (page == nullptr) page = new VEC;
+        auto pt = std::lower_bound(page->begin(), page->end(), x);
+        if (pt == page->end() || *pt != x) page->insert(pt, x);
+    }
+
+    // Largest element <= x in the page of x, 0 if there is none or it is below lo
+    inline u64 predecessor_at_least(u64 x, u64 lo){
+        auto *entry = table.get(x >> log_width);
+        if (entry == nullptr) return 0;
+        const VEC &page = *entry->value;
+        auto pt = std::upper_bound(page.begin(), page.end(), x);
+        if (pt == page.begin() || *(pt - 1) < lo) return 0;
+        return *(pt - 1);
+    }
+
+    template <typename F>
+    void for_each_element(F f){
+        table.for_each([&](auto& entry){
+            for (u64 x : *entry.value) f(x);
+        });
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        table.for_each([&](auto& entry){
+            const VEC &page = *entry.value;
+            usage.page_payload    += page.size() * sizeof(u64);
+            usage.allocator_slack += (page.capacity() - page.size()) * sizeof(u64)
+                                   + malloc_overhead(page.data(), page.capacity() * sizeof(u64))
+                                   + malloc_overhead(entry.value, sizeof(VEC));
+            usage.metadata        += sizeof(VEC);
+        });
+        usage.metadata += sizeof(*this) - sizeof(table);
+        return usage;
+    }
+};
+
+
+// Front-end that picks the page layout from the data and changes it online.
+//
+// The layouts are bitmap pages with epsilon 8, 16 or 32 (PBSEpsilon8,
+// PBSBitTricks<16>, PBSBitTricks<32>), which are fastest and smallest for
+// dense keys, and sorted vector pages of a chosen width, which are smaller
+// for sparse keys. Outside, every layout looks like PBSEpsilon8: the ids are
+// x / 64 and all of them are page bearers, so the test harness walks the
+// same pages whatever the layout is. A visit to page p of a wider layout asks
+// for the predecessor of x within [64p, 64p + 64).
+//
+// Every time the number of insertions doubles (from MIN_CHECK_INSERTIONS
+// on), the elements are collected and the bytes per element of each layout
+// are estimated from the number of distinct pages of every width. The
+// elements are then moved to the best layout if the current one is more than
+// MIGRATE_FACTOR worse. The same happens if the vector pages have grown past
+// MAX_VECTOR_PAGE elements on average and queries scan too much. The
+// checkpoints are geometric, so the passes cost O(log n) per insertion
+// amortized, but the insertion that triggers one takes a pass over everything.
+struct AdaptivePBS {
+
+    static const u64 LOG_ID_WIDTH         = 6;       // ids are x / 64
+    static const u64 MIN_CHECK_INSERTIONS = 1 << 12;
+    static const u64 MAX_VECTOR_PAGE      = 64;      // average elements per vector page
+    constexpr static const double MIGRATE_FACTOR    = 1.25;
+    constexpr static const double VECTOR_PAGE_TAX   = 1.25; // vector pages are slower, count them this much larger
+    constexpr static const double TABLE_FILL        = 0.6;  // average fill of LinearProbing
+    constexpr static const double VECTOR_PAGE_BYTES = 64;   // slot, vector header and malloc chunk of a vector page
+
+    // log_width is the log of the keys per page: 6, 8 or 10 for the bitmaps
+    struct Layout {
+        enum Kind {Bitmap, VectorPages};
+        Kind kind;
+        u64 log_width;
+
+        bool operator==(const Layout& other) const {
+            return kind == other.kind && log_width == other.log_width;
+        }
+    };
+
+    using Pages = std::variant<PBSEpsilon8, PBSBitTricks<16>, PBSBitTricks<32>, SortedVectorPages>;
+
+    Layout layout = {Layout::Bitmap, LOG_ID_WIDTH};
+    Pages pages;
+    u64 n_insertions = 0;
+    u64 next_check   = MIN_CHECK_INSERTIONS;
+    u64 n_migrations = 0;
+
+    AdaptivePBS() : pages(std::in_place_type<PBSEpsilon8>) {}
+
+    static std::string layout_name(Layout layout){
+        std::stringstream sstm;
+        if (layout.kind == Layout::Bitmap) sstm << "bitmap pages, epsilon " << ((u64)(1) << (layout.log_width / 2));
+        else sstm << "vector pages of 2^" << layout.log_width << " keys";
+        return sstm.str();
+    }
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << "AdaptivePBS (" << layout_name(layout) << ", " << n_migrations << " migrations)";
+        return sstm.str();
+    }
+
+    inline static u64 get_id(u64 x){
+        return x >> LOG_ID_WIDTH;
+    }
+
+    inline static bool is_id_page_bearer(u64){
+        return true;
+    }
+
+    inline bool try_insert_in_page(u64 x, u64){
+        std::visit([&](auto& pbs){ insert_into(pbs, x); }, pages);
+        if (++n_insertions >= next_check){
+            next_check *= 2;
+            check_layout();
+        }
+        return true;
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        const u64 lo = id << LOG_ID_WIDTH;
+        const u64 y  = std::min(x, lo + ((u64)(1) << LOG_ID_WIDTH) - 1);
+        return std::visit([&](auto& pbs){ return predecessor_at_least(pbs, y, lo); }, pages);
+    }
+
+    template <typename Bitmap>
+    inline static void insert_into(Bitmap& pbs, u64 x){
+        pbs.try_insert_in_page(x, Bitmap::get_id(x));
+    }
+
+    inline static void insert_into(SortedVectorPages& pbs, u64 x){
+        pbs.insert(x);
+    }
+
+    // Largest element <= y in the page of y, 0 if there is none or it is below lo.
+    // PBSBitTricks answers with the first key of the page when the page has
+    // nothing <= y, so that key is checked.
+    template <typename Bitmap>
+    inline static u64 predecessor_at_least(Bitmap& pbs, u64 y, u64 lo){
+        const u64 id  = Bitmap::get_id(y);
+        const u64 res = pbs.try_predecessor_in_page(y, id);
+        if (res < lo || (res == Bitmap::recover_element(id) && !pbs.contains(res))) return 0;
+        return res;
+    }
+
+    inline static u64 predecessor_at_least(SortedVectorPages& pbs, u64 y, u64 lo){
+        return pbs.predecessor_at_least(y, lo);
+    }
+
+    // Number of distinct elements and of distinct x >> log_width, for every
+    // log_width, from the sorted elements
+    struct Statistics {
+        u64 n = 0;
+        u64 pages[64] = {0};
+
+        Statistics(const std::vector<u64>& sorted){
+            n = sorted.size();
+            for (u64 i = 0; i < n; i++){
+                const u64 differing = i == 0 ? ~(u64)(0) : sorted[i] ^ sorted[i-1];
+                // x >> w differs from the previous element's for every w below the highest differing bit
+                const u64 highest = differing == 0 ? 0 : 64 - std::countl_zero(differing);
+                for (u64 w = 0; w < highest && w < 64; w++) pages[w]++;
+            }
+        }
+
+        double bytes(Layout layout) const {
+            const double n_pages = pages[layout.log_width];
+            if (layout.kind == Layout::Bitmap){
+                const double entry_bytes = sizeof(u64) + ((u64)(1) << layout.log_width) / 8;
+                return n_pages * entry_bytes / TABLE_FILL;
+            }
+            return n * sizeof(u64) * VECTOR_PAGE_TAX + n_pages * VECTOR_PAGE_BYTES;
+        }
+
+        // The widest vector pages that stay below MAX_VECTOR_PAGE elements on average
+        u64 vector_page_width() const {
+            u64 w = LOG_ID_WIDTH;
+            while (w + 1 < 64 && pages[w + 1] * MAX_VECTOR_PAGE >= n) w++;
+            return w;
+        }
+    };
+
+    Layout best_layout(const Statistics& stats){
+        Layout best = {Layout::VectorPages, stats.vector_page_width()};
+        for (u64 log_width : {6, 8, 10}){
+            Layout bitmap = {Layout::Bitmap, log_width};
+            if (stats.bytes(bitmap) < stats.bytes(best)) best = bitmap;
+        }
+        return best;
+    }
+
+    void check_layout(){
+        std::vector<u64> elements;
+        std::visit([&](auto& pbs){ pbs.for_each_element([&](u64 x){ elements.push_back(x); }); }, pages);
+        std::sort(elements.begin(), elements.end());
+        const Statistics stats(elements);
+
+        const Layout best = best_layout(stats);
+        if (best == layout) return;
+        const bool pages_too_long = layout.kind == Layout::VectorPages && stats.pages[layout.log_width] * 4 * MAX_VECTOR_PAGE < stats.n;
+        if (!pages_too_long && stats.bytes(layout) <= MIGRATE_FACTOR * stats.bytes(best)) return;
+        migrate(best, elements);
+    }
+
+    void migrate(Layout new_layout, const std::vector<u64>& elements){
+        if (new_layout.kind == Layout::VectorPages) pages.emplace<SortedVectorPages>(new_layout.log_width);
+        else if (new_layout.log_width == 6)         pages.emplace<PBSEpsilon8>();
+        else if (new_layout.log_width == 8)         pages.emplace<PBSBitTricks<16>>();
+        else                                        pages.emplace<PBSBitTricks<32>>();
+        std::visit([&](auto& pbs){ for (u64 x : elements) insert_into(pbs, x); }, pages);
+        layout = new_layout;
+        n_migrations++;
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = std::visit([](auto& pbs){ return pbs.memory_usage(); }, pages);
+        usage.metadata += sizeof(*this) - std::visit([](auto& pbs){ return sizeof(pbs); }, pages);
+        return usage;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "util.h"
+
+
+// Sort-and-merge processing of a block of operations. The page visits of
+// a block are radix sorted by page id, and each run of visits to the same
+// page is handed to the structure in one call, so the page index is probed
+// once per distinct page instead of once per element, in page id order.
+//
+// Queries do not change the structure and can be reordered freely. For
+// insertions the order only does not matter when every id is a page bearer
+// and x goes to the page of its own id, as in PBSEpsilon8WithTable and
+// PBSBitTricks. In PBSPageBearerHashing the walks of later insertions depend
+// on the pages that earlier ones created or split, so it only batches queries.
+//
+// The structure provides, next to try_insert_in_page / try_predecessor_in_page,
+//
+//      insert_batch_in_page(xs, n, page_id)
+//      predecessors_in_page(xs, n, page_id, results)
+//
+// The sort, and gathering xs and scattering the results back, cost a few
+// passes over the block. That only pays off when a probe costs more than
+// those passes and many visits of the block share a page; with the table in
+// cache, or with far more pages than visits, element at a time is faster.
+//
+// The buffers are kept between blocks, so use one PageBatcher per stream.
+struct PageBatcher {
+
+    static const u64 RADIX_BITS = 8;
+    static const u64 RADIX      = (u64)(1) << RADIX_BITS;
+
+    std::vector<u64> keys, order;
+    std::vector<u64> tmp_keys, tmp_order;
+    std::vector<u64> grouped_xs, grouped_results;
+
+    // One stable LSD radix pass of words and (if given) their positions
+    // on the RADIX_BITS bits above shift. Returns false if words was
+    // already sorted on those bits, in which case nothing is moved.
+    static bool radix_pass(std::vector<u64>& words, std::vector<u64>& tmp_words,
+                           std::vector<u64> *positions, std::vector<u64> *tmp_positions, u64 shift){
+        const u64 n = words.size();
+        u64 offsets[RADIX + 1] = {0};
+        bool sorted = true;
+        u64 previous_digit = 0;
+        for (u64 i = 0; i < n; i++){
+            const u64 digit = (words[i] >> shift) & (RADIX - 1);
+            sorted &= digit >= previous_digit;
+            previous_digit = digit;
+            offsets[digit + 1]++;
+        }
+        if (sorted) return false;
+        for (u64 d = 0; d < RADIX; d++) offsets[d + 1] += offsets[d];
+
+        for (u64 i = 0; i < n; i++){
+            const u64 pos = offsets[(words[i] >> shift) & (RADIX - 1)]++;
+            tmp_words[pos] = words[i];
+            if (positions != nullptr) (*tmp_positions)[pos] = (*positions)[i];
+        }
+        std::swap(words, tmp_words);
+        if (positions != nullptr) std::swap(*positions, *tmp_positions);
+        return true;
+    }
+
+    // Stable LSD radix sort of the positions 0..n by their key. Leaves the
+    // sorted keys in keys and the positions in order. Passes above the
+    // highest set bit of the largest key are skipped, so small ids are cheap,
+    // and keys below 2^32 are sorted together with their position in one
+    // word, which halves the memory traffic of every pass.
+    void sort_by_key(const u64 *unsorted_keys, u64 n){
+        keys.resize(n);
+        order.resize(n);
+        tmp_keys.resize(n);
+
+        u64 max_key = 0;
+        for (u64 i = 0; i < n; i++) max_key = std::max(max_key, unsorted_keys[i]);
+
+        const u64 POSITION_BITS = 32;
+        if ((max_key >> POSITION_BITS) == 0 && (n >> POSITION_BITS) == 0){
+            for (u64 i = 0; i < n; i++) keys[i] = (unsorted_keys[i] << POSITION_BITS) | i;
+            for (u64 shift = POSITION_BITS; shift < 64 && (max_key >> (shift - POSITION_BITS)) != 0; shift += RADIX_BITS){
+                radix_pass(keys, tmp_keys, nullptr, nullptr, shift);
+            }
+            const u64 position_mask = ((u64)(1) << POSITION_BITS) - 1;
+            for (u64 i = 0; i < n; i++){
+                order[i] = keys[i] & position_mask;
+                keys[i] >>= POSITION_BITS;
+            }
+            return;
+        }
+
+        tmp_order.resize(n);
+        for (u64 i = 0; i < n; i++){
+            keys[i]  = unsorted_keys[i];
+            order[i] = i;
+        }
+        for (u64 shift = 0; shift < 64 && (max_key >> shift) != 0; shift += RADIX_BITS){
+            radix_pass(keys, tmp_keys, &order, &tmp_order, shift);
+        }
+    }
+
+    // Inserts xs[0..n), one structure call per distinct page. Only for
+    // structures where the order of insertions does not matter, see above.
+    template <typename pbs_structure>
+    void insert(pbs_structure& pbs, const u64 *xs, u64 n){
+        std::vector<u64> &ids = grouped_results; // as scratch space
+        ids.resize(n);
+        for (u64 i = 0; i < n; i++) ids[i] = pbs_structure::get_id(xs[i]);
+        sort_by_key(ids.data(), n);
+
+        grouped_xs.resize(n);
+        for (u64 i = 0; i < n; i++) grouped_xs[i] = xs[order[i]];
+
+        u64 begin = 0;
+        while (begin < n){
+            u64 end = begin + 1;
+            while (end < n && keys[end] == keys[begin]) end++;
+            pbs.insert_batch_in_page(grouped_xs.data() + begin, end - begin, keys[begin]);
+            begin = end;
+        }
+    }
+
+    // Answers the page visits xs[0..n) / page_ids[0..n) into results[0..n),
+    // in the original order, one structure call per distinct page.
+    template <typename pbs_structure>
+    void predecessors(pbs_structure& pbs, const u64 *xs, const u64 *page_ids, u64 n, u64 *results){
+        sort_by_key(page_ids, n);
+
+        grouped_xs.resize(n);
+        grouped_results.resize(n);
+        for (u64 i = 0; i < n; i++) grouped_xs[i] = xs[order[i]];
+
+        u64 begin = 0;
+        while (begin < n){
+            u64 end = begin + 1;
+            while (end < n && keys[end] == keys[begin]) end++;
+            pbs.predecessors_in_page(grouped_xs.data() + begin, end - begin, keys[begin], grouped_results.data() + begin);
+            begin = end;
+        }
+
+        for (u64 i = 0; i < n; i++) results[order[i]] = grouped_results[i];
+    }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "util.h"
+#include "linear_probing.hh"
+
+
+// Union, intersection and difference of two bitmap PBS structures
+// (PBSEpsilon8, PBSBitTricks) with the same page layout, page by page: pages
+// are matched by id and their words combined with OR, AND or AND NOT, which
+// the compiler vectorizes. Pages that end up empty are dropped. This is what
+// union_with(), intersect_with() and difference_with() of the structures do.
+//
+// The page index must be LinearProbing, since the work is split into ranges
+// of its slots. With n_threads > 1 the ranges are done in parallel:
+//
+//  - intersection and difference only change values of this table, each by
+//    the thread whose range it is in, reading the other table. The pages
+//    that became empty are then removed in one erase_if() pass.
+//  - union ORs the pages both have in place in the same way, while each
+//    thread collects the pages only the other table has. Those are inserted
+//    afterwards on one thread, as inserting can move entries around.
+
+template <typename Data>
+inline void or_words(Data& into, const Data& from){
+    u64 *a = (u64*)&into;
+    const u64 *b = (const u64*)&from;
+    for (u64 i = 0; i < sizeof(Data) / sizeof(u64); i++) a[i] |= b[i];
+}
+
+template <typename Data>
+inline void and_words(Data& into, const Data& from){
+    u64 *a = (u64*)&into;
+    const u64 *b = (const u64*)&from;
+    for (u64 i = 0; i < sizeof(Data) / sizeof(u64); i++) a[i] &= b[i];
+}
+
+template <typename Data>
+inline void and_not_words(Data& into, const Data& from){
+    u64 *a = (u64*)&into;
+    const u64 *b = (const u64*)&from;
+    for (u64 i = 0; i < sizeof(Data) / sizeof(u64); i++) a[i] &= ~b[i];
+}
+
+template <typename Data>
+inline bool is_empty_page(const Data& page){
+    const u64 *a = (const u64*)&page;
+    u64 any = 0;
+    for (u64 i = 0; i < sizeof(Data) / sizeof(u64); i++) any |= a[i];
+    return any == 0;
+}
+
+// Calls f(thread, begin, end) for n_threads ranges that split [0, n)
+template <typename F>
+void for_each_range(u64 n, u64 n_threads, F f){
+    n_threads = std::max((u64)(1), std::min(n_threads, n));
+    if (n_threads == 1) return f(0, 0, n);
+    std::vector<std::thread> threads;
+    for (u64 t = 0; t < n_threads; t++){
+        threads.emplace_back([&, t]{ f(t, n * t / n_threads, n * (t + 1) / n_threads); });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+// Combines every page of table with the page of the same id in other, or
+// with nothing if other has none, and drops the pages that become empty
+template <typename Data, typename Key, typename Combine>
+void combine_pages(LinearProbing<Data, Key>& table, LinearProbing<Data, Key>& other, u64 n_threads, Combine combine){
+    std::vector<u64> n_emptied(std::max((u64)(1), n_threads), 0);
+    for_each_range(table.capacity, n_threads, [&](u64 t, u64 begin, u64 end){
+        for (u64 i = begin; i < end; i++){
+            auto &entry = table.table[i];
+            if (entry.key == LinearProbing<Data, Key>::EMPTY_CELL) continue;
+            combine(entry.value, other.get(entry.key));
+            n_emptied[t] += is_empty_page(entry.value);
+        }
+    });
+    u64 total = 0;
+    for (u64 n : n_emptied) total += n;
+    if (total > 0) table.erase_if([](auto& entry){ return is_empty_page(entry.value); });
+}
+
+template <typename Data, typename Key>
+void bitmap_intersect(LinearProbing<Data, Key>& table, LinearProbing<Data, Key>& other, u64 n_threads = 1){
+    combine_pages(table, other, n_threads, [](Data& page, const auto *other_entry){
+        if (other_entry == nullptr) memset((void*)&page, 0, sizeof(Data));
+        else and_words(page, other_entry->value);
+    });
+}
+
+template <typename Data, typename Key>
+void bitmap_difference(LinearProbing<Data, Key>& table, LinearProbing<Data, Key>& other, u64 n_threads = 1){
+    combine_pages(table, other, n_threads, [](Data& page, const auto *other_entry){
+        if (other_entry != nullptr) and_not_words(page, other_entry->value);
+    });
+}
+
+template <typename Data, typename Key>
+void bitmap_union(LinearProbing<Data, Key>& table, LinearProbing<Data, Key>& other, u64 n_threads = 1){
+    std::vector<std::vector<u64>> missing(std::max((u64)(1), n_threads));
+    for_each_range(other.capacity, n_threads, [&](u64 t, u64 begin, u64 end){
+        for (u64 i = begin; i < end; i++){
+            const auto &other_entry = other.table[i];
+            if (other_entry.key == LinearProbing<Data, Key>::EMPTY_CELL) continue;
+            auto *entry = table.get(other_entry.key);
+            if (entry != nullptr) or_words(entry->value, other_entry.value);
+            else missing[t].push_back(i);
+        }
+    });
+    for (const auto& slots : missing){
+        for (u64 i : slots) table.try_emplace(other.table[i].key, other.table[i].value);
+    }
+}
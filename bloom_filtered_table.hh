@@ -0,0 +1,202 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include "util.h"
+#include "memory_usage.hh"
+#include <cstdlib>
+#include <cstring>
+#include "linear_probing.hh"
+#include "cuckoo_hashing.hh"
+#include "compact_linear_probing.hh"
+
+
+// Split block Bloom filter. Each key maps to one cache-line block of eight
+// u64 words and sets one bit in every word, so both insert and lookup touch
+// a single line. With 16 bits per key the false positive rate is ~0.1%.
+struct BlockedBloomFilter {
+
+    static const u64 CACHE_LINE_SIZE = 64;
+    static const u64 WORDS_PER_BLOCK = 8;
+    static const u64 BITS_PER_BLOCK  = 64 * WORDS_PER_BLOCK;
+    static const u64 BITS_PER_KEY    = 16;
+    static const u64 DEFAULT_LOG_N_BLOCKS = 6;
+
+    struct alignas(CACHE_LINE_SIZE) Block {
+        u64 words[WORDS_PER_BLOCK];
+    };
+
+    u64 log_n_blocks;
+    u64 n_blocks;
+    u64 n_keys;
+    u64 max_n_keys;
+    Block *blocks;
+
+    BlockedBloomFilter(u64 log_blocks = DEFAULT_LOG_N_BLOCKS){
+        blocks = nullptr;
+        allocate(log_blocks);
+    }
+
+    ~BlockedBloomFilter(){
+        if (blocks != nullptr) free(blocks);
+    }
+
+    BlockedBloomFilter(const BlockedBloomFilter& other){
+        blocks = nullptr;
+        operator=(other);
+    }
+
+    BlockedBloomFilter& operator=(const BlockedBloomFilter& other){
+        if (&other != this){
+            allocate(other.log_n_blocks);
+            n_keys = other.n_keys;
+            memcpy((void*)blocks, (void*)other.blocks, n_blocks * sizeof(Block));
+        }
+        return *this;
+    }
+
+    // Empties the filter and makes room for 1 << log_blocks blocks
+    void allocate(u64 log_blocks){
+        if (blocks != nullptr) free(blocks);
+        log_n_blocks = log_blocks;
+        n_blocks     = (u64)(1) << log_n_blocks;
+        n_keys       = 0;
+        max_n_keys   = n_blocks * BITS_PER_BLOCK / BITS_PER_KEY;
+        blocks = (Block*)aligned_alloc(CACHE_LINE_SIZE, n_blocks * sizeof(Block));
+        if (!blocks) std::cout << "Allocation of BlockedBloomFilter failed.\n", exit(1);
+        memset((void*)blocks, 0, n_blocks * sizeof(Block));
+    }
+
+    inline bool is_full() const {
+        return n_keys >= max_n_keys;
+    }
+
+    inline Block* block_of(u64 key) const {
+        const u64 a = 0x9E3779B97F4A7C15;
+        return blocks + ((a * key) >> (64 - log_n_blocks));
+    }
+
+    // Bit to set in word w; the salts are odd constants from Impala's filter
+    inline static u64 bit_in_word(u64 key, u64 w){
+        static const u32 SALT[WORDS_PER_BLOCK] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+        };
+        const u64 b = 2349073786287317911;
+        const u32 h = (u32)((b * key) >> 32);
+        return (u32)(h * SALT[w]) >> 26;
+    }
+
+    inline void insert(u64 key){
+        Block *block = block_of(key);
+        for (u64 w = 0; w < WORDS_PER_BLOCK; w++){
+            block->words[w] |= (u64)(1) << bit_in_word(key, w);
+        }
+        n_keys++;
+    }
+
+    inline bool may_contain(u64 key) const {
+        const Block *block = block_of(key);
+        u64 all_set = 1;
+        for (u64 w = 0; w < WORDS_PER_BLOCK; w++){
+            all_set &= block->words[w] >> bit_in_word(key, w);
+        }
+        return all_set & 1;
+    }
+
+    inline void prefetch(u64 key) const {
+        __builtin_prefetch(block_of(key));
+    }
+
+    u64 bytes(){
+        return n_blocks * sizeof(Block);
+    }
+};
+
+
+// Puts a BlockedBloomFilter over the keys of a hash table, so that get() on
+// an absent key usually costs one filter line instead of a probe sequence
+// that runs until an empty slot (the longest path in linear probing).
+// The filter is updated whenever an insert creates a new key, and rebuilt
+// at twice the size from the table's keys when it fills up.
+//
+// Same interface as the tables themselves. Use it through the aliases at
+// the bottom, e.g. PBSEpsilon8WithTable<FilteredLinearProbing>.
+template <template <typename> class HashTable, typename Data>
+struct BloomFilteredTable {
+
+    using Entry   = typename HashTable<Data>::Entry;
+    using KeyType = typename HashTable<Data>::KeyType;
+
+    HashTable<Data> table;
+    BlockedBloomFilter filter;
+    u64 n_elements = 0;
+
+    static std::string name(){
+        return HashTable<Data>::name() + " + bloom filter";
+    }
+
+    inline void key_was_inserted(u64 key){
+        n_elements = table.n_elements;
+        if (filter.is_full()){
+            filter.allocate(filter.log_n_blocks + 1);
+            table.for_each_key([&](u64 k){ filter.insert(k); });
+        }
+        else filter.insert(key);
+    }
+
+    inline Entry* get_or_insert(u64 key, Data& init_if_not_found){
+        Entry *ret = table.get_or_insert(key, init_if_not_found);
+        if (table.n_elements != n_elements) key_was_inserted(key);
+        return ret;
+    }
+
+    template <typename... Args>
+    inline Entry* try_emplace(u64 key, Args&&... args){
+        Entry *ret = table.try_emplace(key, std::forward<Args>(args)...);
+        if (table.n_elements != n_elements) key_was_inserted(key);
+        return ret;
+    }
+
+    // nullptr if not found
+    inline Entry* get(u64 key){
+        if (!filter.may_contain(key)) return nullptr;
+        return table.get(key);
+    }
+
+    inline void prefetch(u64 key){
+        filter.prefetch(key);
+        table.prefetch(key);
+    }
+
+    template <typename F>
+    void for_each(F f){
+        table.for_each(f);
+    }
+
+    template <typename F>
+    void for_each_key(F f){
+        table.for_each_key(f);
+    }
+
+    u64 table_bytes(){
+        return table.table_bytes() + filter.bytes();
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata        += sizeof(*this) - sizeof(table) + filter.bytes();
+        usage.allocator_slack += malloc_overhead(filter.blocks, filter.bytes());
+        return usage;
+    }
+};
+
+template <typename Data>
+using FilteredLinearProbing = BloomFilteredTable<LinearProbing, Data>;
+
+template <typename Data>
+using FilteredCuckoo = BloomFilteredTable<BucketizedCuckoo, Data>;
+
+template <typename Data>
+using FilteredCompactLinearProbing = BloomFilteredTable<CompactLinearProbing, Data>;
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "util.h"
+#include "memory_usage.hh"
+
+
+// A PBS structure with a write buffer for insert-heavy phases, LSM style.
+// Insertions are appended to a small buffer, which stays in cache, and only
+// reach the structure when buffer_size of them have piled up.
+//
+// Structures with insert_batch_in_page (PBSEpsilon8, PBSBitTricks), where x
+// goes to the page of its own id, get the buffer sorted and deduplicated,
+// one run of elements per page, so every page is probed once per flush and
+// in one sweep. Queries read the buffer as it is: the walk only visits the
+// page of the predecessor, which answers with the larger of the structure's
+// predecessor and the buffer's, so the buffer is sorted when a query finds
+// unsorted elements in it, and searched for the predecessor of x.
+//
+// In the others (PBSPageBearerHashing) an insertion can create or split a
+// page, which changes the pages later walks visit, so a query cannot combine
+// the buffer with the structure (see also batch_operations.hh). They get the
+// insertion visits replayed in the order they came in, with the pages of the
+// next visits prefetched, and the buffer is flushed before the first query.
+template <typename pbs_structure>
+struct BufferedPBS {
+
+    static const u64 PREFETCH_DISTANCE = 8;
+
+    static constexpr bool BATCH_INSERTIONS = requires(pbs_structure pbs, const u64 *xs){
+        pbs.insert_batch_in_page(xs, 0, 0);
+    };
+
+    struct Visit {
+        u64 x;
+        u64 id;
+    };
+
+    pbs_structure pbs;
+    u64 buffer_size;
+    std::vector<u64> buffered;  // with BATCH_INSERTIONS, sorted and distinct up to n_sorted
+    u64 n_sorted = 0;
+    std::vector<Visit> pending; // insertion visits to replay, without BATCH_INSERTIONS
+    u64 n_flushes = 0;
+
+    BufferedPBS(u64 buffer_size) : buffer_size(buffer_size) {
+        if (BATCH_INSERTIONS) buffered.reserve(buffer_size);
+        else pending.reserve(buffer_size);
+    }
+
+    std::string name(){
+        return pbs.name() + " (buffer of " + std::to_string(buffer_size) + ")";
+    }
+
+    inline static u64 get_id(u64 x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    // Buffers the visit; the structure gets it on the next flush
+    inline bool try_insert_in_page(u64 x, u64 id){
+        if constexpr (BATCH_INSERTIONS){
+            buffered.push_back(x);
+            if (buffered.size() >= buffer_size) flush();
+        }
+        else {
+            pending.push_back({.x = x, .id = id});
+            // Not in the middle of a walk, which is over at a bearer
+            if (pending.size() >= buffer_size && is_id_page_bearer(id)) flush();
+        }
+        return true;
+    }
+
+    // Merges the elements appended since the last sort into the sorted prefix
+    inline void sort_buffer(){
+        if (n_sorted == buffered.size()) return;
+        std::sort(buffered.begin() + n_sorted, buffered.end());
+        std::inplace_merge(buffered.begin(), buffered.begin() + n_sorted, buffered.end());
+        buffered.erase(std::unique(buffered.begin(), buffered.end()), buffered.end());
+        n_sorted = buffered.size();
+    }
+
+    void flush(){
+        if constexpr (BATCH_INSERTIONS){
+            sort_buffer();
+            const u64 n = buffered.size();
+            u64 begin = 0;
+            while (begin < n){
+                const u64 id = get_id(buffered[begin]);
+                u64 end = begin + 1;
+                while (end < n && get_id(buffered[end]) == id) end++;
+                pbs.insert_batch_in_page(buffered.data() + begin, end - begin, id);
+                begin = end;
+            }
+            buffered.clear();
+            n_sorted = 0;
+        }
+        else {
+            const u64 n = pending.size();
+            for (u64 i = 0; i < n; i++){
+                if (i + PREFETCH_DISTANCE < n) pbs.prefetch_page(pending[i + PREFETCH_DISTANCE].id);
+                pbs.try_insert_in_page(pending[i].x, pending[i].id);
+            }
+            pending.clear();
+        }
+        n_flushes++;
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        if constexpr (BATCH_INSERTIONS){
+            const u64 res = pbs.try_predecessor_in_page(x, id);
+            if (buffered.empty()) return res;
+            sort_buffer();
+            auto pt = std::upper_bound(buffered.begin(), buffered.end(), x);
+            if (pt == buffered.begin()) return res;
+            return std::max(res, *std::prev(pt));
+        }
+        else {
+            if (!pending.empty()) flush();
+            return pbs.try_predecessor_in_page(x, id);
+        }
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = pbs.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(pbs) + buffered.capacity() * sizeof(u64) + pending.capacity() * sizeof(Visit);
+        return usage;
+    }
+};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include "util.h"
+#include "memory_usage.hh"
+#include "linear_probing.hh"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+
+// Inverse of an odd number mod 2^64. Newton iteration, each step doubles the number of correct bits.
+constexpr u64 inverse_mod_2_64(u64 a){
+    u64 inv = a;
+    for (int i = 0; i < 5; i++) inv *= 2 - a * inv;
+    return inv;
+}
+
+
+// Linear probing with quotiented keys (compact hashing, Cleary style).
+//
+// Keys are mapped through a bijection h(x) = a*x mod 2^key_bits. The top
+// log(capacity) bits of h(x) (the quotient) are the home slot, so only the
+// low bits (the remainder) have to be stored. Each slot is a u32:
+//
+//      [ remainder : 24 bits | displacement + 1 : 8 bits ]
+//
+// where displacement is the distance from the home slot, which lets us
+// recover the quotient and thereby the key. 0 means empty. A lookup compares
+// whole u32s, and since the expected word for distance d+1 is the one for
+// distance d plus one, the probe loop is a single compare per slot.
+//
+// The values are stored in a separate array, so a cache line of slots covers
+// 16 keys instead of 4 (Entry with u64 key and u64 value) or 8 (bare u64 keys).
+//
+// The bijection covers key_bits = log(capacity) + 24 bits, so the capacity
+// follows the number of keys only. Keys of more bits (ids of sparse pages
+// far up the universe) go to an overflow LinearProbing table, allocated on
+// the first one, with their full key. When the table grows, key_bits grows
+// with it and the overflow keys that fit now move into the slots, so a key
+// is in the slots exactly if it fits. With the default capacity that is any
+// key below 2^34; a table of mostly larger keys is better off as a
+// LinearProbing.
+//
+// The displacement must fit in 8 bits. Otherwise we grow the table.
+//
+// Same get / get_or_insert interface as LinearProbing, except that Entry only
+// holds the value (the key lives in the slot array).
+template <typename Data>
+struct CompactLinearProbing {
+
+    using KeyType = u64;
+
+    struct Entry {
+        Data value;
+    };
+
+    static const u64 REMAINDER_BITS    = 24;
+    static const u64 DISPLACEMENT_BITS = 8;
+    static const u64 DISPLACEMENT_MASK = (1 << DISPLACEMENT_BITS) - 1;
+    static const u64 MAX_DISPLACEMENT  = DISPLACEMENT_MASK - 1;
+    static const u32 EMPTY_SLOT        = 0;
+    static const u64 MAX_LOG_CAPACITY  = 32;
+    constexpr static const double MAX_FILL_RATIO = 0.8;
+
+    // Odd multiplier and its inverse mod 2^64, so the hash can be inverted
+    static const u64 MULTIPLIER         = 2187650952262969439;
+    static const u64 INVERSE_MULTIPLIER = inverse_mod_2_64(MULTIPLIER);
+
+    static const u64 DEFAULT_LOG_CAPACITY = 10;
+    u64 log_capacity;
+    u64 capacity;
+    u64 mod_capacity_bitmask;
+    u64 key_bits;
+    u64 n_elements;   // in the slots and in overflow
+    u64 max_n_supported;
+    u32 *slots;
+    Entry *values;
+    LinearProbing<Entry> *overflow = nullptr;  // keys of more than key_bits bits
+
+    CompactLinearProbing(){
+        n_elements = 0;
+        allocate_table(DEFAULT_LOG_CAPACITY);
+    }
+
+    ~CompactLinearProbing(){
+        if (slots  != nullptr) free(slots);
+        if (values != nullptr) free(values);
+        delete overflow;
+    }
+
+    CompactLinearProbing(const CompactLinearProbing& other){
+        slots  = nullptr;
+        values = nullptr;
+        operator=(other);
+    }
+
+    CompactLinearProbing& operator=(const CompactLinearProbing& other){
+        if (&other != this){
+            if (slots  != nullptr) free(slots);
+            if (values != nullptr) free(values);
+            delete overflow;
+            n_elements = other.n_elements;
+            allocate_table(other.log_capacity);
+            memcpy((void*)slots, (void*)other.slots, capacity * sizeof(u32));
+            memcpy((void*)values, (void*)other.values, capacity * sizeof(Entry));
+            overflow = other.overflow ? new LinearProbing<Entry>(*other.overflow) : nullptr;
+        }
+        return *this;
+    }
+
+    static std::string name(){
+        return "CompactLinearProbing";
+    }
+
+    void allocate_table(u64 log_cap){
+        if (log_cap > MAX_LOG_CAPACITY){
+            std::cout << "ERROR: CompactLinearProbing would need 2^" << log_cap << " slots. Exiting.\n";
+            exit(1);
+        }
+        log_capacity         = log_cap;
+        key_bits             = std::min(log_capacity + REMAINDER_BITS, (u64)(64));
+        capacity             = (u64)(1) << log_capacity;
+        mod_capacity_bitmask = capacity - 1;
+        max_n_supported      = (u64)(MAX_FILL_RATIO * capacity);
+        slots  = (u32*)calloc(capacity, sizeof(u32));
+        values = (Entry*)malloc(capacity * sizeof(Entry));
+        if (!slots || !values) {
+            std::cout << "Allocation of table failed in CompactLinearProbing.\n", exit(1);
+        }
+    }
+
+    inline static u64 bits_needed(u64 key){
+        return key == 0 ? 1 : 64 - __builtin_clzll(key);
+    }
+
+    inline bool fits(u64 key) const {
+        return bits_needed(key) <= key_bits;
+    }
+
+    inline u64 n_overflow() const {
+        return overflow ? overflow->n_elements : 0;
+    }
+
+    inline u64 key_mask() const {
+        return key_bits == 64 ? ~(u64)(0) : ((u64)(1) << key_bits) - 1;
+    }
+
+    inline u64 remainder_bits() const {
+        return key_bits - log_capacity;
+    }
+
+    inline u64 hash(u64 key) const {
+        return (MULTIPLIER * key) & key_mask();
+    }
+
+    inline u64 home_slot(u64 h) const {
+        return h >> remainder_bits();
+    }
+
+    // The slot word we expect at displacement 0
+    inline u32 base_slot_word(u64 h) const {
+        const u64 remainder = h & (((u64)(1) << remainder_bits()) - 1);
+        return (u32)((remainder << DISPLACEMENT_BITS) | 1);
+    }
+
+    inline u64 recover_key(u64 slot_i) const {
+        const u32 word         = slots[slot_i];
+        const u64 displacement = (word & DISPLACEMENT_MASK) - 1;
+        const u64 quotient     = (slot_i - displacement) & mod_capacity_bitmask;
+        const u64 remainder    = word >> DISPLACEMENT_BITS;
+        const u64 h            = (quotient << remainder_bits()) | remainder;
+        return (h * INVERSE_MULTIPLIER) & key_mask();
+    }
+
+    // Rebuilds the table with 1 << new_log_capacity slots. Keys are decoded
+    // with the old parameters and re-encoded with the new ones, together with
+    // the overflow keys that fit the larger key_bits.
+    void rebuild(u64 new_log_capacity){
+        u32 *old_slots         = slots;
+        Entry *old_values      = values;
+        const u64 old_capacity = capacity;
+
+        std::vector<std::pair<u64, Entry>> moving;
+        moving.reserve(n_elements - n_overflow());
+        for (u64 i = 0; i < old_capacity; i++){
+            if (old_slots[i] != EMPTY_SLOT) moving.push_back({recover_key(i), old_values[i]});
+        }
+        free(old_slots);
+        free(old_values);
+
+        while (true){
+            allocate_table(new_log_capacity);
+
+            bool ok = true;
+            for (u64 i = 0; i < moving.size() && ok; i++){
+                Entry *dest = insert_new(moving[i].first);
+                if (dest == nullptr) ok = false;
+                else *dest = moving[i].second;
+            }
+            if (overflow != nullptr){
+                overflow->for_each([&](auto& entry){
+                    if (!ok || !fits(entry.key)) return;
+                    Entry *dest = insert_new(entry.key);
+                    if (dest == nullptr) ok = false;
+                    else *dest = entry.value;
+                });
+            }
+            if (ok) break;
+
+            // Some run got too long for the displacement field, try again with more room
+            free(slots);
+            free(values);
+            new_log_capacity++;
+        }
+
+        if (overflow != nullptr) overflow->erase_if([&](auto& entry){ return fits(entry.key); });
+    }
+
+    void resize_table(){
+        rebuild(log_capacity + 1);
+    }
+
+    // Claims a slot for a key that is not in the table. nullptr if the
+    // displacement would not fit in the slot.
+    inline Entry* insert_new(u64 key){
+        const u64 h = hash(key);
+        u64 current = home_slot(h);
+        u32 word    = base_slot_word(h);
+        for (u64 d = 0; d <= MAX_DISPLACEMENT; d++){
+            if (slots[current] == EMPTY_SLOT){
+                slots[current] = word;
+                return values + current;
+            }
+            word++;
+            current = (current + 1) & mod_capacity_bitmask;
+        }
+        return nullptr;
+    }
+
+    // Gets the entry, or inserts a new one if it's not in the table
+    inline Entry* get_or_insert(u64 key, Data& init_if_not_found){
+        return try_emplace(key, init_if_not_found);
+    }
+
+    // Gets the entry, or inserts a new one whose value is constructed in
+    // place from args. Nothing is constructed if the key exists.
+    template <typename... Args>
+    inline Entry* try_emplace(u64 key, Args&&... args){
+        if (!fits(key)){
+            if (overflow == nullptr) overflow = new LinearProbing<Entry>();
+            const u64 n_before = overflow->n_elements;
+            Entry *ret = &overflow->try_emplace(key, std::forward<Args>(args)...)->value;
+            n_elements += overflow->n_elements - n_before;
+            return ret;
+        }
+        const u64 h = hash(key);
+        u64 current = home_slot(h);
+        u32 word    = base_slot_word(h);
+        for (u64 d = 0; d <= MAX_DISPLACEMENT; d++){
+            const u32 tmp = slots[current];
+            if (tmp == word) return values + current;
+            if (tmp == EMPTY_SLOT){
+                // Only a new key grows the table, so entries only move when n_elements grows
+                if (n_elements - n_overflow() >= max_n_supported){
+                    resize_table();
+                    return try_emplace(key, std::forward<Args>(args)...);
+                }
+                slots[current] = word;
+                new (&values[current].value) Data(std::forward<Args>(args)...);
+                n_elements++;
+                return values + current;
+            }
+            word++;
+            current = (current + 1) & mod_capacity_bitmask;
+        }
+
+        // The run is longer than what the displacement field can express
+        resize_table();
+        return try_emplace(key, std::forward<Args>(args)...);
+    }
+
+    // Starts loading the home slot and its value, so that a later get(key) is a cache hit
+    inline void prefetch(u64 key){
+        if (!fits(key)) return;
+        const u64 home = home_slot(hash(key));
+        __builtin_prefetch(slots + home);
+        __builtin_prefetch(values + home);
+    }
+
+    // nullptr if not found
+    inline Entry* get(u64 key){
+        if (!fits(key)){
+            if (overflow == nullptr) return nullptr;
+            auto *entry = overflow->get(key);
+            return entry ? &entry->value : nullptr;
+        }
+
+        const u64 h = hash(key);
+        u64 current = home_slot(h);
+        u32 word    = base_slot_word(h);
+        for (u64 d = 0; d <= MAX_DISPLACEMENT; d++){
+            const u32 tmp = slots[current];
+            if (tmp == word) return values + current;
+            if (tmp == EMPTY_SLOT) return nullptr;
+            word++;
+            current = (current + 1) & mod_capacity_bitmask;
+        }
+        return nullptr;
+    }
+
+    template <typename F>
+    void for_each(F f){
+        for (u64 i = 0; i < capacity; i++){
+            if (slots[i] != EMPTY_SLOT) f(values[i]);
+        }
+        if (overflow != nullptr) overflow->for_each([&](auto& entry){ f(entry.value); });
+    }
+
+    template <typename F>
+    void for_each_key(F f){
+        for (u64 i = 0; i < capacity; i++){
+            if (slots[i] != EMPTY_SLOT) f(recover_key(i));
+        }
+        if (overflow != nullptr) overflow->for_each([&](auto& entry){ f(entry.key); });
+    }
+
+    u64 table_bytes(){
+        return capacity * (sizeof(u32) + sizeof(Entry)) + (overflow ? overflow->table_bytes() : 0);
+    }
+
+    MemoryUsage memory_usage(){
+        const u64 n_in_slots = n_elements - n_overflow();
+        MemoryUsage usage;
+        usage.index_table     = capacity * sizeof(u32);
+        usage.page_payload    = n_in_slots * sizeof(Entry);
+        usage.allocator_slack = (capacity - n_in_slots) * sizeof(Entry)
+                              + malloc_overhead(slots, capacity * sizeof(u32))
+                              + malloc_overhead(values, capacity * sizeof(Entry));
+        usage.metadata        = sizeof(*this);
+        if (overflow != nullptr) usage += overflow->memory_usage();
+        return usage;
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdlib>
+#include <cstring>
+#include "util.h"
+#include "memory_usage.hh"
+
+
+// Read-only encoding of the elements of a cold page: sorted, as fixed-width
+// offsets from the smallest element (frame of reference), with 1, 2 or 4
+// bytes per offset depending on the range of the page.
+//
+// The elements of a page lie in a narrow range above its bearer, so a u64
+// per element is mostly zeros. We use fixed widths rather than Elias-Fano
+// because predecessor is then a branch-free count of the offsets <= x - base,
+// which the compiler vectorizes, followed by one load. Pages whose range does
+// not fit in 32 bits are left as they are.
+//
+// Pages with writes are never packed: the structure unpacks a page into its
+// vector before writing to it, and packs pages again once they are cold.
+template <typename Key = u64>
+struct PackedElements {
+
+    Key base  = 0;
+    u32 n     = 0;
+    u32 width = 0; // bytes per offset, 0 if nothing is packed
+    u8 *bytes = nullptr;
+
+    PackedElements(){}
+
+    ~PackedElements(){
+        clear();
+    }
+
+    PackedElements(const PackedElements& other) = delete;
+    PackedElements& operator=(const PackedElements& other) = delete;
+
+    PackedElements(PackedElements&& other){
+        operator=(std::move(other));
+    }
+
+    PackedElements& operator=(PackedElements&& other){
+        if (&other != this){
+            clear();
+            base  = other.base;
+            n     = other.n;
+            width = other.width;
+            bytes = other.bytes;
+            other.n     = 0;
+            other.width = 0;
+            other.bytes = nullptr;
+        }
+        return *this;
+    }
+
+    inline bool is_packed() const {
+        return width != 0;
+    }
+
+    void clear(){
+        if (bytes != nullptr) free(bytes);
+        bytes = nullptr;
+        n     = 0;
+        width = 0;
+    }
+
+    u64 payload_bytes() const {
+        return (u64)n * width;
+    }
+
+    // Packs elements, which are left empty. Returns false, and leaves
+    // everything as it was, if there is nothing to pack or the range is too wide.
+    bool pack(std::vector<Key>& elements){
+        if (elements.empty()) return false;
+        std::sort(elements.begin(), elements.end());
+        const Key range = elements.back() - elements.front();
+        const u32 new_width = range <= 0xFF ? 1 : range <= 0xFFFF ? 2 : range <= 0xFFFFFFFF ? 4 : 0;
+        if (new_width == 0) return false;
+
+        clear();
+        base  = elements.front();
+        n     = elements.size();
+        width = new_width;
+        bytes = (u8*)malloc(payload_bytes());
+        if (!bytes) std::cout << "Allocation of PackedElements failed.\n", exit(1);
+        switch (width){
+            case 1: store_offsets((u8*)bytes, elements);  break;
+            case 2: store_offsets((u16*)bytes, elements); break;
+            case 4: store_offsets((u32*)bytes, elements); break;
+        }
+
+        elements.clear();
+        elements.shrink_to_fit();
+        return true;
+    }
+
+    // Appends the elements to `elements` and empties the packed page
+    void unpack(std::vector<Key>& elements){
+        elements.reserve(elements.size() + n);
+        for (u32 i = 0; i < n; i++) elements.push_back(base + offset(i));
+        clear();
+    }
+
+    // Largest element <= x, 0 if there is none
+    inline Key predecessor(Key x) const {
+        if (x < base) return 0;
+        const Key target = x - base;
+        u64 count;
+        switch (width){
+            case 1:  count = count_at_most((const u8*)bytes, target);  break;
+            case 2:  count = count_at_most((const u16*)bytes, target); break;
+            default: count = count_at_most((const u32*)bytes, target); break;
+        }
+        return base + offset(count - 1);
+    }
+
+    inline u64 offset(u64 i) const {
+        switch (width){
+            case 1:  return ((const u8*)bytes)[i];
+            case 2:  return ((const u16*)bytes)[i];
+            default: return ((const u32*)bytes)[i];
+        }
+    }
+
+    template <typename T>
+    inline void store_offsets(T *offsets, const std::vector<Key>& elements){
+        for (u32 i = 0; i < n; i++) offsets[i] = (T)(elements[i] - base);
+    }
+
+    // Number of offsets <= target. No early exit, so the loop vectorizes.
+    template <typename T>
+    inline u64 count_at_most(const T *offsets, Key target) const {
+        if (target >= (Key)(T)(~(T)(0))) return n;
+        const T t = (T)target;
+        u64 count = 0;
+        for (u32 i = 0; i < n; i++) count += offsets[i] <= t;
+        return count;
+    }
+};
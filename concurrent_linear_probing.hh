@@ -0,0 +1,292 @@
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include "util.h"
+#include "memory_usage.hh"
+#include "key_traits.hh"
+
+
+// Lock-free variant of LinearProbing for bitmap pages, where the only write
+// to a value is setting bits. Data is a whole number of u64 words, and every
+// value starts out as all zero bits.
+//
+//  - Inserting a new key claims its slot with a CAS on the key; setting
+//    bits is a fetch_or on one word of the value.
+//  - Readers are wait-free: they probe without writing anything and copy
+//    the words of the value out with atomic loads.
+//  - Resizing is cooperative. The writer that finds the table full links a
+//    table of twice the capacity as `next`, and every writer that then
+//    comes along claims chunks of the old table and moves them over before
+//    going on with its own insertion in the new table. Empty slots of a
+//    table being moved are sealed with MOVED, so keys can no longer be
+//    claimed there. Nobody waits for the move to finish.
+//
+// Setting bits is idempotent, which is what makes this simple: an entry is
+// moved by ORing its words into the new table, and a writer that set bits in
+// the old table checks `next` afterwards (fetch_or and the load of next are
+// both seq_cst, as are the link of next and the loads of the mover) and ORs
+// them into the new table as well if a move has started. A key can thus be
+// in more than one table while they are being moved, with part of its bits
+// in each, so readers OR the value over the whole chain of tables starting
+// at the current one.
+//
+// Old tables may still be read after the move and are only freed by the
+// destructor or reclaim_old_tables(), when no other thread uses the table.
+// Keys must be below MOVED, which page ids of the bitmap structures are.
+template <typename Data>
+struct ConcurrentLinearProbing {
+
+    static_assert(std::is_trivially_copyable<Data>::value, "ConcurrentLinearProbing needs trivially copyable values");
+    static_assert(sizeof(Data) % sizeof(u64) == 0, "ConcurrentLinearProbing values are u64 words");
+
+    using KeyType = u64;
+
+    struct Entry {
+        u64 key;
+        Data value;
+    };
+
+    static const u64 WORDS = sizeof(Data) / sizeof(u64);
+    static constexpr u64 EMPTY_CELL = KeyTraits<u64>::ALL_ONES;
+    static constexpr u64 MOVED      = EMPTY_CELL - 1;
+    constexpr static const double MAX_FILL_RATIO = 0.8;
+
+    static const u64 DEFAULT_CAPACITY = (1 << 10);
+    static const u64 CHUNK_SIZE       = (1 << 10);  // slots moved per claim, a power of two
+
+    // One generation of the table
+    struct Slots {
+        u64 capacity;
+        u64 mod_capacity_bitmask;
+        u64 max_n_supported;
+        u64 n_chunks;
+        Entry *entries;
+        std::atomic<u64> n_claimed     = 0;
+        std::atomic<Slots*> next       = nullptr;
+        std::atomic<u64> next_chunk    = 0;
+        std::atomic<u64> n_chunks_done = 0;
+
+        Slots(u64 capacity){
+            this->capacity             = capacity;
+            this->mod_capacity_bitmask = capacity - 1;
+            this->max_n_supported      = (u64)(MAX_FILL_RATIO * capacity);
+            this->n_chunks             = (capacity + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            entries = (Entry*)malloc(capacity * sizeof(Entry));
+            if (!entries) std::cout << "Allocation of ConcurrentLinearProbing table failed.\n", exit(1);
+            memset((void*)entries, 0, capacity * sizeof(Entry));
+            for (u64 i = 0; i < capacity; i++) entries[i].key = EMPTY_CELL;
+        }
+
+        ~Slots(){
+            free(entries);
+        }
+
+        inline bool is_moved() const {
+            return n_chunks_done.load() == n_chunks;
+        }
+    };
+
+    std::atomic<Slots*> current;
+    Slots *oldest;  // start of the chain of generations, for freeing them
+
+    ConcurrentLinearProbing(){
+        oldest = new Slots(DEFAULT_CAPACITY);
+        current.store(oldest);
+    }
+
+    ~ConcurrentLinearProbing(){
+        free_generations_before(nullptr);
+    }
+
+    ConcurrentLinearProbing(const ConcurrentLinearProbing& other) = delete;
+    ConcurrentLinearProbing& operator=(const ConcurrentLinearProbing& other) = delete;
+
+    static std::string name(){
+        return "ConcurrentLinearProbing";
+    }
+
+    inline static u64 hash(u64 x) {
+        return KeyTraits<u64>::hash(x);
+    }
+
+    inline static u64* words_of(Entry *entry){
+        return (u64*)&entry->value;
+    }
+
+    // Sets bits in word `word` of the value of key, inserting key if needed
+    inline void set_bits(u64 key, u64 word, u64 bits){
+        or_into(current.load(std::memory_order_acquire), key, word, &bits, 1);
+    }
+
+    // ORs bits[0..n_words) into the words of the value of key from first_word
+    // on, in slots and in every table linked after it at the time.
+    void or_into(Slots *slots, u64 key, u64 first_word, const u64 *bits, u64 n_words){
+        while (true){
+            Entry *entry = find_or_claim(slots, key);
+            if (entry != nullptr){
+                u64 *words = words_of(entry);
+                for (u64 i = 0; i < n_words; i++){
+                    if (bits[i]) __atomic_fetch_or(words + first_word + i, bits[i], __ATOMIC_SEQ_CST);
+                }
+            }
+            Slots *next = slots->next.load();
+            if (next == nullptr) return;
+            help_move(slots);
+            slots = next;
+        }
+    }
+
+    // The entry of key in slots, claiming an empty slot for it if needed.
+    // nullptr if slots is being moved, in which case slots->next is set.
+    inline Entry* find_or_claim(Slots *slots, u64 key){
+        u64 current_slot = hash(key) & slots->mod_capacity_bitmask;
+        while (true){
+            Entry *entry = slots->entries + current_slot;
+            u64 found = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+            if (found == EMPTY_CELL){
+                if (slots->n_claimed.load(std::memory_order_relaxed) >= slots->max_n_supported){
+                    start_move(slots);
+                    return nullptr;
+                }
+                if (__atomic_compare_exchange_n(&entry->key, &found, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                    slots->n_claimed.fetch_add(1, std::memory_order_relaxed);
+                    return entry;
+                }
+                // Lost the slot to another key or to the mover, look again
+            }
+            if (found == key)   return entry;
+            if (found == MOVED) return nullptr;
+            if (found != EMPTY_CELL) current_slot = (current_slot + 1) & slots->mod_capacity_bitmask;
+        }
+    }
+
+    // Links a table of twice the capacity after slots, unless someone did already
+    void start_move(Slots *slots){
+        if (slots->next.load() != nullptr) return;
+        Slots *bigger = new Slots(slots->capacity * 2);
+        Slots *expected = nullptr;
+        if (!slots->next.compare_exchange_strong(expected, bigger)) delete bigger;
+    }
+
+    // Moves chunks of slots until none are left to claim. Does not wait for
+    // the chunks other threads are moving.
+    void help_move(Slots *slots){
+        Slots *next = slots->next.load();
+        while (true){
+            const u64 chunk = slots->next_chunk.fetch_add(1);
+            if (chunk >= slots->n_chunks) break;
+            move_chunk(slots, next, chunk);
+            slots->n_chunks_done.fetch_add(1);
+        }
+        advance_current();
+    }
+
+    void move_chunk(Slots *slots, Slots *next, u64 chunk){
+        const u64 end = std::min(slots->capacity, (chunk + 1) * CHUNK_SIZE);
+        for (u64 i = chunk * CHUNK_SIZE; i < end; i++){
+            Entry *entry = slots->entries + i;
+            u64 key = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+            if (key == EMPTY_CELL && __atomic_compare_exchange_n(&entry->key, &key, MOVED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+
+            // key was claimed, maybe just now. Writers that set bits after
+            // we read them see next and set them in the new table too.
+            u64 bits[WORDS];
+            bool any = false;
+            for (u64 w = 0; w < WORDS; w++){
+                bits[w] = __atomic_load_n(words_of(entry) + w, __ATOMIC_SEQ_CST);
+                any |= bits[w] != 0;
+            }
+            if (any) or_into(next, key, 0, bits, WORDS);
+        }
+    }
+
+    // Makes the first table that is not completely moved the current one
+    void advance_current(){
+        Slots *slots = current.load();
+        while (slots->next.load() != nullptr && slots->is_moved()){
+            Slots *next = slots->next.load();
+            if (current.compare_exchange_strong(slots, next)) slots = next;
+        }
+    }
+
+    // Entry of key in slots, nullptr if not found. Does not write.
+    inline static Entry* find(Slots *slots, u64 key){
+        u64 current_slot = hash(key) & slots->mod_capacity_bitmask;
+        while (true){
+            Entry *entry = slots->entries + current_slot;
+            const u64 found = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+            if (found == key) return entry;
+            if (found == EMPTY_CELL || found == MOVED) return nullptr;
+            current_slot = (current_slot + 1) & slots->mod_capacity_bitmask;
+        }
+    }
+
+    // Copies the value of key into value, false if key is not in the table.
+    // Wait-free: never writes and never waits for writers.
+    inline bool load(u64 key, Data& value){
+        u64 *words = (u64*)&value;
+        for (u64 w = 0; w < WORDS; w++) words[w] = 0;
+        bool found = false;
+        for (Slots *slots = current.load(std::memory_order_acquire); slots != nullptr; slots = slots->next.load(std::memory_order_acquire)){
+            Entry *entry = find(slots, key);
+            if (entry == nullptr) continue;
+            found = true;
+            for (u64 w = 0; w < WORDS; w++) words[w] |= __atomic_load_n(words_of(entry) + w, __ATOMIC_RELAXED);
+        }
+        return found;
+    }
+
+    inline void prefetch(u64 key){
+        Slots *slots = current.load(std::memory_order_relaxed);
+        __builtin_prefetch(slots->entries + (hash(key) & slots->mod_capacity_bitmask));
+    }
+
+    // Number of keys. Exact when no move is in progress.
+    u64 size(){
+        Slots *slots = current.load();
+        while (slots->next.load() != nullptr) slots = slots->next.load();
+        return slots->n_claimed.load();
+    }
+
+    // Frees the tables before the current one. Only while no other thread
+    // uses the table, since readers may still be in an old one.
+    void reclaim_old_tables(){
+        free_generations_before(current.load());
+    }
+
+    void free_generations_before(Slots *stop){
+        while (oldest != stop){
+            Slots *next = oldest->next.load();
+            delete oldest;
+            oldest = next;
+        }
+    }
+
+    // Keys count as index, values of claimed slots as payload. Old tables
+    // that are not reclaimed yet count as slack.
+    MemoryUsage memory_usage(){
+        MemoryUsage usage;
+        usage.metadata = sizeof(*this);
+        Slots *newest = current.load();
+        while (newest->next.load() != nullptr) newest = newest->next.load();
+        for (Slots *slots = oldest; slots != nullptr; slots = slots->next.load()){
+            const u64 bytes = slots->capacity * sizeof(Entry);
+            usage.metadata += sizeof(Slots) + malloc_overhead(slots, sizeof(Slots));
+            if (slots != newest){
+                usage.allocator_slack += bytes + malloc_overhead(slots->entries, bytes);
+                continue;
+            }
+            const u64 value_bytes = sizeof(Entry) - sizeof(u64);
+            const u64 n_used      = slots->n_claimed.load();
+            usage.index_table     += slots->capacity * sizeof(u64);
+            usage.page_payload    += n_used * value_bytes;
+            usage.allocator_slack += (slots->capacity - n_used) * value_bytes + malloc_overhead(slots->entries, bytes);
+        }
+        return usage;
+    }
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include "util.h"
+#include "concurrent_linear_probing.hh"
+#include "pbs_bit_tricks.hh"
+
+
+// PBSBitTricks for many threads inserting and querying at once. The pages are
+// the same LargeWords, kept in a ConcurrentLinearProbing: an insertion sets
+// one bit of one word with fetch_or (claiming the page with a CAS if it is
+// new), and a query copies the page out with atomic loads and answers from
+// the copy, without taking any lock.
+//
+// With epsilon = 8 a page is a single word, as in PBSEpsilon8.
+template <u64 epsilon>
+struct ConcurrentPBSBitTricks {
+
+    using Sequential = PBSBitTricks<epsilon>;
+    using LargeWord  = typename Sequential::LargeWord;
+
+    static const u64 bits_per_word = Sequential::bits_per_word;
+
+    ConcurrentLinearProbing<LargeWord> table;
+
+    ConcurrentPBSBitTricks(){};
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << "ConcurrentPBSBitTricks<" << epsilon << ">";
+        return sstm.str();
+    }
+
+    inline static u64 get_id(u64 x){
+        return Sequential::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return Sequential::is_id_page_bearer(id);
+    }
+
+    inline bool try_insert_in_page(u64 x, u64){
+        const u64 index = Sequential::get_index_in_page(x);
+        table.set_bits(get_id(x), index / bits_per_word, (u64)(1) << (index % bits_per_word));
+        return true;
+    }
+
+    inline void prefetch_page(u64 id){
+        table.prefetch(id);
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        LargeWord page;
+        if (!table.load(id, page)) return 0;
+
+        u64 index_of_pred = get_id(x) > id ?
+                            page.get_largest() :
+                            page.predecessor(Sequential::get_index_in_page(x));
+
+        return Sequential::recover_element(id) + index_of_pred;
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(table);
+        return usage;
+    }
+};
+
+using ConcurrentPBSEpsilon8 = ConcurrentPBSBitTricks<8>;
+
+
+// Baseline for the concurrent structures: any PBS structure behind a
+// reader-writer lock. Insertions take it exclusively, queries shared.
+template <typename pbs_structure>
+struct MutexPBS {
+
+    pbs_structure pbs;
+    std::shared_mutex mutex;
+
+    MutexPBS(){};
+
+    std::string name(){
+        return pbs.name() + " (mutex)";
+    }
+
+    inline static u64 get_id(u64 x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    inline bool try_insert_in_page(u64 x, u64 id){
+        std::unique_lock lock(mutex);
+        return pbs.try_insert_in_page(x, id);
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        std::shared_lock lock(mutex);
+        return pbs.try_predecessor_in_page(x, id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = pbs.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(pbs);
+        return usage;
+    }
+};
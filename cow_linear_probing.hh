@@ -0,0 +1,216 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <type_traits>
+#include "util.h"
+#include "memory_usage.hh"
+#include "key_traits.hh"
+#include "linear_probing.hh"
+
+
+// Linear probing whose slots are split into segments of SEGMENT_SIZE entries,
+// each behind a reference count (shared_ptr). Copying the table copies the
+// segment pointers only, O(capacity / SEGMENT_SIZE), and the copy shares the
+// segments until one side writes to them: a write to a segment that another
+// copy still holds copies that segment first. This gives the PBS structures
+// cheap snapshots (see their snapshot()) that stay consistent while the
+// original keeps taking inserts, and that are released by dropping them.
+//
+// Writes go through get_or_insert() and try_emplace() only; get() and
+// for_each() are for reading, and their entries may be shared with a
+// snapshot. Entries move when their segment is copied, which n_moves counts
+// so that a PageFinger on the table drops the entries it cached.
+//
+// A snapshot may be read and released on another thread, but it must be
+// taken on the thread that writes to the table.
+template <typename Data, typename Key = u64>
+struct CowLinearProbing {
+
+    static_assert(std::is_trivially_copyable<Data>::value, "CowLinearProbing needs trivially copyable values");
+
+    using KeyType = Key;
+
+    struct Entry {
+        Key key;
+        Data value;
+    };
+
+    static constexpr Key EMPTY_CELL = KeyTraits<Key>::ALL_ONES;
+    constexpr static const double MAX_FILL_RATIO = 0.8;
+
+    static const u64 LOG_SEGMENT_SIZE = 9;
+    static const u64 SEGMENT_SIZE     = (1 << LOG_SEGMENT_SIZE);
+    static const u64 DEFAULT_CAPACITY = (1 << 10);
+    static_assert(DEFAULT_CAPACITY >= SEGMENT_SIZE, "The table must have whole segments");
+    static const u64 SEGMENT_CONTROL_BLOCK_BYTES = 32; // shared_ptr's, with its malloc header
+
+    struct Segment {
+        Entry entries[SEGMENT_SIZE];
+
+        Segment(){
+            memset((void*)entries, (unsigned char)EMPTY_CELL, sizeof(entries));
+        }
+    };
+
+    std::vector<std::shared_ptr<Segment>> segments;
+    u64 capacity;
+    u64 mod_capacity_bitmask;
+    u64 n_elements = 0;
+    u64 max_n_supported;
+
+    // Segments copied because a snapshot held them, and entry moves for
+    // PageFinger: segment copies and resizes
+    u64 n_segment_copies = 0;
+    u64 n_moves          = 0;
+
+    CowLinearProbing(){
+        allocate(DEFAULT_CAPACITY);
+    }
+
+    static std::string name(){
+        if (sizeof(Key) != sizeof(u64)) return "CowLinearProbing<" + KeyTraits<Key>::name() + " keys>";
+        return "CowLinearProbing";
+    }
+
+    void allocate(u64 new_capacity){
+        capacity             = new_capacity;
+        mod_capacity_bitmask = capacity - 1;
+        max_n_supported      = (u64)(MAX_FILL_RATIO * capacity);
+        segments.clear();
+        for (u64 s = 0; s < capacity / SEGMENT_SIZE; s++) segments.emplace_back(new Segment);
+    }
+
+    inline static u64 hash(Key x) {
+        return KeyTraits<Key>::hash(x);
+    }
+
+    inline Entry& slot(u64 i){
+        return segments[i >> LOG_SEGMENT_SIZE]->entries[i & (SEGMENT_SIZE - 1)];
+    }
+
+    // The segment of slot i, copied first if a snapshot holds it too. The
+    // acquire fence orders our writes after the reads of snapshots that
+    // released it on other threads.
+    inline Segment& writable_segment(u64 i){
+        std::shared_ptr<Segment> &segment = segments[i >> LOG_SEGMENT_SIZE];
+        if (segment.use_count() > 1){
+            segment.reset(new Segment(*segment));
+            n_segment_copies++;
+            n_moves++;
+        }
+        else std::atomic_thread_fence(std::memory_order_acquire);
+        return *segment;
+    }
+
+    // Doubles the table into new segments. Snapshots keep the old ones.
+    void resize_table(){
+        std::vector<std::shared_ptr<Segment>> old_segments;
+        old_segments.swap(segments);
+        allocate(capacity * 2);
+        n_moves++;
+        for (const auto& segment : old_segments){
+            for (const Entry& old_entry : segment->entries){
+                if (old_entry.key == EMPTY_CELL) continue;
+                u64 current = hash(old_entry.key) & mod_capacity_bitmask;
+                while (slot(current).key != EMPTY_CELL) current = (current + 1) & mod_capacity_bitmask;
+                slot(current) = old_entry;
+            }
+        }
+    }
+
+    // Gets the entry, or inserts a new one if it's not in the table
+    inline Entry* get_or_insert(Key key, Data& init_if_not_found){
+        bool inserted;
+        Entry *ret = find_or_claim_slot(key, inserted);
+        if (inserted) new (&ret->value) Data(init_if_not_found);
+        return ret;
+    }
+
+    template <typename... Args>
+    inline Entry* try_emplace(Key key, Args&&... args){
+        bool inserted;
+        Entry *ret = find_or_claim_slot(key, inserted);
+        if (inserted) new (&ret->value) Data(std::forward<Args>(args)...);
+        return ret;
+    }
+
+    // The entry of key, or an empty slot claimed for it, in a segment that
+    // only this table holds
+    inline Entry* find_or_claim_slot(Key key, bool& inserted){
+        u64 current = hash(key) & mod_capacity_bitmask;
+        while (slot(current).key != key && slot(current).key != EMPTY_CELL) current = (current + 1) & mod_capacity_bitmask;
+        // Resizes for new keys only, like LinearProbing
+        if (slot(current).key == EMPTY_CELL && n_elements >= max_n_supported){
+            resize_table();
+            current = hash(key) & mod_capacity_bitmask;
+            while (slot(current).key != EMPTY_CELL) current = (current + 1) & mod_capacity_bitmask;
+        }
+        Entry *ret = writable_segment(current).entries + (current & (SEGMENT_SIZE - 1));
+        inserted = ret->key == EMPTY_CELL;
+        if (inserted){
+            ret->key = key;
+            n_elements++;
+        }
+        return ret;
+    }
+
+    inline void prefetch(Key key){
+        __builtin_prefetch(&slot(hash(key) & mod_capacity_bitmask));
+    }
+
+    // nullptr if not found
+    inline Entry* get(Key key){
+        u64 current = hash(key) & mod_capacity_bitmask;
+        while (true){
+            Entry &entry = slot(current);
+            if (entry.key == key) return &entry;
+            if (entry.key == EMPTY_CELL) return nullptr;
+            current = (current + 1) & mod_capacity_bitmask;
+        }
+    }
+
+    u64 table_bytes(){
+        return capacity * sizeof(Entry);
+    }
+
+    // As for LinearProbing; the segment pointers and their reference counts
+    // are metadata. Segments shared with snapshots are counted in full.
+    // Segments are allocated with new rather than make_shared, so that
+    // malloc_overhead() gets the start of their allocation.
+    MemoryUsage memory_usage(){
+        const u64 value_bytes = sizeof(Entry) - sizeof(Key);
+        MemoryUsage usage;
+        usage.index_table     = capacity * sizeof(Key);
+        usage.page_payload    = n_elements * value_bytes;
+        usage.allocator_slack = (capacity - n_elements) * value_bytes;
+        for (const auto& segment : segments) usage.allocator_slack += malloc_overhead(segment.get(), sizeof(Segment));
+        usage.metadata        = sizeof(*this) + segments.capacity() * sizeof(std::shared_ptr<Segment>)
+                              + segments.size() * SEGMENT_CONTROL_BLOCK_BYTES;
+        return usage;
+    }
+
+    template <typename F>
+    void for_each(F f){
+        for (auto& segment : segments){
+            for (Entry& entry : segment->entries){
+                if (entry.key != EMPTY_CELL) f(entry);
+            }
+        }
+    }
+
+    template <typename F>
+    void for_each_key(F f){
+        for_each([&](Entry& entry){ f(entry.key); });
+    }
+};
+
+
+template <typename Data, typename Key>
+struct PageIndexFor<CowLinearProbing, Data, Key> {
+    using type = CowLinearProbing<Data, Key>;
+};
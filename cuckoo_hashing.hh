@@ -0,0 +1,389 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include "util.h"
+#include "memory_usage.hh"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+
+// Bucketized cuckoo hashing with two hash functions and a small stash.
+// Every key lives in one of its two buckets (or in the stash), so a lookup
+// touches at most two buckets no matter how full the table is. A bucket is
+// one cache line, in one of two layouts depending on the entry size:
+//
+//  - entries of up to 16 bytes, e.g. (page id, u64 bitmap) in PBSEpsilon8,
+//    are stored in the bucket, 4 to a line, so a hit reads one line.
+//  - larger entries (PBSBitTricks with 64 or more bits per page) would make
+//    a bucket span several lines. The bucket keeps the 8 keys only, and the
+//    entries sit in a separate array in the same slot order, so a lookup
+//    scans at most two lines of keys and reads the entry of the hit.
+//    Entries keep their key too, for get() to return (key, value).
+//
+// If both buckets of a new key are full, we BFS for a short cuckoo path and
+// move the entries along it. If there is no such path the entry goes into
+// the stash, and the table doubles once the stash is full. The stash is only
+// scanned when it is non-empty, which it rarely is.
+//
+// Same get / get_or_insert interface as LinearProbing, so it can be used as
+// the page index of the PBS structures.
+template <typename Data>
+struct BucketizedCuckoo {
+
+    using KeyType = u64;
+
+    struct Entry {
+        u64 key;
+        Data value;
+    };
+
+    static const u64 ALL_ONES   = 0xFFFFFFFFFFFFFFFF;
+    static const u64 EMPTY_CELL = ALL_ONES;
+    constexpr static const double MAX_FILL_RATIO = 0.9;
+
+    static const u64 CACHE_LINE_SIZE  = 64;
+    static constexpr bool INLINE_ENTRIES = 4 * sizeof(Entry) <= CACHE_LINE_SIZE;
+    static const u64 SLOTS_PER_BUCKET = CACHE_LINE_SIZE / (INLINE_ENTRIES ? sizeof(Entry) : sizeof(u64));
+    static const u64 STASH_SIZE       = 8;
+    static const u64 MAX_PATH_LENGTH  = 5;
+    static const u64 MAX_BFS_NODES    = 256;
+
+    struct alignas(CACHE_LINE_SIZE) EntryBucket {
+        Entry slots[SLOTS_PER_BUCKET];
+    };
+
+    struct alignas(CACHE_LINE_SIZE) KeyBucket {
+        u64 keys[SLOTS_PER_BUCKET];
+    };
+
+    using Bucket = std::conditional_t<INLINE_ENTRIES, EntryBucket, KeyBucket>;
+    static_assert(sizeof(Bucket) == CACHE_LINE_SIZE, "A bucket must be one cache line");
+
+    // n_buckets = 1 << log_n_buckets, buckets are picked with multiply-shift
+    static const u64 DEFAULT_LOG_N_BUCKETS = 8;
+    u64 log_n_buckets;
+    u64 n_buckets;
+    u64 capacity;
+    u64 n_elements;
+    u64 max_n_supported;
+    Bucket *buckets;
+    Entry *entries;  // of slot b * SLOTS_PER_BUCKET + s, without INLINE_ENTRIES
+    Entry stash[STASH_SIZE];
+    u64 n_stashed;
+
+    BucketizedCuckoo(){
+        n_elements = 0;
+        buckets    = nullptr;
+        entries    = nullptr;
+        allocate_table(DEFAULT_LOG_N_BUCKETS);
+    }
+
+    ~BucketizedCuckoo(){
+        if (buckets != nullptr) free(buckets);
+        if (entries != nullptr) free(entries);
+    }
+
+    BucketizedCuckoo(const BucketizedCuckoo& other){
+        buckets = nullptr;
+        entries = nullptr;
+        operator=(other);
+    }
+
+    BucketizedCuckoo& operator=(const BucketizedCuckoo& other){
+        if (&other != this){
+            if (buckets != nullptr) free(buckets);
+            if (entries != nullptr) free(entries);
+            allocate_table(other.log_n_buckets);
+            n_elements = other.n_elements;
+            n_stashed  = other.n_stashed;
+            memcpy((void*)buckets, (void*)other.buckets, n_buckets * sizeof(Bucket));
+            if (!INLINE_ENTRIES) memcpy((void*)entries, (void*)other.entries, capacity * sizeof(Entry));
+            memcpy((void*)stash, (void*)other.stash, sizeof(stash));
+        }
+        return *this;
+    }
+
+    static std::string name(){
+        return "BucketizedCuckoo";
+    }
+
+    // Sets up an empty table with 1 << log_buckets buckets. Does not touch n_elements.
+    void allocate_table(u64 log_buckets){
+        log_n_buckets   = log_buckets;
+        n_buckets       = (u64)(1) << log_n_buckets;
+        capacity        = n_buckets * SLOTS_PER_BUCKET;
+        max_n_supported = (u64)(MAX_FILL_RATIO * capacity);
+        n_stashed       = 0;
+
+        const u64 size = n_buckets * sizeof(Bucket);
+        buckets = (Bucket*)aligned_alloc(CACHE_LINE_SIZE, size);
+        if (!INLINE_ENTRIES) entries = (Entry*)malloc(capacity * sizeof(Entry));
+        if (!buckets || (!INLINE_ENTRIES && !entries)) {
+            std::cout << "Allocation of buckets failed in BucketizedCuckoo.\n", exit(1);
+        }
+        memset((void*)buckets, (unsigned char)EMPTY_CELL, size);
+        memset((void*)stash, (unsigned char)EMPTY_CELL, sizeof(stash));
+    }
+
+    // Slot s of bucket b, in either layout
+    inline static u64& key_in(Bucket *bs, u64 b, u64 s){
+        if constexpr (INLINE_ENTRIES) return bs[b].slots[s].key;
+        else return bs[b].keys[s];
+    }
+
+    inline static Entry* entry_in(Bucket *bs, Entry *es, u64 b, u64 s){
+        if constexpr (INLINE_ENTRIES) return bs[b].slots + s;
+        else return es + b * SLOTS_PER_BUCKET + s;
+    }
+
+    inline u64& key_at(u64 b, u64 s){
+        return key_in(buckets, b, s);
+    }
+
+    inline Entry* entry_at(u64 b, u64 s){
+        return entry_in(buckets, entries, b, s);
+    }
+
+    inline void set_key(u64 b, u64 s, u64 key){
+        key_at(b, s) = key;
+        if constexpr (!INLINE_ENTRIES) entry_at(b, s)->key = key;
+    }
+
+    inline void move_entry(u64 from_b, u64 from_s, u64 to_b, u64 to_s){
+        *entry_at(to_b, to_s) = *entry_at(from_b, from_s);
+        if constexpr (!INLINE_ENTRIES) key_at(to_b, to_s) = key_at(from_b, from_s);
+    }
+
+    void resize_table(){
+        Bucket *old_buckets  = buckets;
+        Entry *old_entries   = entries;
+        const u64 old_n_buckets = n_buckets;
+        Entry old_stash[STASH_SIZE];
+        memcpy((void*)old_stash, (void*)stash, sizeof(stash));
+        const u64 old_n_stashed = n_stashed;
+
+        // Rehashing can in principle overflow the stash, in which case we just grow more
+        u64 new_log_n_buckets = log_n_buckets + 1;
+        while (!try_rehash(new_log_n_buckets, old_buckets, old_entries, old_n_buckets, old_stash, old_n_stashed)){
+            new_log_n_buckets++;
+        }
+        free(old_buckets);
+        if (old_entries != nullptr) free(old_entries);
+    }
+
+    bool try_rehash(u64 new_log_n_buckets, Bucket *old_buckets, Entry *old_entries, u64 old_n_buckets,
+                    Entry *old_stash, u64 old_n_stashed){
+        auto give_up = [&]{
+            free(buckets);
+            if (!INLINE_ENTRIES) free(entries);
+            return false;
+        };
+        allocate_table(new_log_n_buckets);
+        for (u64 b = 0; b < old_n_buckets; b++){
+            for (u64 s = 0; s < SLOTS_PER_BUCKET; s++){
+                if (key_in(old_buckets, b, s) == EMPTY_CELL) continue;
+                if (insert_new(*entry_in(old_buckets, old_entries, b, s)) == nullptr) return give_up();
+            }
+        }
+        for (u64 i = 0; i < old_n_stashed; i++){
+            if (insert_new(old_stash[i]) == nullptr) return give_up();
+        }
+        return true;
+    }
+
+    // Multiply-shift with two different multipliers. We use the high bits
+    // since the low bits of a*x only depend on the low bits of x, which
+    // would make the two buckets of consecutive page ids correlated.
+    inline u64 bucket_1(u64 key) const {
+        const u64 a = 2187650952262969439;
+        return (a * key) >> (64 - log_n_buckets);
+    }
+
+    inline u64 bucket_2(u64 key) const {
+        const u64 a = 8163375249528611521;
+        return (a * key) >> (64 - log_n_buckets);
+    }
+
+    inline u64 alternate_bucket(u64 key, u64 current_bucket) const {
+        const u64 b1 = bucket_1(key);
+        return b1 == current_bucket ? bucket_2(key) : b1;
+    }
+
+    // The slot of key in bucket b, SLOTS_PER_BUCKET if it has none
+    inline u64 find_in_bucket(u64 b, u64 key){
+        for (u64 s = 0; s < SLOTS_PER_BUCKET; s++){
+            if (key_at(b, s) == key) return s;
+        }
+        return SLOTS_PER_BUCKET;
+    }
+
+    // Starts loading both buckets of key, so that a later get(key) is a cache hit
+    inline void prefetch(u64 key){
+        __builtin_prefetch(buckets + bucket_1(key));
+        __builtin_prefetch(buckets + bucket_2(key));
+    }
+
+    // nullptr if not found
+    inline Entry* get(u64 key){
+        const u64 first  = bucket_1(key);
+        const u64 second = bucket_2(key);
+        // Both lines are fetched in parallel, so a miss costs one memory round trip
+        __builtin_prefetch(buckets + second);
+
+        u64 s = find_in_bucket(first, key);
+        if (s != SLOTS_PER_BUCKET) return entry_at(first, s);
+        s = find_in_bucket(second, key);
+        if (s != SLOTS_PER_BUCKET) return entry_at(second, s);
+
+        for (u64 i = 0; i < n_stashed; i++){
+            if (stash[i].key == key) return stash + i;
+        }
+        return nullptr;
+    }
+
+    // Gets the entry, or inserts a new one if it's not in the table
+    inline Entry* get_or_insert(u64 key, Data& init_if_not_found){
+        return try_emplace(key, init_if_not_found);
+    }
+
+    // Gets the entry, or inserts a new one whose value is constructed in
+    // place from args. Nothing is constructed if the key exists.
+    template <typename... Args>
+    inline Entry* try_emplace(u64 key, Args&&... args){
+        Entry *ret = get(key);
+        if (ret != nullptr) return ret;
+
+        if (n_elements >= max_n_supported) resize_table();
+
+        while ((ret = claim_slot(key)) == nullptr) resize_table();
+        new (&ret->value) Data(std::forward<Args>(args)...);
+        n_elements++;
+        return ret;
+    }
+
+    // Places an entry whose key is not in the table. Returns where the entry
+    // ended up, or nullptr if there was no cuckoo path and the stash is full.
+    inline Entry* insert_new(const Entry& entry){
+        Entry *slot = claim_slot(entry.key);
+        if (slot != nullptr) *slot = entry;
+        return slot;
+    }
+
+    // Finds a slot for a key that is not in the table and sets its key.
+    // nullptr if there was no cuckoo path and the stash is full.
+    inline Entry* claim_slot(u64 key){
+        const u64 b1 = bucket_1(key);
+        const u64 b2 = bucket_2(key);
+
+        u64 b = b1;
+        u64 s = find_in_bucket(b1, EMPTY_CELL);
+        if (s == SLOTS_PER_BUCKET){
+            b = b2;
+            s = find_in_bucket(b2, EMPTY_CELL);
+        }
+        if (s == SLOTS_PER_BUCKET && !free_slot_by_cuckoo_path(b1, b2, b, s)){
+            if (n_stashed == STASH_SIZE) return nullptr;
+            Entry *slot = stash + n_stashed++;
+            slot->key = key;
+            return slot;
+        }
+        set_key(b, s, key);
+        return entry_at(b, s);
+    }
+
+    struct BfsNode {
+        u64 bucket;
+        i64 parent;       // -1 for the two starting buckets
+        u64 parent_slot;  // the slot in the parent whose entry can move to bucket
+        u64 depth;
+    };
+
+    inline static bool bucket_on_path(const BfsNode *nodes, i64 node_i, u64 bucket){
+        for (i64 i = node_i; i != -1; i = nodes[i].parent){
+            if (nodes[i].bucket == bucket) return true;
+        }
+        return false;
+    }
+
+    // BFS from the (full) buckets b1 and b2 until we reach a bucket with an empty
+    // slot. Moves the entries along the path, and sets freed_bucket and freed_slot
+    // to the slot that was freed in b1 or b2. false if there is no path within
+    // the search limits.
+    bool free_slot_by_cuckoo_path(u64 b1, u64 b2, u64& freed_bucket, u64& freed_slot){
+        BfsNode nodes[MAX_BFS_NODES];
+        i64 head = 0, tail = 0;
+        nodes[tail++] = {.bucket = b1, .parent = -1, .parent_slot = 0, .depth = 0};
+        if (b2 != b1) nodes[tail++] = {.bucket = b2, .parent = -1, .parent_slot = 0, .depth = 0};
+
+        while (head < tail){
+            const i64 node_i = head++;
+            const BfsNode node = nodes[node_i];
+
+            for (u64 s = 0; s < SLOTS_PER_BUCKET; s++){
+                const u64 alt = alternate_bucket(key_at(node.bucket, s), node.bucket);
+                if (bucket_on_path(nodes, node_i, alt)) continue;
+
+                const u64 empty = find_in_bucket(alt, EMPTY_CELL);
+                if (empty != SLOTS_PER_BUCKET){
+                    // Shift entries one step along the path, starting from the end
+                    move_entry(node.bucket, s, alt, empty);
+                    freed_bucket = node.bucket;
+                    freed_slot   = s;
+                    for (i64 i = node_i; nodes[i].parent != -1; i = nodes[i].parent){
+                        const u64 from_bucket = nodes[nodes[i].parent].bucket;
+                        const u64 from_slot   = nodes[i].parent_slot;
+                        move_entry(from_bucket, from_slot, freed_bucket, freed_slot);
+                        freed_bucket = from_bucket;
+                        freed_slot   = from_slot;
+                    }
+                    return true;
+                }
+
+                if (node.depth + 1 < MAX_PATH_LENGTH && tail < (i64)MAX_BFS_NODES){
+                    nodes[tail++] = {.bucket = alt, .parent = node_i, .parent_slot = s, .depth = node.depth + 1};
+                }
+            }
+        }
+        return false;
+    }
+
+    u64 table_bytes(){
+        return n_buckets * sizeof(Bucket) + (INLINE_ENTRIES ? 0 : capacity * sizeof(Entry)) + sizeof(stash);
+    }
+
+    // Keys count as index, values (and padding) of used slots as payload.
+    // Out of line entries keep a second copy of their key, also index.
+    // The stash is part of the struct, so it counts as metadata.
+    MemoryUsage memory_usage(){
+        const u64 value_bytes = sizeof(Entry) - sizeof(u64);
+        const u64 n_in_buckets = n_elements - n_stashed;
+        const u64 bucket_padding = INLINE_ENTRIES ? sizeof(Bucket) - SLOTS_PER_BUCKET * sizeof(Entry) : 0;
+        MemoryUsage usage;
+        usage.index_table     = capacity * sizeof(u64) * (INLINE_ENTRIES ? 1 : 2);
+        usage.page_payload    = n_in_buckets * value_bytes;
+        usage.allocator_slack = (capacity - n_in_buckets) * value_bytes + n_buckets * bucket_padding
+                              + malloc_overhead(buckets, n_buckets * sizeof(Bucket));
+        if (!INLINE_ENTRIES) usage.allocator_slack += malloc_overhead(entries, capacity * sizeof(Entry));
+        usage.metadata        = sizeof(*this);
+        return usage;
+    }
+
+    template <typename F>
+    void for_each(F f){
+        for (u64 b = 0; b < n_buckets; b++){
+            for (u64 s = 0; s < SLOTS_PER_BUCKET; s++){
+                if (key_at(b, s) != EMPTY_CELL) f(*entry_at(b, s));
+            }
+        }
+        for (u64 i = 0; i < n_stashed; i++) f(stash[i]);
+    }
+
+    template <typename F>
+    void for_each_key(F f){
+        for_each([&](Entry& entry){ f(entry.key); });
+    }
+};
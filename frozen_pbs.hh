@@ -0,0 +1,253 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include "util.h"
+#include "memory_usage.hh"
+#include "minimal_perfect_hash.hh"
+#include "pbs_epsilon_8.hh"
+#include "pbs_bit_tricks.hh"
+#include "pbs_with_page_bearer_hashing.hh"
+#include "pbs_map_and_vec.cpp"
+
+
+// Read-only PBS structures for the query phase, built from a mutable one by
+// freeze(). The page index is a MinimalPerfectHash over the page ids, so
+// there is no load factor headroom and no probing. Its position picks a slot
+// that holds the page id, which is checked (a walk visits absent pages, and
+// they must answer 0), and the page itself or where to find it.
+//
+// The check is the full page id rather than a fingerprint: next to a u64
+// bitmap it costs nothing after alignment, and unlike a fingerprint it never
+// lets an absent page answer.
+//
+// The frozen structures have the same get_id and is_id_page_bearer as the
+// structure they were frozen from, so the page walks stay the same.
+
+
+// Bitmap pages (PBSEpsilon8, PBSBitTricks), stored in the slots in hash order:
+// a page lookup is the pilot, which is usually cached, and one slot.
+template <u64 epsilon, typename Key = u64>
+struct FrozenBitmapPBS {
+
+    using Set       = PBSBitTricks<epsilon, LinearProbing, Key>;
+    using LargeWord = typename Set::LargeWord;
+
+    struct Slot {
+        Key id;
+        LargeWord bits;
+    };
+
+    MinimalPerfectHash<Key> hash;
+    std::vector<Slot> slots;
+
+    FrozenBitmapPBS(){}
+
+    // pages[i] is the bitmap of page ids[i]
+    FrozenBitmapPBS(const std::vector<Key>& ids, const std::vector<LargeWord>& pages) : hash(ids) {
+        slots.resize(ids.size());
+        for (u64 i = 0; i < ids.size(); i++) slots[hash(ids[i])] = {.id = ids[i], .bits = pages[i]};
+    }
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << "FrozenBitmapPBS<" << epsilon;
+        if (sizeof(Key) != sizeof(u64)) sstm << ", " << KeyTraits<Key>::name() << " keys";
+        sstm << ">";
+        return sstm.str();
+    }
+
+    inline static Key get_id(Key x){
+        return Set::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(Key id){
+        return Set::is_id_page_bearer(id);
+    }
+
+    inline const Slot* get(Key id) const {
+        if (slots.empty()) return nullptr;
+        const Slot *slot = slots.data() + hash(id);
+        return slot->id == id ? slot : nullptr;
+    }
+
+    inline bool contains(Key x) const {
+        const Slot *slot = get(get_id(x));
+        return slot != nullptr && slot->bits.test_bit(Set::get_index_in_page(x));
+    }
+
+    inline void prefetch_page(Key id){
+        hash.prefetch(id);
+    }
+
+    // 0 if the page has nothing <= x
+    inline Key try_predecessor_in_page(Key x, Key id){
+        const Slot *slot = get(id);
+        if (slot == nullptr) return 0;
+        const u64 index = get_id(x) > id ? slot->bits.get_largest() : slot->bits.predecessor(Set::get_index_in_page(x));
+        if (!slot->bits.test_bit(index)) return 0;
+        return Set::recover_element(id) + index;
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = hash.memory_usage();
+        usage.index_table     += slots.size() * sizeof(Key);
+        usage.page_payload    += slots.size() * (sizeof(Slot) - sizeof(Key));
+        usage.allocator_slack += malloc_overhead(slots.data(), slots.size() * sizeof(Slot));
+        usage.metadata        += sizeof(*this) - sizeof(hash);
+        return usage;
+    }
+};
+
+
+// Pages of elements (PBSPageBearerHashing, MapAndVecPBS): the elements of all
+// pages are sorted and packed back to back in page id order, and the slot of
+// a page, in hash order, has its id, where its elements start and end, and
+// the limit below which it answers (see PBSPageBearerHashing's split_limit).
+// A page lookup is the pilot, one slot and the cache lines of the page.
+template <typename pbs_structure, typename Key = u64>
+struct FrozenSortedPBS {
+
+    static constexpr Key NO_LIMIT = KeyTraits<Key>::ALL_ONES;
+
+    struct Slot {
+        Key id;
+        Key limit;
+        u32 begin;
+        u32 end;
+    };
+
+    // What freeze() collects from the mutable structure
+    struct Page {
+        Key id;
+        Key limit;
+        std::vector<Key> elements;
+    };
+
+    std::string source_name;
+    MinimalPerfectHash<Key> hash;
+    std::vector<Slot> slots;
+    std::vector<Key> elements;
+    bool only_bearers = true; // no promoted pages, so other ids can be skipped without a lookup
+
+    FrozenSortedPBS(){}
+
+    FrozenSortedPBS(const std::string& source_name, std::vector<Page>& pages) : source_name(source_name) {
+        std::sort(pages.begin(), pages.end(), [](const Page& a, const Page& b){ return a.id < b.id; });
+        std::vector<Key> ids;
+        u64 n_elements = 0;
+        for (const Page& page : pages){
+            ids.push_back(page.id);
+            n_elements += page.elements.size();
+            only_bearers &= pbs_structure::is_id_page_bearer(page.id);
+        }
+        if (n_elements > 0xFFFFFFFF) std::cout << "FrozenSortedPBS supports up to 2^32 elements. Exiting.\n", exit(1);
+
+        hash = MinimalPerfectHash<Key>(ids);
+        slots.resize(pages.size());
+        elements.reserve(n_elements);
+        for (Page& page : pages){
+            std::sort(page.elements.begin(), page.elements.end());
+            Slot &slot = slots[hash(page.id)];
+            slot.id    = page.id;
+            slot.limit = page.limit;
+            slot.begin = elements.size();
+            elements.insert(elements.end(), page.elements.begin(), page.elements.end());
+            slot.end   = elements.size();
+        }
+    }
+
+    std::string name(){
+        return "FrozenSortedPBS (" + source_name + ")";
+    }
+
+    inline static Key get_id(Key x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(Key id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    inline const Slot* get(Key id) const {
+        if (slots.empty() || (only_bearers && !is_id_page_bearer(id))) return nullptr;
+        const Slot *slot = slots.data() + hash(id);
+        return slot->id == id ? slot : nullptr;
+    }
+
+    inline void prefetch_page(Key id){
+        if (only_bearers && !is_id_page_bearer(id)) return;
+        hash.prefetch(id);
+    }
+
+    // Counts the elements <= x without early exit, which vectorizes, as in
+    // PackedElements. 0 if the page has nothing <= x.
+    inline Key try_predecessor_in_page(Key x, Key id){
+        const Slot *slot = get(id);
+        if (slot == nullptr || x >= slot->limit) return 0;
+        const Key *page = elements.data() + slot->begin;
+        const u64 n     = slot->end - slot->begin;
+        u64 count = 0;
+        for (u64 i = 0; i < n; i++) count += page[i] <= x;
+        return count == 0 ? 0 : page[count - 1];
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = hash.memory_usage();
+        usage.index_table     += slots.size() * sizeof(Slot);
+        usage.page_payload    += elements.size() * sizeof(Key);
+        usage.allocator_slack += malloc_overhead(slots.data(), slots.size() * sizeof(Slot))
+                               + malloc_overhead(elements.data(), elements.size() * sizeof(Key));
+        usage.metadata        += sizeof(*this) - sizeof(hash) + source_name.capacity();
+        return usage;
+    }
+};
+
+
+// freeze(pbs) gives the read-only version of pbs, which is left as it is.
+// The page index of pbs must keep the page ids (not CompactLinearProbing).
+
+template <template <typename> class HashTable, typename Key>
+FrozenBitmapPBS<8, Key> freeze(PBSEpsilon8WithTable<HashTable, Key>& pbs){
+    using Frozen = FrozenBitmapPBS<8, Key>;
+    std::vector<Key> ids;
+    std::vector<typename Frozen::LargeWord> pages;
+    pbs.table.for_each([&](auto& entry){
+        ids.push_back(entry.key);
+        pages.emplace_back();
+        pages.back().words[0] = entry.value;
+    });
+    return Frozen(ids, pages);
+}
+
+template <u64 epsilon, template <typename> class HashTable, typename Key>
+FrozenBitmapPBS<epsilon, Key> freeze(PBSBitTricks<epsilon, HashTable, Key>& pbs){
+    std::vector<Key> ids;
+    std::vector<typename FrozenBitmapPBS<epsilon, Key>::LargeWord> pages;
+    pbs.table.for_each([&](auto& entry){
+        ids.push_back(entry.key);
+        pages.push_back(entry.value);
+    });
+    return FrozenBitmapPBS<epsilon, Key>(ids, pages);
+}
+
+template <u64 epsilon, template <typename> class HashTable, u64 max_page_factor, typename Key>
+auto freeze(PBSPageBearerHashing<epsilon, HashTable, max_page_factor, Key>& pbs){
+    using Frozen = FrozenSortedPBS<PBSPageBearerHashing<epsilon, HashTable, max_page_factor, Key>, Key>;
+    std::vector<typename Frozen::Page> pages;
+    pbs.for_each_page([&](Key id, Key limit, std::vector<Key>& elements){
+        pages.push_back({.id = id, .limit = limit, .elements = elements});
+    });
+    return Frozen(pbs.name(), pages);
+}
+
+template <u64 epsilon, typename Key>
+auto freeze(MapAndVecPBS<epsilon, Key>& pbs){
+    using Frozen = FrozenSortedPBS<MapAndVecPBS<epsilon, Key>, Key>;
+    std::vector<typename Frozen::Page> pages;
+    pbs.for_each_page([&](Key id, std::vector<Key>& elements){
+        pages.push_back({.id = id, .limit = Frozen::NO_LIMIT, .elements = elements});
+    });
+    return Frozen(pbs.name(), pages);
+}
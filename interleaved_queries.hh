@@ -0,0 +1,92 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+#include "util.h"
+
+
+// Coroutine-interleaved predecessor queries (needs C++20).
+//
+// A logical predecessor query visits several pages, and each visit is a
+// dependent hash table miss. We run n_in_flight lanes, each a coroutine that
+// takes the next walk from a shared cursor and, for every page of the walk,
+// prefetches the page's table slot and suspends. The lanes are resumed round
+// robin, so by the time a lane does its table probe the line has (hopefully)
+// arrived, and the memory stalls of independent queries overlap.
+//
+// The page ids of a walk are the ones from generate_pbs_test_data, and
+// consecutive entries with the same x form one walk. The structure needs
+// prefetch_page(page_id) next to try_predecessor_in_page(x, page_id).
+
+struct InterleavedLane {
+    struct promise_type {
+        InterleavedLane get_return_object(){
+            return InterleavedLane{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void(){}
+        void unhandled_exception(){ std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// The queries of one block, handed out one walk at a time
+struct WalkCursor {
+    const u64 *xs;
+    const u64 *page_ids;
+    u64 current;
+    u64 end;
+
+    inline bool next_walk(u64& walk_begin, u64& walk_end){
+        if (current >= end) return false;
+        walk_begin = current;
+        const u64 x = xs[current];
+        while (current < end && xs[current] == x) current++;
+        walk_end = current;
+        return true;
+    }
+};
+
+template <typename pbs_structure>
+InterleavedLane predecessor_lane(pbs_structure& pbs, WalkCursor& cursor, u64& sum){
+    u64 walk_begin, walk_end;
+    while (cursor.next_walk(walk_begin, walk_end)){
+        for (u64 i = walk_begin; i < walk_end; i++){
+            const u64 page_id = cursor.page_ids[i];
+            pbs.prefetch_page(page_id);
+            co_await std::suspend_always{};
+            sum += pbs.try_predecessor_in_page(cursor.xs[i], page_id);
+        }
+    }
+}
+
+// Answers the page visits xs[0..n) / page_ids[0..n) with n_in_flight walks in
+// flight and returns the sum of the answers, like the scalar loop in
+// test_pbs_data_structure.
+template <typename pbs_structure>
+u64 interleaved_predecessor_queries(pbs_structure& pbs, const u64 *xs, const u64 *page_ids, u64 n, u64 n_in_flight){
+    WalkCursor cursor = {.xs = xs, .page_ids = page_ids, .current = 0, .end = n};
+    u64 sum = 0;
+
+    std::vector<std::coroutine_handle<InterleavedLane::promise_type>> lanes;
+    for (u64 i = 0; i < n_in_flight; i++){
+        lanes.push_back(predecessor_lane(pbs, cursor, sum).handle);
+    }
+
+    u64 n_running = lanes.size();
+    while (n_running > 0){
+        for (auto& lane : lanes){
+            if (!lane || lane.done()) continue;
+            lane.resume();
+            if (lane.done()){
+                lane.destroy();
+                lane = nullptr;
+                n_running--;
+            }
+        }
+    }
+    return sum;
+}
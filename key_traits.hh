@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include "util.h"
+
+
+// What the tables and PBS structures need to know about their key type:
+// the all-ones sentinel for empty slots, a fold to 64 bits for the hash
+// functions that work on u64, and the table hash built on it. Keys are u64
+// by default; u32 halves the key bytes of tables and pages when the universe
+// allows it, and u128 is for universes beyond 2^64. The largest key of each
+// width is the sentinel and cannot be stored.
+template <typename Key>
+struct KeyTraits;
+
+template <>
+struct KeyTraits<u64> {
+    static const u64 ALL_ONES = 0xFFFFFFFFFFFFFFFF;
+
+    // hash(x) = a*x + b, also computed 8 keys at a time in PBSEpsilon8::contains_batch
+    static const u64 HASH_A = 2187650952262969439;
+    static const u64 HASH_B = 2349073786287317910;
+
+    static std::string name(){
+        return "u64";
+    }
+
+    inline static u64 fold(u64 x){
+        return x;
+    }
+
+    inline static u64 hash(u64 x){
+        return (HASH_A * x) + HASH_B;
+    }
+};
+
+template <>
+struct KeyTraits<u32> {
+    static const u32 ALL_ONES = 0xFFFFFFFF;
+
+    static std::string name(){
+        return "u32";
+    }
+
+    inline static u64 fold(u32 x){
+        return x;
+    }
+
+    inline static u64 hash(u32 x){
+        return KeyTraits<u64>::hash(x);
+    }
+};
+
+template <>
+struct KeyTraits<u128> {
+    static constexpr u128 ALL_ONES = ~(u128)(0);
+
+    static std::string name(){
+        return "u128";
+    }
+
+    // The high half goes through a multiplication, so keys that only
+    // differ in the high half do not cancel out
+    inline static u64 fold(u128 x){
+        const u64 c = 8163375249528611521;
+        return (u64)x ^ (c * (u64)(x >> 64));
+    }
+
+    inline static u64 hash(u128 x){
+        return KeyTraits<u64>::hash(fold(x));
+    }
+};
@@ -6,19 +6,36 @@
 #include <unordered_map>
 #include <vector>
 #include "util.h"
+#include "memory_usage.hh"
+#include "key_traits.hh"
 #include <cstdlib>
 #include <cstring>
+#include <cassert>
+#include <string>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
-template <typename Data>
+// Key is u64 by default, see key_traits.hh for the other widths
+template <typename Data, typename Key = u64>
 struct LinearProbing {
 
+    // Entries are moved around with memcpy (copy, resize), so Data must be
+    // trivially relocatable. We check for trivially copyable, which implies it.
+    static_assert(std::is_trivially_copyable<Data>::value, "LinearProbing needs trivially copyable values");
+
+    using KeyType = Key;
+
     struct Entry {
-        u64 key;
+        Key key;
         Data value;
     };
 
-    static const u64 ALL_ONES   = 0xFFFFFFFFFFFFFFFF;
-    static const u64 EMPTY_CELL = ALL_ONES;
+    static constexpr Key ALL_ONES   = KeyTraits<Key>::ALL_ONES;
+    static constexpr Key EMPTY_CELL = ALL_ONES;
     constexpr static const double MAX_FILL_RATIO = 0.8;
     
     // Capacity = 1 << k for some k to support fast mod 
@@ -28,10 +45,25 @@ struct LinearProbing {
     u64 n_elements;
     u64 max_n_supported;
     Entry *table; 
+
+    // Instrumentation for the benchmark: table allocations and bytes of
+    // Entry/Data copied by inserts, resizes and copies of the table
+    u64 n_allocations = 0;
+    u64 n_bytes_copied = 0;
+
+    // Rebuilds by erase_if() and assignments, which move entries without a
+    // new key (see PageFinger)
+    u64 n_moves = 0;
+
+    // Threads that move the entries when the table doubles, see rehash_in_parallel()
+    u64 n_rehash_threads = 1;
+    static const u64 PARALLEL_REHASH_MIN_CAPACITY = (1 << 16);
+    static const u64 REHASH_CHUNK                 = (1 << 16);
     
     // ------------- TODO --------------
     // ------ Implement shrinking ------
     // ---------------------------------
+    // (only erase_if() shrinks the table so far)
 
     LinearProbing(){
         capacity             = DEFAULT_CAPACITY;
@@ -41,6 +73,7 @@ struct LinearProbing {
         u64 size             = sizeof(Entry)*capacity;
         table                = (Entry*)malloc(size);  
         table = (Entry*)memset((void*)table, (unsigned char)EMPTY_CELL, size); 
+        n_allocations++;
         verify_valid_capacity();
     }
 
@@ -50,15 +83,24 @@ struct LinearProbing {
 
     LinearProbing(const LinearProbing& other){   
         assert(&other != this); 
+        table = nullptr;
         operator=(other);
     }
 
+    LinearProbing(LinearProbing&& other){
+        table = nullptr;
+        operator=(std::move(other));
+    }
+
     LinearProbing& operator=(const LinearProbing& other){
         if(&other != this){
+            if (table != nullptr) free(table);
             capacity               = other.capacity;
             mod_capacity_bitmask   = other.mod_capacity_bitmask;
             n_elements             = other.n_elements;
             max_n_supported        = other.max_n_supported;
+            n_rehash_threads       = other.n_rehash_threads;
+            n_moves++;
 
             if (other.table != nullptr){
                 u64 size = capacity * sizeof(Entry);
@@ -67,17 +109,45 @@ struct LinearProbing {
                     std::cout << "Allocation of table failed in operator= for LinearProbing.\n", exit(1);
                 }
                 memcpy((void*)table, (void*)other.table, size);  
+                n_allocations++;
+                n_bytes_copied += size;
             }
             else table = nullptr;
             return *this;
         } else return *this; 
     }
 
+    // Steals the table. other is left without a table and must not be used
+    // except for destruction or being assigned to.
+    LinearProbing& operator=(LinearProbing&& other){
+        if(&other != this){
+            if (table != nullptr) free(table);
+            capacity               = other.capacity;
+            mod_capacity_bitmask   = other.mod_capacity_bitmask;
+            n_elements             = other.n_elements;
+            max_n_supported        = other.max_n_supported;
+            n_allocations          = other.n_allocations;
+            n_bytes_copied         = other.n_bytes_copied;
+            n_rehash_threads       = other.n_rehash_threads;
+            n_moves++;
+            table                  = other.table;
+            other.table            = nullptr;
+            other.n_elements       = 0;
+        }
+        return *this;
+    }
+
+    static std::string name(){
+        if (sizeof(Key) != sizeof(u64)) return "LinearProbing<" + KeyTraits<Key>::name() + " keys>";
+        return "LinearProbing";
+    }
+
     void resize_table(){
         // TODO: Remember to implement shrinking if necessary
 
         Entry *old_table = table;
         u64 old_capacity = capacity;
+        const u64 n_elements_before_resize = n_elements;
 
         // Ensure capacity is (1 << k) for some k 
         this->capacity             = this->capacity * 2;
@@ -87,20 +157,151 @@ struct LinearProbing {
 
         u64 new_size               = sizeof(*table)*capacity;
         this->table                = (typeof(table))malloc(new_size);
-        memset((void*)this->table, (unsigned char)EMPTY_CELL, new_size);
+        n_allocations++;
         verify_valid_capacity();
 
-
-        Entry tmp;
-        for(size_t i = 0; i < old_capacity; i++){
-            tmp = old_table[i];
-            if (tmp.key != EMPTY_CELL){
-                get_or_insert(tmp.key, tmp.value);
+        if (n_rehash_threads > 1 && old_capacity >= PARALLEL_REHASH_MIN_CAPACITY){
+            rehash_in_parallel(old_table, old_capacity);
+        } else {
+            memset((void*)this->table, (unsigned char)EMPTY_CELL, new_size);
+            // Keys in the old table are distinct, and the new table has room
+            // for all of them, so we only look for the first empty slot and
+            // relocate the entry there without going through get_or_insert.
+            for(size_t i = 0; i < old_capacity; i++){
+                const Entry *old_entry = old_table + i;
+                if (old_entry->key == EMPTY_CELL) continue;
+                relocate(old_entry);
             }
         }
+        this->n_elements = n_elements_before_resize;
         free(old_table);
     }
 
+    // Removes every entry for which should_erase(entry) is true, in one pass
+    // over the table that moves the rest into a new one. The new table is the
+    // smallest that holds them at half of MAX_FILL_RATIO, so a table that
+    // grew and was then mostly emptied gives the memory back. Deleting
+    // entries one by one would need backward shifts in every cluster instead.
+    // Returns the number of entries removed.
+    template <typename F>
+    u64 erase_if(F should_erase){
+        u64 n_kept = 0;
+        for (u64 i = 0; i < capacity; i++){
+            if (table[i].key == EMPTY_CELL) continue;
+            if (should_erase(table[i])) table[i].key = EMPTY_CELL;
+            else n_kept++;
+        }
+        const u64 n_erased = n_elements - n_kept;
+        if (n_erased == 0) return 0;
+
+        u64 new_capacity = DEFAULT_CAPACITY;
+        while (n_kept >= MAX_FILL_RATIO * new_capacity / 2) new_capacity *= 2;
+
+        Entry *old_table   = table;
+        u64 old_capacity   = capacity;
+        capacity             = new_capacity;
+        mod_capacity_bitmask = capacity - 1;
+        n_elements           = n_kept;
+        max_n_supported      = (u64)(MAX_FILL_RATIO * capacity);
+        table                = (Entry*)malloc(sizeof(Entry) * capacity);
+        if (!table) std::cout << "Allocation of table failed in erase_if for LinearProbing.\n", exit(1);
+        n_moves++;
+        memset((void*)table, (unsigned char)EMPTY_CELL, sizeof(Entry) * capacity);
+        n_allocations++;
+        for (u64 i = 0; i < old_capacity; i++){
+            if (old_table[i].key != EMPTY_CELL) relocate(old_table + i);
+        }
+        free(old_table);
+        return n_erased;
+    }
+
+    // Copies old_entry to the first empty slot from its home in the new table
+    inline void relocate(const Entry *old_entry){
+        u64 current = hash(old_entry->key) & mod_capacity_bitmask;
+        while (table[current].key != EMPTY_CELL) current = (current + 1) & mod_capacity_bitmask;
+        memcpy((void*)(table + current), (const void*)old_entry, sizeof(Entry));
+        n_bytes_copied += sizeof(Entry);
+    }
+
+    // Doubling splits the table cleanly: an entry with home h in the old table
+    // has home h or h + old_capacity in the new one. Clusters end at empty
+    // slots, so the old table is cut at empty slots into ranges [begin, end)
+    // whose entries all have their home in the range. Those entries only need
+    // new slots [begin, end) and [begin, end) + old_capacity, which no other
+    // range uses, so ranges are moved independently. Each range also clears
+    // its part of the new table first.
+    //
+    // The ranges are REHASH_CHUNK slots long (cut at the next empty slot) and
+    // threads take the next one from a shared counter until none are left.
+    // The few entries that do not fit, namely clusters that wrap around the
+    // end of the old table and new clusters that would grow past the end of
+    // their range, are moved on this thread once the others are done.
+    void rehash_in_parallel(const Entry *old_table, u64 old_capacity){
+        const u64 n_chunks = (old_capacity + REHASH_CHUNK - 1) / REHASH_CHUNK;
+        std::atomic<u64> next_chunk = 0;
+        std::vector<std::vector<u64>> deferred(n_rehash_threads);
+        std::vector<u64> bytes_copied(n_rehash_threads, 0);
+
+        // Start of chunk k: the first empty slot at or after k * REHASH_CHUNK
+        auto chunk_begin = [&](u64 k){
+            if (k == 0) return (u64)(0);
+            u64 i = std::min(old_capacity, k * REHASH_CHUNK);
+            while (i < old_capacity && old_table[i].key != EMPTY_CELL) i++;
+            return i;
+        };
+
+        auto work = [&](u64 t){
+            while (true){
+                const u64 k = next_chunk.fetch_add(1);
+                if (k >= n_chunks) break;
+                const u64 begin = chunk_begin(k);
+                const u64 end   = chunk_begin(k + 1);
+                if (begin >= end) continue; // a cluster longer than a chunk, moved with the previous one
+                bytes_copied[t] += rehash_range(old_table, old_capacity, begin, end, deferred[t]);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (u64 t = 1; t < n_rehash_threads; t++) threads.emplace_back(work, t);
+        work(0);
+        for (auto& thread : threads) thread.join();
+
+        for (u64 t = 0; t < n_rehash_threads; t++){
+            n_bytes_copied += bytes_copied[t];
+            for (u64 i : deferred[t]) relocate(old_table + i);
+        }
+    }
+
+    // Moves the entries at old slots [begin, end) using only new slots [begin, end)
+    // and [begin, end) + old_capacity, see rehash_in_parallel(). Appends the
+    // old slots of entries that do not fit there to deferred. Returns bytes copied.
+    u64 rehash_range(const Entry *old_table, u64 old_capacity, u64 begin, u64 end, std::vector<u64>& deferred){
+        const u64 range_bytes = (end - begin) * sizeof(Entry);
+        memset((void*)(table + begin), (unsigned char)EMPTY_CELL, range_bytes);
+        memset((void*)(table + begin + old_capacity), (unsigned char)EMPTY_CELL, range_bytes);
+
+        u64 bytes_copied = 0;
+        for (u64 i = begin; i < end; i++){
+            const Entry *old_entry = old_table + i;
+            if (old_entry->key == EMPTY_CELL) continue;
+
+            const u64 home     = hash(old_entry->key) & mod_capacity_bitmask;
+            const u64 old_home = home & (old_capacity - 1);
+            const u64 limit    = home < old_capacity ? end : end + old_capacity;
+            u64 current = home;
+            if (old_home >= begin && old_home < end){
+                while (current < limit && table[current].key != EMPTY_CELL) current++;
+            }
+            if (old_home < begin || old_home >= end || current == limit){
+                deferred.push_back(i);
+                continue;
+            }
+            memcpy((void*)(table + current), (const void*)old_entry, sizeof(Entry));
+            bytes_copied += sizeof(Entry);
+        }
+        return bytes_copied;
+    }
+
     void verify_valid_capacity(){
         // capacity should be a power of two to support fast modulo
         const u64 n = capacity;
@@ -111,16 +312,36 @@ struct LinearProbing {
         }
     }
 
-    inline static u64 hash(u64 x) {
-        const u64 a = 2187650952262969439;
-        const u64 b = 2349073786287317910;
-        return (a * x) + b;
+    inline static u64 hash(Key x) {
+        return KeyTraits<Key>::hash(x);
     }
 
     // Gets the entry, or inserts a new one if it's not in the table 
-    inline Entry* get_or_insert(u64 key, Data& init_if_not_found){
-        if (n_elements >= max_n_supported) resize_table();
-        
+    inline Entry* get_or_insert(Key key, Data& init_if_not_found){
+        bool inserted;
+        Entry *ret = find_or_claim_slot(key, inserted);
+        if (inserted) {
+            new (&ret->value) Data(init_if_not_found);
+            n_bytes_copied += sizeof(Data);
+        }
+        return ret;
+    }
+
+    // Gets the entry, or inserts a new one whose value is constructed in
+    // place from args. Nothing is constructed or copied if the key exists.
+    template <typename... Args>
+    inline Entry* try_emplace(Key key, Args&&... args){
+        bool inserted;
+        Entry *ret = find_or_claim_slot(key, inserted);
+        if (inserted) new (&ret->value) Data(std::forward<Args>(args)...);
+        return ret;
+    }
+
+    // Returns the entry of key if present. Otherwise claims an empty slot
+    // for key, sets inserted and leaves the value for the caller to construct.
+    // The table only resizes for a new key, so entries only move when
+    // n_elements grows (see PageFinger).
+    inline Entry* find_or_claim_slot(Key key, bool& inserted){
         u64 current = hash(key) & mod_capacity_bitmask;
         Entry *ret = nullptr;
         Entry *tmp;
@@ -135,15 +356,26 @@ struct LinearProbing {
         }
         const bool key_was_not_found = ret == nullptr;
         if (key_was_not_found){
+            if (n_elements >= max_n_supported){
+                resize_table();
+                current = hash(key) & mod_capacity_bitmask;
+                while (table[current].key != EMPTY_CELL) current = (current + 1) & mod_capacity_bitmask;
+            }
             ret = table + current;
-            *ret = {.key = key, .value = init_if_not_found};
+            ret->key = key;
             n_elements++;
         }
+        inserted = key_was_not_found;
         return ret;
     }
 
+    // Starts loading the home slot of key, so that a later get(key) is a cache hit
+    inline void prefetch(Key key){
+        __builtin_prefetch(table + (hash(key) & mod_capacity_bitmask));
+    }
+
     // nullptr if not found
-    inline Entry* get(u64 key){
+    inline Entry* get(Key key){
         u64 current = hash(key) & mod_capacity_bitmask;
         Entry *ret = nullptr;
         Entry *tmp;
@@ -158,4 +390,63 @@ struct LinearProbing {
         }
         return ret;
     }
-};
\ No newline at end of file
+
+    u64 table_bytes(){
+        return capacity * sizeof(Entry);
+    }
+
+    // Keys count as index, values (and padding) of used slots as payload
+    MemoryUsage memory_usage(){
+        const u64 value_bytes = sizeof(Entry) - sizeof(Key);
+        MemoryUsage usage;
+        usage.index_table     = capacity * sizeof(Key);
+        usage.page_payload    = n_elements * value_bytes;
+        usage.allocator_slack = (capacity - n_elements) * value_bytes + malloc_overhead(table, table_bytes());
+        usage.metadata        = sizeof(*this);
+        return usage;
+    }
+
+    template <typename F>
+    void for_each(F f){
+        for (u64 i = 0; i < capacity; i++){
+            if (table[i].key != EMPTY_CELL) f(table[i]);
+        }
+    }
+
+    template <typename F>
+    void for_each_key(F f){
+        for_each([&](Entry& entry){ f(entry.key); });
+    }
+};
+
+
+// The page index a PBS structure with keys of type Key gets from its
+// HashTable parameter. Only LinearProbing takes the key width; the other
+// tables are keyed by u64, which holds the page ids of u32 and u64 keys.
+//
+// The tables a PBS structure can take as HashTable:
+//
+//  - LinearProbing (linear_probing.hh), the default. The only one with
+//    erase_if(), which expiring pages and the set operations need.
+//  - BucketizedCuckoo (cuckoo_hashing.hh): a lookup reads at most two
+//    buckets of one cache line each (and the stash), however full the table is.
+//  - CompactLinearProbing (compact_linear_probing.hh): quotiented keys in
+//    4-byte slots. Entries do not hold the page id, so for_each_element()
+//    does not compile with it.
+//  - CowLinearProbing (cow_linear_probing.hh): copy-on-write segments,
+//    for cheap snapshot()s.
+//  - any of the first three behind a bloom filter (bloom_filtered_table.hh,
+//    e.g. FilteredLinearProbing), for workloads that probe many absent pages.
+template <template <typename> class HashTable, typename Data, typename Key>
+struct PageIndexFor {
+    static_assert(sizeof(Key) <= sizeof(u64), "Only LinearProbing supports page ids wider than 64 bits");
+    using type = HashTable<Data>;
+};
+
+template <typename Data, typename Key>
+struct PageIndexFor<LinearProbing, Data, Key> {
+    using type = LinearProbing<Data, Key>;
+};
+
+template <template <typename> class HashTable, typename Data, typename Key>
+using PageIndex = typename PageIndexFor<HashTable, Data, Key>::type;
@@ -4,16 +4,40 @@
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <iterator>
+#include <sched.h>
+#include <sys/wait.h>
 
 #include "util.h"
 
 #include "pbs_map_and_vec.cpp"
 #include "pbs_linear_probing.cpp"
 #include "linear_probing.hh"
+#include "cuckoo_hashing.hh"
+#include "compact_linear_probing.hh"
+#include "bloom_filtered_table.hh"
 #include "test_linear_probing.hh"
 #include "pbs_epsilon_8.hh"
 #include "pbs_bit_tricks.hh"
 #include "pbs_with_page_bearer_hashing.hh"
+#include "interleaved_queries.hh"
+#include "op_trace.hh"
+#include "batch_operations.hh"
+#include "concurrent_pbs.hh"
+#include "adaptive_pbs.hh"
+#include "write_ahead_log.hh"
+#include "pbs_map.hh"
+#include "frozen_pbs.hh"
+#include "sliding_window_pbs.hh"
+#include "buffered_pbs.hh"
+#include "memory_usage.hh"
+#include "perf_regression.hh"
 
 typedef std::mt19937 MTRng;  
 const u32 seed_val = 996241586;    
@@ -38,8 +62,19 @@ struct TestResult {
     u64 sum;
     u64 insertion_time;
     u64 query_time;
+    double bytes_per_element = 0;
 };
 
+// Number of distinct keys inserted, which is what bytes per element is relative to
+u64 count_distinct_insertions(TestData& data){
+    std::vector<u64> keys;
+    for (u64 i = 0; i < data.ops.size(); i++){
+        if (data.ops[i] == TestData::Op::Insert) keys.push_back(data.xs[i]);
+    }
+    std::sort(keys.begin(), keys.end());
+    return std::unique(keys.begin(), keys.end()) - keys.begin();
+}
+
     //#define DEBUGGING_QUERIES
     //#define DEBUGGING_INSERTIONS
 
@@ -106,9 +141,8 @@ PbsTestData<pbs_structure> generate_pbs_test_data(TestData& data){
 }
 
 
-TestResult test_set_data_structure(TestData& data){
-    
-    std::set<u64> set;
+// Runs the ops of data on set, timing the blocks of insertions and of queries
+TestResult run_set_test_data(std::set<u64>& set, TestData& data){
     set.insert(0);
     u64 insertion_time = 0;
     u64 query_time = 0;
@@ -147,21 +181,39 @@ TestResult test_set_data_structure(TestData& data){
             exit(1);
         }
     }
+    return {.structure_name = "std::set", .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
+
+TestResult test_set_data_structure(TestData& data){
+    std::set<u64> set;
+    const TestResult result = run_set_test_data(set, data);
+    const u64 insertion_time = result.insertion_time;
+    const u64 query_time     = result.query_time;
+    const u64 sum            = result.sum;
+
+    // Red-black tree nodes: colour, three pointers and the key, one malloc each
+    const u64 node_bytes = 4 * sizeof(void*) + sizeof(u64);
+    MemoryUsage usage;
+    usage.index_table     = set.size() * (node_bytes - sizeof(u64));
+    usage.page_payload    = set.size() * sizeof(u64);
+    usage.allocator_slack = set.size() * estimated_malloc_overhead(node_bytes);
+    usage.metadata        = sizeof(set);
+    const u64 n_elements  = count_distinct_insertions(data);
 
     std::cout << "Testing regular set\n";
     std::cout << "Insertion time: " << insertion_time << "us\n";
     std::cout << "Query time: " << query_time << "us\n";
     std::cout << "Sum: " << sum << "\n";
+    usage.print(n_elements);
     std::cout << "--------------------\n";
 
-    return {.structure_name = "std::set", .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+    return {.structure_name = "std::set", .sum = sum, .insertion_time = insertion_time, .query_time = query_time,
+            .bytes_per_element = (double)usage.total() / n_elements};
 }
 
+// Runs the ops of data on pbs, timing the blocks of insertions and of queries
 template <typename pbs_structure>
-TestResult test_pbs_data_structure(TestData& test_data){
-    pbs_structure pbs = pbs_structure();
-    std::cout << "Testing " << pbs.name() << "\n";
-    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+TestResult run_pbs_test_data(pbs_structure& pbs, PbsTestData<pbs_structure>& data){
     using Data = PbsTestData<pbs_structure>;
     u64 insertion_time = 0;
     u64 query_time = 0;
@@ -202,63 +254,1724 @@ TestResult test_pbs_data_structure(TestData& test_data){
             exit(1);
         }
     }
+    return {.structure_name = pbs.name(), .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
+
+template <typename pbs_structure>
+TestResult test_pbs_data_structure(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Testing " << pbs.name() << "\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    TestResult result = run_pbs_test_data(pbs, data);
+
+    const MemoryUsage usage = pbs.memory_usage();
+    const u64 n_elements    = count_distinct_insertions(test_data);
+
+    std::cout << "Insertion time: " << result.insertion_time << "us\n";
+    std::cout << "Query time: " << result.query_time << "us\n";
+    std::cout << "Sum: " << result.sum << "\n";
+    usage.print(n_elements);
+    std::cout << "--------------------\n";
+
+    //pbs.print_statistics();
+
+    result.structure_name    = pbs.name();
+    result.bytes_per_element = (double)usage.total() / n_elements;
+    return result;
+}
+
+// Times every page lookup of the query phase on its own and reports the tail,
+// which is where long linear probing runs show up. Insertions are not timed.
+template <typename pbs_structure>
+void test_pbs_query_latency(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Query latency of " << pbs.name() << "\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+
+    std::vector<u64> latencies;
+    u64 sum = 0;
+    const u64 N = data.ops.size();
+    for (u64 i = 0; i < N; i++){
+        if (data.ops[i] == Data::Op::Insert){
+            pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+        }
+        else {
+            const u64 start = nowNanos();
+            sum += pbs.try_predecessor_in_page(data.xs[i], data.page_id[i]);
+            const u64 end = nowNanos();
+            latencies.push_back(end - start);
+        }
+    }
+    if (latencies.empty()) return;
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](double p){ return latencies[(u64)(p * (latencies.size() - 1))]; };
+    std::cout << "Page lookups: " << latencies.size() << "\n";
+    std::cout << "p50: "   << percentile(0.5)   << "ns\n";
+    std::cout << "p99: "   << percentile(0.99)  << "ns\n";
+    std::cout << "p99.9: " << percentile(0.999) << "ns\n";
+    std::cout << "max: "   << latencies.back()  << "ns\n";
+    std::cout << "Sum: " << sum << "\n";
+    std::cout << "--------------------\n";
+}
+
+// Builds the structure from the insertions only and reports the size of its
+// page index. Only for the structures that keep their pages in `table`.
+template <typename pbs_structure>
+void print_page_index_footprint(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    std::vector<u64> keys;
+    for (u64 i = 0; i < test_data.ops.size(); i++){
+        if (test_data.ops[i] != TestData::Op::Insert) continue;
+        pbs.try_insert_in_page(test_data.xs[i], pbs_structure::get_id(test_data.xs[i]));
+        keys.push_back(test_data.xs[i]);
+    }
+    std::sort(keys.begin(), keys.end());
+    const u64 n_keys = std::unique(keys.begin(), keys.end()) - keys.begin();
+
+    const u64 bytes = pbs.table.table_bytes();
+    std::cout << "Page index of " << pbs.name() << "\n";
+    std::cout << "Pages: " << pbs.table.n_elements << "\n";
+    std::cout << "Table bytes: " << bytes << "\n";
+    std::cout << "Bytes per page: " << (double)bytes / pbs.table.n_elements << "\n";
+    std::cout << "Bytes per element: " << (double)bytes / n_keys << "\n";
+    std::cout << "--------------------\n";
+}
+
+// Table allocations and bytes copied by LinearProbing while inserting.
+// Only for structures whose `table` is a LinearProbing.
+template <typename pbs_structure>
+void print_linear_probing_copies(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    u64 n_insertions = 0;
+    const u64 start = nowMicros();
+    for (u64 i = 0; i < test_data.ops.size(); i++){
+        if (test_data.ops[i] != TestData::Op::Insert) continue;
+        pbs.try_insert_in_page(test_data.xs[i], pbs_structure::get_id(test_data.xs[i]));
+        n_insertions++;
+    }
+    const u64 end = nowMicros();
+
+    std::cout << "Copies in " << pbs.name() << "\n";
+    std::cout << "Insertion time: " << end - start << "us\n";
+    std::cout << "Allocations: " << pbs.table.n_allocations << "\n";
+    std::cout << "Bytes copied: " << pbs.table.n_bytes_copied << "\n";
+    std::cout << "Bytes copied per insertion: " << (double)pbs.table.n_bytes_copied / n_insertions << "\n";
+    std::cout << "--------------------\n";
+}
+
+// Time of one doubling of a LinearProbing<u64> of 2^log_capacity slots, just
+// before it would resize, on 1..max_threads rehash threads. Each run resizes a
+// copy of the same table; the keys are looked up again afterwards.
+void test_linear_probing_parallel_resize(u64 min_log_capacity, u64 max_log_capacity, u64 max_threads){
+    using Table = LinearProbing<u64>;
+    std::mt19937_64 generator(seed_val);
+    for (u64 log_capacity = min_log_capacity; log_capacity <= max_log_capacity; log_capacity++){
+        Table full;
+        std::vector<u64> keys;
+        u64 value = 0;
+        while (full.capacity < ((u64)(1) << log_capacity) || full.n_elements < full.max_n_supported){
+            const u64 key = generator() >> 1;
+            if (full.get(key) != nullptr) continue;
+            full.get_or_insert(key, value);
+            keys.push_back(key);
+        }
+
+        std::cout << "Resize of 2^" << log_capacity << " slots, " << full.n_elements << " entries:";
+        for (u64 n_threads = 1; n_threads <= max_threads; n_threads++){
+            Table table = full;
+            table.n_rehash_threads = n_threads;
+            const u64 start = nowMicros();
+            table.resize_table();
+            const u64 time = nowMicros() - start;
+
+            u64 n_missing = 0;
+            for (u64 key : keys) n_missing += table.get(key) == nullptr;
+            std::cout << " " << n_threads << " threads " << time << "us";
+            if (n_missing) std::cout << " \033[31;1mERROR: " << n_missing << " keys lost\033[0m";
+        }
+        std::cout << "\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+// Builds the structure from the insertions only and prints its page size distribution
+template <typename pbs_structure>
+void print_page_size_distribution(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    for (u64 i = 0; i < data.ops.size(); i++){
+        if (data.ops[i] == Data::Op::Insert) pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+    }
+    std::cout << "Page sizes of " << pbs.name() << "\n";
+    pbs.print_statistics();
+    std::cout << "--------------------\n";
+}
+
+// Same as test_pbs_data_structure, but each query block is answered by the
+// coroutine engine with n_in_flight interleaved walks
+template <typename pbs_structure>
+TestResult test_pbs_data_structure_interleaved(TestData& test_data, u64 n_in_flight){
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Testing " << pbs.name() << " with " << n_in_flight << " interleaved walks\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    u64 insertion_time = 0;
+    u64 query_time = 0;
+    u64 sum = 0;
+    i64 current = 0;
+    const i64 N = data.ops.size();
+    while (current < N){
+        if (data.ops[current] == Data::Op::Insert){
+            const u64 start = nowMicros();
+            while (current < N && data.ops[current] == Data::Op::Insert){
+                pbs.try_insert_in_page(data.xs[current], data.page_id[current]);
+                current++;
+            }
+            const u64 end = nowMicros();
+            insertion_time += end - start;
+        }
+        else if (data.ops[current] == Data::Op::Query){
+            i64 block_end = current;
+            while (block_end < N && data.ops[block_end] == Data::Op::Query) block_end++;
+
+            const u64 start = nowMicros();
+            sum += interleaved_predecessor_queries(pbs, data.xs.data() + current, data.page_id.data() + current, block_end - current, n_in_flight);
+            const u64 end = nowMicros();
+            query_time += end - start;
+            current = block_end;
+        }
+        else {
+            std::cout << "Unsupported operation. Exiting.\n";
+            exit(1);
+        }
+    }
 
     std::cout << "Insertion time: " << insertion_time << "us\n";
     std::cout << "Query time: " << query_time << "us\n";
     std::cout << "Sum: " << sum << "\n";
     std::cout << "--------------------\n";
 
-    //pbs.print_statistics();
+    std::stringstream sstm;
+    sstm << pbs.name() << " (" << n_in_flight << " in flight)";
+    return {.structure_name = sstm.str(), .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
 
-    return {.structure_name = pbs.name(), .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+// Like test_pbs_data_structure, but after every block of insertions the pages
+// that were not written to in the last min_idle_writes page writes are packed.
+// Packing is timed on its own; the next writes to a page unpack it again.
+template <typename pbs_structure>
+TestResult test_pbs_cold_pages(TestData& test_data, u64 min_idle_writes){
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Testing " << pbs.name() << " with cold pages packed after " << min_idle_writes << " idle writes\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    u64 insertion_time = 0;
+    u64 query_time = 0;
+    u64 packing_time = 0;
+    u64 n_packed = 0;
+    u64 sum = 0;
+    i64 current = 0;
+    const i64 N = data.ops.size();
+    while (current < N){
+        if (data.ops[current] == Data::Op::Insert){
+            u64 start = nowMicros();
+            while (current < N && data.ops[current] == Data::Op::Insert){
+                pbs.try_insert_in_page(data.xs[current], data.page_id[current]);
+                current++;
+            }
+            insertion_time += nowMicros() - start;
+
+            start = nowMicros();
+            n_packed += pbs.compress_cold_pages(min_idle_writes);
+            packing_time += nowMicros() - start;
+        }
+        else if (data.ops[current] == Data::Op::Query){
+            const u64 start = nowMicros();
+            while (current < N && data.ops[current] == Data::Op::Query){
+                sum += pbs.try_predecessor_in_page(data.xs[current], data.page_id[current]);
+                current++;
+            }
+            query_time += nowMicros() - start;
+        }
+        else {
+            std::cout << "Unsupported operation. Exiting.\n";
+            exit(1);
+        }
+    }
+
+    const MemoryUsage usage = pbs.memory_usage();
+    const u64 n_elements    = count_distinct_insertions(test_data);
+
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    std::cout << "Packing time: " << packing_time << "us for " << n_packed << " pages\n";
+    std::cout << "Query time: " << query_time << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    usage.print(n_elements);
+    std::cout << "--------------------\n";
+
+    return {.structure_name = pbs.name() + " (packed cold pages)", .sum = sum, .insertion_time = insertion_time,
+            .query_time = query_time, .bytes_per_element = (double)usage.total() / n_elements};
 }
 
-void compare_results(TestResult baseline, TestResult testing){
-    std::cout << "-----------------------\n";
-    std::cout << "Comparing " << testing.structure_name << " to baseline " << baseline.structure_name << "\n";
+// Sort-and-merge blocks: each block of page visits is sorted by page id and
+// every page is probed once per block. Insertion blocks are only batched when
+// the structure has insert_batch_in_page, see batch_operations.hh.
+template <typename pbs_structure>
+TestResult test_pbs_data_structure_batched(TestData& test_data){
+    constexpr bool batch_insertions = requires(pbs_structure pbs, const u64 *xs){
+        pbs.insert_batch_in_page(xs, 0, 0);
+    };
+
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Testing " << pbs.name() << " with sorted blocks" << (batch_insertions ? "" : " (queries only)") << "\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    PageBatcher batcher;
+    std::vector<u64> results;
+    u64 insertion_time = 0;
+    u64 query_time = 0;
+    u64 sum = 0;
+    i64 current = 0;
+    const i64 N = data.ops.size();
+    while (current < N){
+        i64 block_end = current;
+        while (block_end < N && data.ops[block_end] == data.ops[current]) block_end++;
+        const u64 block_size = block_end - current;
 
+        if (data.ops[current] == Data::Op::Insert){
+            const u64 start = nowMicros();
+            if constexpr (batch_insertions){
+                batcher.insert(pbs, data.xs.data() + current, block_size);
+            }
+            else {
+                for (i64 i = current; i < block_end; i++) pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+            }
+            const u64 end = nowMicros();
+            insertion_time += end - start;
+        }
+        else if (data.ops[current] == Data::Op::Query){
+            const u64 start = nowMicros();
+            results.resize(block_size);
+            batcher.predecessors(pbs, data.xs.data() + current, data.page_id.data() + current, block_size, results.data());
+            for (auto res : results) sum += res;
+            const u64 end = nowMicros();
+            query_time += end - start;
+        }
+        else {
+            std::cout << "Unsupported operation. Exiting.\n";
+            exit(1);
+        }
+        current = block_end;
+    }
 
-    auto all_ok = "\033[32;1mOK: the sum checks out\033[0m\n";
-    auto error  = "\033[31;1mERROR: they differ!\033[0m\n";
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    std::cout << "Query time: " << query_time << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    std::cout << "--------------------\n";
 
-    if (baseline.sum == testing.sum) std::cout << all_ok;
-    else std::cout << error;
+    return {.structure_name = pbs.name() + " (sorted blocks)", .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
 
-    std::cout << "Time PBS / Set\nInsertion: " 
-              << (double)testing.insertion_time / (double)baseline.insertion_time 
-              << "\nQuery: " << (double)testing.query_time / (double)baseline.query_time << "\n";
-    std::cout << "-----------------------\n";
+// Pins the calling thread to one core
+void pin_to_core(u64 core){
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core, &cpu_set);
+    if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0){
+        std::cout << "Could not pin thread to core " << core << "\n";
+    }
 }
 
-int main(void){
+// Read-only query throughput on 1..all cores. All insertions are done first
+// and the structure is frozen; the query page visits are then split into
+// contiguous chunks, one per thread, with thread i pinned to core i.
+template <typename pbs_structure>
+void test_pbs_parallel_queries(TestData& test_data){
+    TestData frozen_data;
+    for (auto op : {TestData::Op::Insert, TestData::Op::Query}){
+        for (u64 i = 0; i < test_data.ops.size(); i++){
+            if (test_data.ops[i] != op) continue;
+            frozen_data.ops.push_back(op);
+            frozen_data.xs.push_back(test_data.xs[i]);
+        }
+    }
 
-    srand(seed_val);
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Parallel queries on " << pbs.name() << "\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(frozen_data);
+    using Data = PbsTestData<pbs_structure>;
 
-    //u64 universe_size = 0xFFFFFFFFFFFFFFF0;
-    
-    // the setting universe_size = 3000000, n = 1000000, n_rounds = 2, seed_val = 996241586,
-    // and TestData data = generate_test_data(universe_size,n,n/1000,n_rounds);
-    // leads to a bug with test_pbs_data_structure<PBSPageBearerHashing<32>>(data),
-    // Only care about this if you're actually going to use the structure.
-    // I'm fairly certain the bug is in PBSPageBearerHashing and not in LinearProbing. 
-    
-    u64 universe_size = 3000000;
-    u64 n   = 1000000;
-    u64 n_rounds = 2;
-    TestData data = generate_test_data(universe_size,n,n/1000,n_rounds);
+    u64 first_query = 0;
+    while (first_query < data.ops.size() && data.ops[first_query] == Data::Op::Insert){
+        pbs.try_insert_in_page(data.xs[first_query], data.page_id[first_query]);
+        first_query++;
+    }
+    const u64 n_queries = data.ops.size() - first_query;
+    const u64 n_cores   = std::max(1u, std::thread::hardware_concurrency());
 
-    const u64 epsilon = 32;
-    //auto baseline = test_pbs_data_structure<MapAndVecPBS<epsilon>>(data);
-    auto baseline = test_set_data_structure(data);
+    u64 single_thread_sum = 0;
+    for (u64 n_threads = 1; n_threads <= n_cores; n_threads++){
+        std::vector<u64> sums(n_threads), times(n_threads), counts(n_threads);
+        std::atomic<u64> n_ready = 0;
 
-    std::vector<TestResult> results = {
-        test_pbs_data_structure<PBSPageBearerHashing<epsilon>>(data),
-        //test_pbs_data_structure<PBSBitTricks<epsilon>>(data),
-        //test_pbs_data_structure<MapAndVecPBS<epsilon>>(data),
-        //test_pbs_data_structure<PBSEpsilon8>(data),
-        //test_pbs_data_structure<PBSLinearProbing<8>>(data),
+        auto run_chunk = [&](u64 t){
+            pin_to_core(t);
+            const u64 begin = first_query + n_queries * t / n_threads;
+            const u64 end   = first_query + n_queries * (t + 1) / n_threads;
+            n_ready++;
+            while (n_ready.load() < n_threads) {}
+
+            u64 sum = 0;
+            const u64 start = nowNanos();
+            for (u64 i = begin; i < end; i++){
+                sum += pbs.try_predecessor_in_page(data.xs[i], data.page_id[i]);
+            }
+            times[t]  = nowNanos() - start;
+            sums[t]   = sum;
+            counts[t] = end - begin;
+        };
+
+        std::vector<std::thread> threads;
+        for (u64 t = 0; t < n_threads; t++) threads.emplace_back(run_chunk, t);
+        for (auto& thread : threads) thread.join();
+
+        u64 sum = 0, slowest = 1;
+        for (u64 t = 0; t < n_threads; t++){
+            sum += sums[t];
+            slowest = std::max(slowest, times[t]);
+        }
+        if (n_threads == 1) single_thread_sum = sum;
+
+        std::cout << n_threads << " threads: " << (double)n_queries * 1e9 / slowest << " page visits/s, ns per visit:";
+        for (u64 t = 0; t < n_threads; t++) std::cout << " " << (counts[t] ? (double)times[t] / counts[t] : 0);
+        if (sum != single_thread_sum) std::cout << " \033[31;1mERROR: sum differs from 1 thread\033[0m";
+        std::cout << "\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+// Insert throughput on 1..all cores, for the concurrent structures and
+// MutexPBS. The insert page visits are split into contiguous chunks, one per
+// thread, and inserted into a fresh structure; the queries are then answered
+// on one thread, and their sum must not depend on the number of threads.
+template <typename pbs_structure>
+void test_pbs_parallel_inserts(TestData& test_data){
+    TestData frozen_data;
+    for (auto op : {TestData::Op::Insert, TestData::Op::Query}){
+        for (u64 i = 0; i < test_data.ops.size(); i++){
+            if (test_data.ops[i] != op) continue;
+            frozen_data.ops.push_back(op);
+            frozen_data.xs.push_back(test_data.xs[i]);
+        }
+    }
+
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(frozen_data);
+    using Data = PbsTestData<pbs_structure>;
+
+    u64 n_inserts = 0;
+    while (n_inserts < data.ops.size() && data.ops[n_inserts] == Data::Op::Insert) n_inserts++;
+    const u64 n_cores = std::max(1u, std::thread::hardware_concurrency());
+
+    u64 single_thread_sum = 0;
+    for (u64 n_threads = 1; n_threads <= n_cores; n_threads++){
+        auto pbs = std::make_unique<pbs_structure>();
+        if (n_threads == 1) std::cout << "Parallel inserts on " << pbs->name() << "\n";
+        std::atomic<u64> n_ready = 0;
+
+        auto run_chunk = [&](u64 t){
+            pin_to_core(t);
+            const u64 begin = n_inserts * t / n_threads;
+            const u64 end   = n_inserts * (t + 1) / n_threads;
+            n_ready++;
+            while (n_ready.load() < n_threads) {}
+            for (u64 i = begin; i < end; i++) pbs->try_insert_in_page(data.xs[i], data.page_id[i]);
+        };
+
+        const u64 start = nowNanos();
+        std::vector<std::thread> threads;
+        for (u64 t = 0; t < n_threads; t++) threads.emplace_back(run_chunk, t);
+        for (auto& thread : threads) thread.join();
+        const u64 time = nowNanos() - start;
+
+        u64 sum = 0;
+        for (u64 i = n_inserts; i < data.ops.size(); i++){
+            sum += pbs->try_predecessor_in_page(data.xs[i], data.page_id[i]);
+        }
+        if (n_threads == 1) single_thread_sum = sum;
+
+        std::cout << n_threads << " threads: " << (double)n_inserts * 1e9 / time << " page visits/s";
+        if (sum != single_thread_sum) std::cout << " \033[31;1mERROR: sum differs from 1 thread\033[0m";
+        std::cout << "\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+// Query streams with and without a PageFinger, on sorted, nearly sorted and
+// random query orders. All insertions are done first, then each stream is
+// answered twice over the same frozen structure and the sums must agree.
+template <typename pbs_structure>
+void test_pbs_finger_queries(TestData& test_data){
+    std::vector<u64> inserted, random_queries;
+    for (u64 i = 0; i < test_data.ops.size(); i++){
+        if (test_data.ops[i] == TestData::Op::Insert) inserted.push_back(test_data.xs[i]);
+        else random_queries.push_back(test_data.xs[i]);
+    }
+
+    std::vector<u64> sorted_queries = random_queries;
+    std::sort(sorted_queries.begin(), sorted_queries.end());
+
+    // Sorted, except that one query in ten swaps places with one up to 64 later
+    std::vector<u64> nearly_sorted_queries = sorted_queries;
+    MTRng order_rng(seed_val);
+    std::uniform_int_distribution<u64> offset(1, 64);
+    for (u64 i = 0; i + 64 < nearly_sorted_queries.size(); i += 10){
+        std::swap(nearly_sorted_queries[i], nearly_sorted_queries[i + offset(order_rng)]);
+    }
+
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Finger queries on " << pbs.name() << "\n";
+
+    auto stream_data = [&](const std::vector<u64>& queries){
+        TestData frozen_data;
+        frozen_data.ops.assign(inserted.size(), TestData::Op::Insert);
+        frozen_data.xs = inserted;
+        frozen_data.ops.insert(frozen_data.ops.end(), queries.size(), TestData::Op::Query);
+        frozen_data.xs.insert(frozen_data.xs.end(), queries.begin(), queries.end());
+        return generate_pbs_test_data<pbs_structure>(frozen_data);
     };
 
+    using Data = PbsTestData<pbs_structure>;
+    bool built = false;
+    for (auto [stream_name, queries] : {std::pair{"sorted", &sorted_queries},
+                                        std::pair{"nearly sorted", &nearly_sorted_queries},
+                                        std::pair{"random", &random_queries}}){
+        Data data = stream_data(*queries);
+        u64 first_query = 0;
+        while (first_query < data.ops.size() && data.ops[first_query] == Data::Op::Insert){
+            if (!built) pbs.try_insert_in_page(data.xs[first_query], data.page_id[first_query]);
+            first_query++;
+        }
+        built = true;
+
+        // Alternating runs, keeping the fastest of each, so that neither pays
+        // for the first touch of the pages or for a noisy neighbour
+        const u64 N_REPEATS = 5;
+        u64 plain_time = ~(u64)(0), finger_time = ~(u64)(0);
+        u64 plain_sum = 0, finger_sum = 0;
+        typename pbs_structure::Finger finger;
+        for (u64 repeat = 0; repeat < N_REPEATS; repeat++){
+            plain_sum = 0;
+            u64 start = nowMicros();
+            for (u64 i = first_query; i < data.ops.size(); i++){
+                plain_sum += pbs.try_predecessor_in_page(data.xs[i], data.page_id[i]);
+            }
+            plain_time = std::min(plain_time, nowMicros() - start);
+
+            finger = typename pbs_structure::Finger();
+            finger_sum = 0;
+            start = nowMicros();
+            for (u64 i = first_query; i < data.ops.size(); i++){
+                finger_sum += pbs.try_predecessor_in_page(data.xs[i], data.page_id[i], finger);
+            }
+            finger_time = std::min(finger_time, nowMicros() - start);
+        }
+
+        const u64 n_lookups = finger.n_hits + finger.n_misses;
+        std::cout << stream_name << ": " << plain_time << "us without finger, " << finger_time << "us with finger, "
+                  << (n_lookups ? 100.0 * finger.n_hits / n_lookups : 0) << "% finger hits, "
+                  << (finger.n_adjacent ? 100.0 * finger.n_adjacent_hits / finger.n_adjacent : 0)
+                  << "% on the " << finger.n_adjacent << " steps to an adjacent page";
+        if (plain_sum != finger_sum) std::cout << " \033[31;1mERROR: sums differ\033[0m";
+        std::cout << "\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+// Writes the ops of test_data to a trace without page ids, enough for std::set
+void write_trace(TestData& data, const std::string& path){
+    TraceWriter writer(path, false);
+    for (u64 i = 0; i < data.ops.size(); i++){
+        auto op = data.ops[i] == TestData::Op::Insert ? TraceRecord::Insert : TraceRecord::Query;
+        writer.write(op, data.xs[i]);
+    }
+    writer.close();
+}
+
+// Writes the ops of test_data together with their page walks for pbs_structure.
+// A walk always ends at a page bearer, which is how we find where it ends.
+template <typename pbs_structure>
+void write_pbs_trace(TestData& test_data, const std::string& path){
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    TraceWriter writer(path, true);
+    const u64 N = data.ops.size();
+    u64 walk_begin = 0;
+    for (u64 i = 0; i < N; i++){
+        if (!pbs_structure::is_id_page_bearer(data.page_id[i])) continue;
+        auto op = data.ops[i] == Data::Op::Insert ? TraceRecord::Insert : TraceRecord::Query;
+        writer.write(op, data.xs[i], data.page_id.data() + walk_begin, i + 1 - walk_begin);
+        walk_begin = i + 1;
+    }
+    writer.close();
+}
+
+TestResult replay_set_trace(const std::string& path){
+    TraceReader trace(path);
+    std::set<u64> set;
+    set.insert(0);
+    u64 insertion_time = 0;
+    u64 query_time = 0;
+    u64 sum = 0;
+
+    TraceRecord record;
+    bool has_record = trace.next(record);
+    while (has_record){
+        const auto block_op = record.op;
+        const u64 start = nowMicros();
+        while (has_record && record.op == block_op){
+            if (record.op == TraceRecord::Insert) set.insert(record.key);
+            else {
+                auto pt = set.upper_bound(record.key);
+                pt--;
+                sum += *pt;
+            }
+            has_record = trace.next(record);
+        }
+        const u64 end = nowMicros();
+        if (block_op == TraceRecord::Insert) insertion_time += end - start;
+        else query_time += end - start;
+    }
+
+    std::cout << "Replaying " << path << " on regular set\n";
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    std::cout << "Query time: " << query_time << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    std::cout << "--------------------\n";
+    return {.structure_name = "std::set", .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
+
+// Same as test_pbs_data_structure, but streams the ops and page walks from a
+// trace written by write_pbs_trace for the same kind of structure
+template <typename pbs_structure>
+TestResult replay_pbs_trace(const std::string& path){
+    TraceReader trace(path);
+    if (!trace.has_page_ids()) std::cout << "Trace " << path << " has no page ids. Exiting.\n", exit(1);
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Replaying " << path << " on " << pbs.name() << "\n";
+    u64 insertion_time = 0;
+    u64 query_time = 0;
+    u64 sum = 0;
+
+    TraceRecord record;
+    bool has_record = trace.next(record);
+    while (has_record){
+        const auto block_op = record.op;
+        const u64 start = nowMicros();
+        while (has_record && record.op == block_op){
+            if (record.op == TraceRecord::Insert){
+                for (u64 p = 0; p < record.n_pages; p++) pbs.try_insert_in_page(record.key, record.page_ids[p]);
+            }
+            else {
+                for (u64 p = 0; p < record.n_pages; p++) sum += pbs.try_predecessor_in_page(record.key, record.page_ids[p]);
+            }
+            has_record = trace.next(record);
+        }
+        const u64 end = nowMicros();
+        if (block_op == TraceRecord::Insert) insertion_time += end - start;
+        else query_time += end - start;
+    }
+
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    std::cout << "Query time: " << query_time << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    std::cout << "--------------------\n";
+    return {.structure_name = pbs.name(), .sum = sum, .insertion_time = insertion_time, .query_time = query_time};
+}
+
+// Insert throughput in memory and through a WriteAheadLog with each of the
+// commit batch sizes, counting the final sync. Each log is then replayed into
+// a fresh structure, whose query sum must match the one built in memory.
+template <typename pbs_structure>
+void test_pbs_logged_inserts(TestData& test_data, const std::string& path, std::vector<u64> commit_batches){
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    const u64 N = data.ops.size();
+
+    auto insert_all = [&](auto& pbs){
+        for (u64 i = 0; i < N; i++){
+            if (data.ops[i] == Data::Op::Insert) pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+        }
+    };
+    auto query_sum = [&](auto& pbs){
+        u64 sum = 0;
+        for (u64 i = 0; i < N; i++){
+            if (data.ops[i] == Data::Op::Query) sum += pbs.try_predecessor_in_page(data.xs[i], data.page_id[i]);
+        }
+        return sum;
+    };
+    u64 n_inserts = 0;
+    for (u64 i = 0; i < N; i++) n_inserts += data.ops[i] == Data::Op::Insert;
+
+    pbs_structure in_memory = pbs_structure();
+    std::cout << "Logged inserts on " << in_memory.name() << "\n";
+    u64 start = nowMicros();
+    insert_all(in_memory);
+    const u64 in_memory_time = nowMicros() - start;
+    const u64 expected_sum   = query_sum(in_memory);
+    std::cout << "In memory: " << in_memory_time << "us, " << (double)n_inserts * 1e6 / in_memory_time << " page visits/s\n";
+
+    for (u64 commit_batch : commit_batches){
+        unlink(path.c_str());
+        u64 time, n_syncs;
+        {
+            LoggedPBS<pbs_structure> logged(path, commit_batch);
+            start = nowMicros();
+            insert_all(logged);
+            logged.log.sync();
+            time = nowMicros() - start;
+            logged.log.close();
+            n_syncs = logged.log.n_syncs;
+        }
+
+        start = nowMicros();
+        pbs_structure replayed = pbs_structure();
+        u64 n_records;
+        replay_log(replayed, path, &n_records);
+        const u64 replay_time = nowMicros() - start;
+
+        std::cout << "Group commit of " << commit_batch << ": " << time << "us, " << (double)n_inserts * 1e6 / time
+                  << " page visits/s, " << n_syncs << " syncs, replay of " << n_records << " records " << replay_time << "us";
+        if (query_sum(replayed) != expected_sum) std::cout << " \033[31;1mERROR: replayed structure differs\033[0m";
+        std::cout << "\n";
+    }
+    unlink(path.c_str());
+    std::cout << "--------------------\n";
+}
+
+// Replays logs whose end was torn by a crash: a partial record, and whole
+// records of zeros, which is what is left when the file was extended but its
+// data never reached the disk. Replay must stop after the good records, and
+// the log must take appends again after them.
+bool check_wal_torn_tails(const std::string& path){
+    const u64 N_RECORDS = 9;
+    const u64 RECORDS_START = sizeof(WalHeader);
+    auto element = [](u64 i){ return 64 * i + i; };
+    auto replayed_ok = [&](u64 n_expected){
+        PBSEpsilon8 replayed = PBSEpsilon8();
+        u64 n_records;
+        const u64 valid_bytes = replay_log(replayed, path, &n_records);
+        bool ok = n_records == n_expected && valid_bytes == RECORDS_START + n_expected * sizeof(WalRecord);
+        for (u64 i = 0; i < n_expected; i++) ok &= replayed.contains(element(i));
+        return ok;
+    };
+
+    const std::vector<std::pair<std::string, std::vector<u8>>> tails = {
+        {"a torn record",          std::vector<u8>(sizeof(WalRecord) / 2, 0xAB)},
+        {"three records of zeros", std::vector<u8>(3 * sizeof(WalRecord), 0)},
+    };
+    bool all_ok = true;
+    for (const auto& [tail_name, tail] : tails){
+        unlink(path.c_str());
+        {
+            LoggedPBS<PBSEpsilon8> logged(path, 1);
+            for (u64 i = 0; i < N_RECORDS; i++) logged.try_insert_in_page(element(i), PBSEpsilon8::get_id(element(i)));
+        }
+        const int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        const bool appended = fd >= 0 && write(fd, tail.data(), tail.size()) == (ssize_t)tail.size();
+        if (fd >= 0) ::close(fd);
+
+        bool ok = appended && replayed_ok(N_RECORDS);
+        // Restarting cuts the tail off, and the next record goes after the good ones
+        {
+            LoggedPBS<PBSEpsilon8> logged(path, 1);
+            ok &= logged.n_replayed == N_RECORDS;
+            logged.try_insert_in_page(element(N_RECORDS), PBSEpsilon8::get_id(element(N_RECORDS)));
+        }
+        ok &= replayed_ok(N_RECORDS + 1);
+
+        if (ok) std::cout << "\033[32;1mOK: log replay stops at " << tail_name << "\033[0m\n";
+        else std::cout << "\033[31;1mERROR: log replay does not stop at " << tail_name << "\033[0m\n";
+        all_ok &= ok;
+    }
+    unlink(path.c_str());
+    return all_ok;
+}
+
+// A LoggedPBS pointed at a file that is not a log must exit and leave the
+// file alone. It runs in a child process, as it exits. An empty file gets
+// a new log.
+bool check_wal_keeps_foreign_file(const std::string& path){
+    const std::string contents = "not a log, but somebody's data\n";
+    auto write_file = [&](const std::string& data){
+        unlink(path.c_str());
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        const bool written = fd >= 0 && write(fd, data.data(), data.size()) == (ssize_t)data.size();
+        if (fd >= 0) ::close(fd);
+        return written;
+    };
+    auto run_logged = [&]{
+        std::cout.flush(); // or the child prints it again
+        const pid_t pid = fork();
+        if (pid == 0){
+            std::cout.setstate(std::ios::failbit); // the message is expected
+            LoggedPBS<PBSEpsilon8> logged(path, 1);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    };
+
+    bool ok = write_file(contents) && run_logged() == 1;
+    std::string kept(contents.size() + 1, 0);
+    const int fd = open(path.c_str(), O_RDONLY);
+    ok &= fd >= 0 && read(fd, kept.data(), kept.size()) == (ssize_t)contents.size() && kept.substr(0, contents.size()) == contents;
+    if (fd >= 0) ::close(fd);
+
+    ok &= write_file("") && run_logged() == 0;
+    {
+        LoggedPBS<PBSEpsilon8> logged(path, 1);
+        ok &= logged.n_replayed == 0;
+    }
+    unlink(path.c_str());
+
+    if (ok) std::cout << "\033[32;1mOK: a file that is not a log is left alone\033[0m\n";
+    else std::cout << "\033[31;1mERROR: a file that is not a log was overwritten\033[0m\n";
+    return ok;
+}
+
+// Inserts everything, then probes the pages of n_probes uniformly random keys
+// directly. In a sparse universe most of these pages do not exist, which is
+// the case a filter in front of the page index is for.
+template <typename pbs_structure>
+void test_pbs_absent_page_probes(TestData& test_data, u64 universe_size, u64 n_probes){
+    pbs_structure pbs = pbs_structure();
+    for (u64 i = 0; i < test_data.ops.size(); i++){
+        if (test_data.ops[i] == TestData::Op::Insert) pbs.try_insert_in_page(test_data.xs[i], pbs_structure::get_id(test_data.xs[i]));
+    }
+
+    // Own generator, so every structure gets the same probes
+    MTRng probe_rng(seed_val);
+    std::uniform_int_distribution<u64> uniform(0, universe_size);
+    std::vector<u64> probes(n_probes);
+    for (auto& x : probes) x = uniform(probe_rng);
+
+    u64 sum = 0;
+    u64 n_found = 0;
+    const u64 start = nowMicros();
+    for (auto x : probes){
+        const u64 res = pbs.try_predecessor_in_page(x, pbs_structure::get_id(x));
+        n_found += res != 0;
+        sum += res;
+    }
+    const u64 end = nowMicros();
+
+    std::cout << "Probing random pages of " << pbs.name() << "\n";
+    std::cout << "Probes: " << n_probes << ", hits: " << n_found << "\n";
+    std::cout << "Probe time: " << end - start << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    std::cout << "--------------------\n";
+}
+
+// Inserts everything, then checks membership of n_probes uniformly random
+// keys, one at a time with contains() and 8 at a time with contains_batch().
+// The number of members found must match std::set.
+template <typename pbs_structure>
+void test_pbs_membership(TestData& test_data, u64 universe_size, u64 n_probes){
+    pbs_structure pbs = pbs_structure();
+    std::set<u64> set;
+    for (u64 i = 0; i < test_data.ops.size(); i++){
+        if (test_data.ops[i] != TestData::Op::Insert) continue;
+        pbs.try_insert_in_page(test_data.xs[i], pbs_structure::get_id(test_data.xs[i]));
+        set.insert(test_data.xs[i]);
+    }
+
+    MTRng probe_rng(seed_val);
+    std::uniform_int_distribution<u64> uniform(0, universe_size);
+    n_probes -= n_probes % 8;
+    std::vector<u64> probes(n_probes);
+    for (auto& x : probes) x = uniform(probe_rng);
+
+    u64 n_members = 0;
+    for (auto x : probes) n_members += set.count(x);
+
+    u64 n_found_scalar = 0;
+    const u64 scalar_start = nowMicros();
+    for (auto x : probes) n_found_scalar += pbs.contains(x);
+    const u64 scalar_time = nowMicros() - scalar_start;
+
+    u64 n_found_batch = 0;
+    const u64 batch_start = nowMicros();
+    for (u64 i = 0; i < n_probes; i += 8) n_found_batch += __builtin_popcount(pbs.contains_batch(probes.data() + i));
+    const u64 batch_time = nowMicros() - batch_start;
+
+    std::cout << "Membership in " << pbs.name() << "\n";
+    std::cout << "Probes: " << n_probes << ", members: " << n_members << "\n";
+    std::cout << "contains: " << scalar_time << "us, contains_batch: " << batch_time << "us\n";
+    if (n_found_scalar != n_members || n_found_batch != n_members){
+        std::cout << "\033[31;1mERROR: found " << n_found_scalar << " one at a time and " << n_found_batch << " in batches\033[0m\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+// Key-value mode: every key is inserted with a value derived from it, and
+// every query gets the key and the value of its predecessor. The value must
+// belong to the key, and the sum of the keys must match std::set.
+inline u64 map_test_value(u64 x){
+    return x * 0x9E3779B97F4A7C15;
+}
+
+template <typename pbs_map>
+TestResult test_pbs_map(TestData& test_data){
+    pbs_map pbs = pbs_map();
+    std::cout << "Testing " << pbs.name() << "\n";
+    PbsTestData<pbs_map> data = generate_pbs_test_data<pbs_map>(test_data);
+    using Data = PbsTestData<pbs_map>;
+
+    u64 insertion_time = 0;
+    u64 query_time     = 0;
+    u64 sum            = 0;
+    u64 n_wrong_values = 0;
+    u64 current = 0;
+    const u64 N = data.ops.size();
+    while (current < N){
+        const auto op = data.ops[current];
+        const u64 start = nowMicros();
+        for (; current < N && data.ops[current] == op; current++){
+            const u64 x = data.xs[current];
+            if (op == Data::Op::Insert){
+                pbs.try_insert_in_page(x, data.page_id[current], map_test_value(x));
+                continue;
+            }
+            decltype(pbs_map::get_id(x)) key;
+            u64 value;
+            if (!pbs.try_predecessor_in_page(x, data.page_id[current], key, value)) continue;
+            sum += key;
+            n_wrong_values += value != map_test_value(key);
+        }
+        (op == Data::Op::Insert ? insertion_time : query_time) += nowMicros() - start;
+    }
+
+    const MemoryUsage usage = pbs.memory_usage();
+    const u64 n_elements    = count_distinct_insertions(test_data);
+
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    std::cout << "Query time: " << query_time << "us\n";
+    std::cout << "Sum: " << sum << "\n";
+    if (n_wrong_values > 0) std::cout << "\033[31;1mERROR: " << n_wrong_values << " wrong values\033[0m\n";
+    usage.print(n_elements);
+    std::cout << "--------------------\n";
+
+    return {.structure_name = pbs.name(), .sum = sum, .insertion_time = insertion_time, .query_time = query_time,
+            .bytes_per_element = (double)usage.total() / n_elements};
+}
+
+// Inserts everything, freezes the structure and answers the queries with
+// both, the mutable structure and the frozen one. Use with one block of
+// insertions followed by queries, so the walks are those of the final set.
+template <typename pbs_structure>
+TestResult test_pbs_frozen(TestData& test_data){
+    pbs_structure pbs = pbs_structure();
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+
+    const u64 insertion_start = nowMicros();
+    for (u64 i = 0; i < data.ops.size(); i++){
+        if (data.ops[i] == Data::Op::Insert) pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+    }
+    const u64 insertion_time = nowMicros() - insertion_start;
+
+    const u64 freeze_start = nowMicros();
+    auto frozen = freeze(pbs);
+    const u64 freeze_time = nowMicros() - freeze_start;
+
+    auto time_queries = [&](auto& structure, u64& sum){
+        sum = 0;
+        u64 n_queries = 0;
+        const u64 start = nowMicros();
+        for (u64 i = 0; i < data.ops.size(); i++){
+            if (data.ops[i] != Data::Op::Query) continue;
+            sum += structure.try_predecessor_in_page(data.xs[i], data.page_id[i]);
+            n_queries++;
+        }
+        const u64 time = nowMicros() - start;
+        std::cout << "Query time: " << time << "us, " << (double)n_queries / std::max((u64)(1), time) << " page visits per us\n";
+        return time;
+    };
+
+    const u64 n_elements = count_distinct_insertions(test_data);
+    std::cout << "Testing " << pbs.name() << "\n";
+    std::cout << "Insertion time: " << insertion_time << "us\n";
+    u64 mutable_sum;
+    time_queries(pbs, mutable_sum);
+    pbs.memory_usage().print(n_elements);
+
+    std::cout << "Frozen into " << frozen.name() << "\n";
+    std::cout << "Build time: " << freeze_time << "us\n";
+    u64 sum;
+    const u64 query_time = time_queries(frozen, sum);
+    const MemoryUsage usage = frozen.memory_usage();
+    usage.print(n_elements);
+    if (sum != mutable_sum) std::cout << "\033[31;1mERROR: sum " << sum << ", mutable " << mutable_sum << "\033[0m\n";
+    std::cout << "--------------------\n";
+
+    return {.structure_name = frozen.name(), .sum = sum, .insertion_time = insertion_time + freeze_time, .query_time = query_time,
+            .bytes_per_element = (double)usage.total() / n_elements};
+}
+
+// An endless stream of increasing timestamps with random gaps of mean_gap,
+// in blocks of inserts each followed by as many queries for random times in
+// the window. Every answer is checked against a std::set that drops the keys
+// leaving the window. The peak memory should depend on the window only, not
+// on the length of the stream; the same structure without expiry is shown for
+// comparison.
+template <typename pbs_structure>
+void test_pbs_sliding_window(u64 n_insertions, u64 window, u64 mean_gap){
+    const u64 BLOCK = 1 << 12;
+    SlidingWindowPBS<pbs_structure> pbs(window);
+    pbs_structure unbounded = pbs_structure();
+    std::set<u64> reference;
+    MTRng stream_rng(seed_val);
+    std::uniform_int_distribution<u64> gap(1, 2 * mean_gap - 1);
+    std::uniform_int_distribution<u64> age(0, window);
+
+    u64 now = 0;
+    u64 insertion_time = 0;
+    u64 query_time     = 0;
+    u64 sum            = 0;
+    u64 expected_sum   = 0;
+    u64 peak_bytes     = 0;
+    std::vector<u64> xs(BLOCK);
+    std::vector<u64> page_ids(BLOCK);
+    for (u64 done = 0; done < n_insertions; done += BLOCK){
+        for (auto& x : xs) x = now += gap(stream_rng);
+
+        const u64 insertion_start = nowMicros();
+        for (u64 x : xs) pbs.try_insert_in_page(x, pbs_structure::get_id(x));
+        insertion_time += nowMicros() - insertion_start;
+
+        for (u64 x : xs) unbounded.try_insert_in_page(x, pbs_structure::get_id(x));
+        reference.insert(xs.begin(), xs.end());
+        reference.erase(reference.begin(), reference.lower_bound(pbs.window_start()));
+
+        // The page of the predecessor in the window, if there is one
+        for (u64 i = 0; i < BLOCK; i++){
+            const u64 t  = now - std::min(now, age(stream_rng));
+            auto pt      = reference.upper_bound(t);
+            const u64 expected = pt == reference.begin() ? 0 : *std::prev(pt);
+            xs[i]        = t;
+            page_ids[i]  = expected == 0 ? pbs_structure::get_id(t) : pbs_structure::get_id(expected);
+            expected_sum += expected;
+        }
+        const u64 query_start = nowMicros();
+        for (u64 i = 0; i < BLOCK; i++) sum += pbs.try_predecessor_in_page(xs[i], page_ids[i]);
+        query_time += nowMicros() - query_start;
+
+        peak_bytes = std::max(peak_bytes, pbs.memory_usage().total());
+    }
+
+    std::cout << "Sliding window of " << pbs.name() << "\n";
+    std::cout << "Insertions: " << n_insertions << ", keys in the window at the end: " << reference.size() << "\n";
+    std::cout << "Insertion time: " << insertion_time << "us, query time: " << query_time << "us\n";
+    std::cout << "Sweeps: " << pbs.n_sweeps << ", pages expired: " << pbs.n_pages_expired << "\n";
+    std::cout << "Peak memory: " << peak_bytes << " bytes, " << (double)peak_bytes / reference.size() << " per key in the window\n";
+    std::cout << "Without expiry: " << unbounded.memory_usage().total() << " bytes\n";
+    if (sum == expected_sum) std::cout << "\033[32;1mOK: the sum checks out\033[0m\n";
+    else std::cout << "\033[31;1mERROR: sum " << sum << ", expected " << expected_sum << "\033[0m\n";
+    std::cout << "--------------------\n";
+}
+
+// Union, intersection and difference of two random sets of n_elements each:
+// element by element, reinserting the elements of the result into a new
+// structure (into a copy of the first set for the union), vs combining whole
+// pages with union_with() etc. on 1, 2, 4 .. max_threads threads.
+template <typename pbs_structure>
+void test_pbs_set_operations(u64 universe_size, u64 n_elements, u64 max_threads){
+    MTRng set_rng(seed_val);
+    std::uniform_int_distribution<u64> dist(1, universe_size - 1);
+    pbs_structure a = pbs_structure();
+    pbs_structure b = pbs_structure();
+    std::set<u64> a_set, b_set;
+    for (u64 i = 0; i < n_elements; i++){
+        const u64 x = dist(set_rng), y = dist(set_rng);
+        a.try_insert_in_page(x, pbs_structure::get_id(x));
+        b.try_insert_in_page(y, pbs_structure::get_id(y));
+        a_set.insert(x);
+        b_set.insert(y);
+    }
+    std::cout << "Set operations on " << a.name() << ", " << a_set.size() << " and " << b_set.size() << " elements\n";
+
+    auto check = [](pbs_structure& result, const std::vector<u64>& expected){
+        std::vector<u64> elements;
+        result.for_each_element([&](u64 x){ elements.push_back(x); });
+        std::sort(elements.begin(), elements.end());
+        return elements == expected;
+    };
+
+    std::vector<u64> expected;
+    auto run = [&](const std::string& op, auto element_wise, auto bulk){
+        u64 start = nowMicros();
+        pbs_structure reinserted = element_wise();
+        const u64 element_wise_time = nowMicros() - start;
+        bool ok = check(reinserted, expected);
+        std::cout << op << ": " << expected.size() << " elements. Element-wise: " << element_wise_time << "us";
+        for (u64 n_threads = 1; n_threads <= max_threads; n_threads *= 2){
+            pbs_structure result = a;
+            start = nowMicros();
+            bulk(result, n_threads);
+            std::cout << ", " << n_threads << " thread(s): " << nowMicros() - start << "us";
+            ok &= check(result, expected);
+        }
+        std::cout << "\n";
+        if (ok) std::cout << "\033[32;1mOK: the elements match std::set\033[0m\n";
+        else std::cout << "\033[31;1mERROR: the elements do not match std::set\033[0m\n";
+    };
+
+    expected.clear();
+    std::set_union(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    run("Union", [&]{
+        pbs_structure result = a;
+        b.for_each_element([&](u64 x){ result.try_insert_in_page(x, pbs_structure::get_id(x)); });
+        return result;
+    }, [&](pbs_structure& result, u64 n_threads){ result.union_with(b, n_threads); });
+
+    expected.clear();
+    std::set_intersection(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    run("Intersection", [&]{
+        pbs_structure result = pbs_structure();
+        a.for_each_element([&](u64 x){ if (b.contains(x)) result.try_insert_in_page(x, pbs_structure::get_id(x)); });
+        return result;
+    }, [&](pbs_structure& result, u64 n_threads){ result.intersect_with(b, n_threads); });
+
+    expected.clear();
+    std::set_difference(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(), std::back_inserter(expected));
+    run("Difference", [&]{
+        pbs_structure result = pbs_structure();
+        a.for_each_element([&](u64 x){ if (!b.contains(x)) result.try_insert_in_page(x, pbs_structure::get_id(x)); });
+        return result;
+    }, [&](pbs_structure& result, u64 n_threads){ result.difference_with(b, n_threads); });
+    std::cout << "--------------------\n";
+}
+
+// Query latency on a snapshot while the structure goes on taking inserts.
+// The first block of insertions goes in and a snapshot of it is taken. Its
+// queries then run on the snapshot on another thread, first with nothing
+// else going on, then over and over while this thread inserts the rest of
+// the test data and takes (and drops) another snapshot every snapshot_every
+// insertions. Every pass must answer as for the first block only.
+template <typename pbs_structure>
+void test_pbs_snapshot_queries(TestData& test_data, u64 snapshot_every){
+    pbs_structure pbs = pbs_structure();
+    std::cout << "Snapshot queries of " << pbs.name() << "\n";
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    using Data = PbsTestData<pbs_structure>;
+    const u64 N = data.ops.size();
+
+    u64 first_query = 0;
+    for (; first_query < N && data.ops[first_query] == Data::Op::Insert; first_query++){
+        pbs.try_insert_in_page(data.xs[first_query], data.page_id[first_query]);
+    }
+    u64 end_of_queries = first_query;
+    while (end_of_queries < N && data.ops[end_of_queries] == Data::Op::Query) end_of_queries++;
+
+    // The answers as of the first block
+    std::set<u64> first_block = {0};
+    u64 expected_sum = 0;
+    u64 op = 0;
+    for (; op < test_data.ops.size() && test_data.ops[op] == TestData::Op::Insert; op++) first_block.insert(test_data.xs[op]);
+    for (; op < test_data.ops.size() && test_data.ops[op] == TestData::Op::Query; op++){
+        expected_sum += *std::prev(first_block.upper_bound(test_data.xs[op]));
+    }
+
+    u64 start = nowNanos();
+    auto snapshot = pbs.snapshot();
+    const u64 snapshot_time = nowNanos() - start;
+
+    auto run_queries = [&](std::vector<u64>& latencies){
+        u64 sum = 0;
+        for (u64 i = first_query; i < end_of_queries; i++){
+            const u64 query_start = nowNanos();
+            sum += snapshot->try_predecessor_in_page(data.xs[i], data.page_id[i]);
+            latencies.push_back(nowNanos() - query_start);
+        }
+        return sum;
+    };
+    std::vector<u64> idle, concurrent;
+    bool ok = run_queries(idle) == expected_sum;
+
+    std::atomic<bool> writer_done = false;
+    u64 n_passes = 0;
+    std::thread reader([&]{
+        do {
+            ok &= run_queries(concurrent) == expected_sum;
+            n_passes++;
+        } while (!writer_done);
+    });
+    u64 n_insertions = 0, n_snapshots = 0;
+    start = nowMicros();
+    for (u64 i = end_of_queries; i < N; i++){
+        if (data.ops[i] != Data::Op::Insert) continue;
+        pbs.try_insert_in_page(data.xs[i], data.page_id[i]);
+        if (++n_insertions % snapshot_every == 0){
+            pbs.snapshot();
+            n_snapshots++;
+        }
+    }
+    const u64 insertion_time = nowMicros() - start;
+    writer_done = true;
+    reader.join();
+
+    auto print_latencies = [](const std::string& label, std::vector<u64>& latencies){
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p){ return latencies[(u64)(p * (latencies.size() - 1))]; };
+        std::cout << label << ": p50 " << percentile(0.5) << "ns, p99 " << percentile(0.99)
+                  << "ns, p99.9 " << percentile(0.999) << "ns, max " << latencies.back() << "ns\n";
+    };
+    std::cout << "Snapshot taken in " << snapshot_time << "ns\n";
+    std::cout << "Writer: " << n_insertions << " page insertions in " << insertion_time << "us, "
+              << n_snapshots << " more snapshots";
+    if constexpr (requires { pbs.table.n_segment_copies; }) std::cout << ", " << pbs.table.n_segment_copies << " segments copied";
+    if constexpr (requires { pbs.n_pages_copied; }) std::cout << ", " << pbs.n_pages_copied << " pages copied";
+    std::cout << "\n";
+    if (!idle.empty()){
+        print_latencies("Page lookups on the snapshot, writer idle", idle);
+        print_latencies("Page lookups on the snapshot during inserts (" + std::to_string(n_passes) + " passes)", concurrent);
+    }
+    if (ok) std::cout << "\033[32;1mOK: every pass answers as of the snapshot\033[0m\n";
+    else std::cout << "\033[31;1mERROR: a pass does not answer as of the snapshot\033[0m\n";
+    std::cout << "--------------------\n";
+}
+
+// Ingest through a BufferedPBS for each buffer size, against the structure
+// without a buffer: insertions per second, including the last flush, and the
+// query time relative to the unbuffered structure. The answers must be the same.
+template <typename pbs_structure>
+void test_pbs_buffered(TestData& test_data, std::vector<u64> buffer_sizes){
+    using Buffered = BufferedPBS<pbs_structure>;
+    u64 n_insertions = 0;
+    for (auto op : test_data.ops) n_insertions += op == TestData::Op::Insert;
+
+    pbs_structure pbs = pbs_structure();
+    PbsTestData<pbs_structure> data = generate_pbs_test_data<pbs_structure>(test_data);
+    const TestResult plain = run_pbs_test_data(pbs, data);
+    std::cout << "Buffered inserts of " << plain.structure_name << "\n";
+    std::cout << "No buffer: " << (u64)(1e6 * n_insertions / std::max((u64)(1), plain.insertion_time)) << " insertions/s, "
+              << "insertion time " << plain.insertion_time << "us, query time " << plain.query_time << "us\n";
+
+    PbsTestData<Buffered> buffered_data = generate_pbs_test_data<Buffered>(test_data);
+    for (u64 buffer_size : buffer_sizes){
+        Buffered buffered(buffer_size);
+        TestResult result = run_pbs_test_data(buffered, buffered_data);
+        const u64 start = nowMicros();
+        buffered.flush();
+        result.insertion_time += nowMicros() - start;
+
+        std::cout << "Buffer of " << buffer_size << ": "
+                  << (u64)(1e6 * n_insertions / std::max((u64)(1), result.insertion_time)) << " insertions/s ("
+                  << (double)plain.insertion_time / std::max((u64)(1), result.insertion_time) << "x), query time "
+                  << (double)result.query_time / std::max((u64)(1), plain.query_time) << "x, "
+                  << buffered.n_flushes << " flushes";
+        if (result.sum == plain.sum) std::cout << " \033[32;1mOK\033[0m\n";
+        else std::cout << " \033[31;1mERROR: sum " << result.sum << ", expected " << plain.sum << "\033[0m\n";
+    }
+    std::cout << "--------------------\n";
+}
+
+void compare_results(TestResult baseline, TestResult testing){
+    std::cout << "-----------------------\n";
+    std::cout << "Comparing " << testing.structure_name << " to baseline " << baseline.structure_name << "\n";
+
+
+    auto all_ok = "\033[32;1mOK: the sum checks out\033[0m\n";
+    auto error  = "\033[31;1mERROR: they differ!\033[0m\n";
+
+    if (baseline.sum == testing.sum) std::cout << all_ok;
+    else std::cout << error;
+
+    std::cout << "Time PBS / Set\nInsertion: " 
+              << (double)testing.insertion_time / (double)baseline.insertion_time 
+              << "\nQuery: " << (double)testing.query_time / (double)baseline.query_time << "\n";
+    if (testing.bytes_per_element > 0){
+        std::cout << "Bytes per element: " << testing.bytes_per_element;
+        if (baseline.bytes_per_element > 0) std::cout << " (set: " << baseline.bytes_per_element << ")";
+        std::cout << "\n";
+    }
+    std::cout << "-----------------------\n";
+}
+
+// One structure on one workload of the regression suite, with its page
+// walks precomputed so that a run only times the structure
+struct RegressionCase {
+    std::string workload;
+    std::function<TestResult()> run;
+};
+
+template <typename pbs_structure>
+void add_regression_case(std::vector<RegressionCase>& cases, const std::string& workload, TestData& test_data){
+    auto data = std::make_shared<PbsTestData<pbs_structure>>(generate_pbs_test_data<pbs_structure>(test_data));
+    cases.push_back({.workload = workload, .run = [data]{
+        pbs_structure pbs = pbs_structure();
+        return run_pbs_test_data(pbs, *data);
+    }});
+}
+
+const u64 REGRESSION_RUNS         = 11;
+// The baseline in the source tree, wherever the binary runs from
+#ifdef PAGE_BEARER_SOURCE_DIR
+const std::string DEFAULT_REGRESSION_BASELINE = std::string(PAGE_BEARER_SOURCE_DIR) + "/regression_baseline.txt";
+#else
+const std::string DEFAULT_REGRESSION_BASELINE = "regression_baseline.txt";
+#endif
+const double REGRESSION_THRESHOLD = 0.1;  // slowdowns below 10% are not reported
+
+void print_regression_comparison(const std::string& phase, const RegressionComparison& cmp){
+    auto ratio = [](double r){
+        std::stringstream sstm;
+        sstm << std::fixed << std::setprecision(3) << r;
+        return sstm.str();
+    };
+    auto percent = [&](double r){
+        std::stringstream sstm;
+        sstm << std::showpos << std::fixed << std::setprecision(1) << 100 * (r / cmp.baseline_median - 1) << "%";
+        return sstm.str();
+    };
+    std::cout << "  " << phase << ": " << ratio(cmp.baseline_median) << " -> " << ratio(cmp.median) << " of std::set ("
+              << percent(cmp.median) << ", quartiles " << ratio(cmp.baseline_low) << " .. " << ratio(cmp.baseline_high)
+              << " -> " << ratio(cmp.low) << " .. " << ratio(cmp.high) << ", z "
+              << ratio(cmp.median >= cmp.baseline_median ? cmp.z_slower : -cmp.z_faster) << ")";
+    if (cmp.verdict == RegressionComparison::Slower)      std::cout << " \033[31;1mSLOWER\033[0m\n";
+    else if (cmp.verdict == RegressionComparison::Faster) std::cout << " \033[32;1mfaster\033[0m\n";
+    else std::cout << " ok\n";
+}
+
+// Runs every structure of a fixed set on a dense and a sparse workload
+// REGRESSION_RUNS times, and compares the timings with the baseline at
+// baseline_path (see perf_regression.hh), or replaces the baseline with them.
+// Every round times std::set on each workload first, and the cases of the
+// round are recorded as ratios to it. The runs of all cases are interleaved
+// so that drift of the machine hits them alike. Returns the number of
+// regressions: timings that are significantly slower than the baseline by
+// more than REGRESSION_THRESHOLD (see compare_timings), sums that differ
+// from the baseline or between runs, and cases the baseline does not have.
+u64 run_regression_suite(const std::string& baseline_path, bool update_baseline){
+    // Read first, so that a missing baseline fails before the runs
+    std::map<std::string, RegressionRecord> baseline;
+    if (!update_baseline) baseline = load_regression_baseline(baseline_path);
+
+    const u64 n = 400000;
+    // Reseeded for every workload, so they do not depend on what ran before
+    rng.seed(seed_val);
+    TestData dense = generate_test_data(3000000, n/2, n/2, 2);
+    rng.seed(seed_val);
+    TestData sparse = generate_test_data(1ull << 40, n/2, n/2, 2);
+
+    std::map<std::string, TestData*> workloads = {{"dense", &dense}, {"sparse", &sparse}};
+
+    std::vector<RegressionCase> cases;
+    add_regression_case<PBSEpsilon8>(cases, "dense", dense);
+    add_regression_case<PBSBitTricks<16>>(cases, "dense", dense);
+    add_regression_case<PBSBitTricks<32>>(cases, "dense", dense);
+    add_regression_case<PBSPageBearerHashing<16>>(cases, "dense", dense);
+    add_regression_case<PBSPageBearerHashing<32>>(cases, "dense", dense);
+    add_regression_case<MapAndVecPBS<32>>(cases, "dense", dense);
+    add_regression_case<PBSEpsilon8>(cases, "sparse", sparse);
+    add_regression_case<PBSBitTricks<32>>(cases, "sparse", sparse);
+    add_regression_case<PBSPageBearerHashing<32>>(cases, "sparse", sparse);
+    add_regression_case<MapAndVecPBS<32>>(cases, "sparse", sparse);
+
+    std::cout << "Regression suite: " << cases.size() << " cases, " << REGRESSION_RUNS << " runs each\n";
+    std::vector<RegressionRecord> records(cases.size());
+    std::vector<bool> consistent(cases.size(), true);
+    // One round to warm up the caches, the allocator and the clock first
+    for (const auto& [workload, data] : workloads){
+        std::set<u64> set;
+        run_set_test_data(set, *data);
+    }
+    for (const auto& c : cases) c.run();
+
+    for (u64 run = 0; run < REGRESSION_RUNS; run++){
+        std::map<std::string, TestResult> reference;
+        for (const auto& [workload, data] : workloads){
+            std::set<u64> set;
+            reference[workload] = run_set_test_data(set, *data);
+        }
+        for (u64 i = 0; i < cases.size(); i++){
+            const TestResult result = cases[i].run();
+            const TestResult& ref   = reference[cases[i].workload];
+            if (run > 0 && result.sum != records[i].sum) consistent[i] = false;
+            records[i].case_name = result.structure_name + " / " + cases[i].workload;
+            records[i].sum       = result.sum;
+            records[i].insertion_ratios.push_back((double)result.insertion_time / std::max(ref.insertion_time, (u64)(1)));
+            records[i].query_ratios.push_back((double)result.query_time / std::max(ref.query_time, (u64)(1)));
+        }
+    }
+
+    u64 n_regressions = 0;
+    for (u64 i = 0; i < cases.size(); i++){
+        if (!consistent[i]){
+            std::cout << records[i].case_name << "\n  \033[31;1mERROR: the sum differs between runs\033[0m\n";
+            n_regressions++;
+        }
+    }
+
+    if (update_baseline){
+        save_regression_baseline(baseline_path, records);
+        std::cout << "Wrote baseline " << baseline_path << "\n";
+        return n_regressions;
+    }
+
+    for (const auto& record : records){
+        std::cout << record.case_name << "\n";
+        auto pt = baseline.find(record.case_name);
+        if (pt == baseline.end()){
+            std::cout << "  \033[31;1mERROR: not in the baseline\033[0m\n";
+            n_regressions++;
+            continue;
+        }
+        const RegressionRecord& base = pt->second;
+        if (base.sum != record.sum){
+            std::cout << "  \033[31;1mERROR: sum " << record.sum << ", baseline " << base.sum << "\033[0m\n";
+            n_regressions++;
+        }
+        const auto insertion = compare_timings(base.insertion_ratios, record.insertion_ratios, REGRESSION_THRESHOLD);
+        const auto query     = compare_timings(base.query_ratios, record.query_ratios, REGRESSION_THRESHOLD);
+        print_regression_comparison("Insertion", insertion);
+        print_regression_comparison("Query", query);
+        n_regressions += (insertion.verdict == RegressionComparison::Slower) + (query.verdict == RegressionComparison::Slower);
+    }
+    std::cout << "--------------------\n";
+    if (n_regressions == 0) std::cout << "\033[32;1mOK: no regressions\033[0m\n";
+    else std::cout << "\033[31;1mERROR: " << n_regressions << " regressions\033[0m\n";
+    return n_regressions;
+}
+
+// Correctness checks of what the benchmarks do not exercise, for
+// `PageBearer checks`. Returns the number that failed.
+// A finger on a copy-on-write table, whose cached page is copied away from
+// a snapshot by an insertion that adds no page
+bool check_finger_after_snapshot(){
+    using pbs_structure = PBSEpsilon8WithTable<CowLinearProbing>;
+    auto pbs = pbs_structure();
+    typename pbs_structure::Finger finger;
+    const u64 id = pbs_structure::get_id(700);
+
+    pbs.try_insert_in_page(640, pbs_structure::get_id(640));
+    auto snapshot = pbs.snapshot();
+    const u64 before = pbs.try_predecessor_in_page(700, id, finger);
+    pbs.try_insert_in_page(650, pbs_structure::get_id(650));
+    const u64 after = pbs.try_predecessor_in_page(700, id, finger);
+    const bool ok = before == 640 && after == 650 && after == pbs.try_predecessor_in_page(700, id)
+                 && snapshot->try_predecessor_in_page(700, id) == 640;
+
+    if (ok) std::cout << "\033[32;1mOK: finger sees the insertion after a snapshot\033[0m\n";
+    else std::cout << "\033[31;1mERROR: finger answers " << after << " after a snapshot, the structure "
+                   << pbs.try_predecessor_in_page(700, id) << "\033[0m\n";
+    return ok;
+}
+
+// Keys far beyond the compact table's quotienting go to its overflow table,
+// and do not blow up its capacity
+bool check_compact_table_large_keys(){
+    using Table = CompactLinearProbing<u64>;
+    Table table;
+    std::vector<u64> keys = {1ull << 50, (1ull << 62) + 5, ~(u64)(0) - 1};
+    for (u64 i = 0; i < 5000; i++) keys.push_back(i * 3);
+    for (u64 i = 0; i < 100; i++) keys.push_back((1ull << 40) + i);
+    for (u64 key : keys){
+        u64 value = key ^ 1;
+        table.get_or_insert(key, value);
+    }
+    const u64 n_in_overflow = table.n_overflow();
+    const u64 log_capacity  = table.log_capacity;
+
+    // Growing the table brings keys of up to log(capacity) + 24 bits in from overflow
+    for (u64 i = 5000; i < 2000000; i++){
+        u64 value = (i * 3) ^ 1;
+        table.get_or_insert(i * 3, value);
+        keys.push_back(i * 3);
+    }
+
+    bool ok = n_in_overflow == 103 && log_capacity <= 13 && table.n_elements == keys.size() && table.n_overflow() == 3;
+    for (u64 key : keys){
+        auto *entry = table.get(key);
+        ok &= entry != nullptr && entry->value == (key ^ 1);
+    }
+    ok &= table.get((1ull << 50) + 1) == nullptr && table.get(1ull << 62) == nullptr;
+    u64 n_keys = 0;
+    table.for_each_key([&](u64){ n_keys++; });
+    ok &= n_keys == keys.size();
+
+    if (ok) std::cout << "\033[32;1mOK: large keys in the compact table\033[0m\n";
+    else std::cout << "\033[31;1mERROR: large keys in the compact table (2^" << log_capacity << " slots, "
+                   << n_in_overflow << " keys in overflow)\033[0m\n";
+    return ok;
+}
+
+// A finger on a table that is full up to its resize threshold, and gets an
+// insertion into a page it has already
+bool check_finger_at_full_table(){
+    using pbs_structure = PBSEpsilon8;
+    auto pbs = pbs_structure();
+    typename pbs_structure::Finger finger;
+    const u64 n_pages = pbs.table.max_n_supported;
+    for (u64 id = 0; id < n_pages; id++) pbs.try_insert_in_page(64 * id, id);
+    const u64 capacity = pbs.table.capacity;
+
+    const u64 before = pbs.try_predecessor_in_page(5 * 64 + 10, 5, finger);
+    pbs.try_insert_in_page(5 * 64 + 7, 5);
+    const u64 after = pbs.try_predecessor_in_page(5 * 64 + 10, 5, finger);
+    const bool ok = before == 5 * 64 && after == 5 * 64 + 7 && pbs.table.capacity == capacity;
+
+    if (ok) std::cout << "\033[32;1mOK: finger on a full table\033[0m\n";
+    else std::cout << "\033[31;1mERROR: finger answers " << after << " on a full table, the structure "
+                   << pbs.try_predecessor_in_page(5 * 64 + 10, 5) << "\033[0m\n";
+    return ok;
+}
+
+// A finger across expired pages: erasing 10 pages and inserting 10 new
+// ones brings n_elements back to where it was, in a rebuilt table
+bool check_finger_after_expiry(){
+    using pbs_structure = PBSEpsilon8;
+    auto pbs = pbs_structure();
+    typename pbs_structure::Finger finger;
+    for (u64 id = 0; id < 100; id++) pbs.try_insert_in_page(64 * id, id);
+
+    const u64 before = pbs.try_predecessor_in_page(50 * 64 + 10, 50, finger);
+    pbs.expire_pages_below(10);
+    for (u64 id = 100; id < 110; id++) pbs.try_insert_in_page(64 * id, id);
+    pbs.try_insert_in_page(50 * 64 + 7, 50);
+    const u64 after = pbs.try_predecessor_in_page(50 * 64 + 10, 50, finger);
+    const bool ok = before == 50 * 64 && after == 50 * 64 + 7 && pbs.table.n_elements == 100;
+
+    if (ok) std::cout << "\033[32;1mOK: finger after expired pages\033[0m\n";
+    else std::cout << "\033[31;1mERROR: finger answers " << after << " after expired pages, the structure "
+                   << pbs.try_predecessor_in_page(50 * 64 + 10, 50) << "\033[0m\n";
+    return ok;
+}
+
+// A finger across an intersection, which drops the pages the other
+// structure does not have by rebuilding the table
+bool check_finger_after_intersection(){
+    using pbs_structure = PBSEpsilon8;
+    auto pbs   = pbs_structure();
+    auto other = pbs_structure();
+    typename pbs_structure::Finger finger;
+    for (u64 id = 0; id < 100; id++){
+        pbs.try_insert_in_page(64 * id, id);
+        pbs.try_insert_in_page(64 * id + 5, id);
+    }
+    for (u64 id = 0; id < 50; id++){
+        other.try_insert_in_page(64 * id, id);
+        other.try_insert_in_page(64 * id + 3, id);
+    }
+
+    const u64 x = 30 * 64 + 12;
+    const u64 before = pbs.try_predecessor_in_page(x, 30, finger);
+    // Without the finger until n_elements is back, which it must not trust
+    pbs.intersect_with(other);
+    const u64 intersected = pbs.try_predecessor_in_page(x, 30);
+    for (u64 id = 200; id < 250; id++) pbs.try_insert_in_page(64 * id, id);
+    pbs.try_insert_in_page(30 * 64 + 9, 30);
+    const u64 after = pbs.try_predecessor_in_page(x, 30, finger);
+    const bool ok = before == 30 * 64 + 5 && intersected == 30 * 64 && after == 30 * 64 + 9
+                 && pbs.table.n_elements == 100;
+
+    if (ok) std::cout << "\033[32;1mOK: finger after an intersection\033[0m\n";
+    else std::cout << "\033[31;1mERROR: finger answers " << intersected << ", " << after
+                   << " after an intersection, the structure " << pbs.try_predecessor_in_page(x, 30) << "\033[0m\n";
+    return ok;
+}
+
+u64 run_checks(){
+    u64 n_failed = 0;
+    n_failed += !check_wal_torn_tails("pbs_check.wal");
+    n_failed += !check_wal_keeps_foreign_file("pbs_check.wal");
+    n_failed += !check_finger_after_snapshot();
+    n_failed += !check_compact_table_large_keys();
+    n_failed += !check_finger_at_full_table();
+    n_failed += !check_finger_after_expiry();
+    n_failed += !check_finger_after_intersection();
+    return n_failed;
+}
+
+int main(int argc, char **argv){
+
+    // PageBearer checks
+    if (argc > 1 && std::string(argv[1]) == "checks") return run_checks() == 0 ? 0 : 1;
+
+    // PageBearer regression [--update-baseline] [baseline file]
+    if (argc > 1 && std::string(argv[1]) == "regression"){
+        bool update_baseline = false;
+        std::string baseline_path = DEFAULT_REGRESSION_BASELINE;
+        for (int i = 2; i < argc; i++){
+            if (std::string(argv[i]) == "--update-baseline") update_baseline = true;
+            else baseline_path = argv[i];
+        }
+        return run_regression_suite(baseline_path, update_baseline) == 0 ? 0 : 1;
+    }
+
+    srand(seed_val);
+
+    //u64 universe_size = 0xFFFFFFFFFFFFFFF0;
+    
+    u64 universe_size = 3000000;
+    u64 n   = 1000000;
+    u64 n_rounds = 2;
+    TestData data = generate_test_data(universe_size,n,n/1000,n_rounds);
+
+    const u64 epsilon = 32;
+    //auto baseline = test_pbs_data_structure<MapAndVecPBS<epsilon>>(data);
+    auto baseline = test_set_data_structure(data);
+
+    std::vector<TestResult> results = {
+        test_pbs_data_structure<PBSPageBearerHashing<epsilon>>(data),
+        //test_pbs_data_structure<PBSBitTricks<epsilon>>(data),
+        //test_pbs_data_structure<MapAndVecPBS<epsilon>>(data),
+        //test_pbs_data_structure<PBSEpsilon8>(data),
+        //test_pbs_data_structure<PBSLinearProbing<8>>(data),
+        //test_pbs_data_structure<PBSEpsilon8WithTable<BucketizedCuckoo>>(data),
+        //test_pbs_data_structure<PBSBitTricks<epsilon, BucketizedCuckoo>>(data),
+        //test_pbs_data_structure<PBSPageBearerHashing<epsilon, BucketizedCuckoo>>(data),
+    };
+
+    // Probes of mostly absent pages in a sparse universe, with and without a bloom filter
+    //u64 sparse_universe_size = 1ull << 40;
+    //TestData sparse_data = generate_test_data(sparse_universe_size, n, 0, 1);
+    //test_pbs_absent_page_probes<PBSEpsilon8>(sparse_data, sparse_universe_size, 10*n);
+    //test_pbs_absent_page_probes<PBSEpsilon8WithTable<FilteredLinearProbing>>(sparse_data, sparse_universe_size, 10*n);
+    //test_pbs_absent_page_probes<PBSBitTricks<epsilon>>(sparse_data, sparse_universe_size, 10*n);
+    //test_pbs_absent_page_probes<PBSBitTricks<epsilon, FilteredLinearProbing>>(sparse_data, sparse_universe_size, 10*n);
+
+    // Membership checks, one key at a time vs 8 keys with AVX-512
+    //test_pbs_membership<PBSEpsilon8>(data, universe_size, 10*n);
+    //test_pbs_membership<PBSEpsilon8>(sparse_data, sparse_universe_size, 10*n);
+
+    // Record the workload once, then replay it from disk without rebuilding it
+    //write_trace(data, "workload.trace");
+    //write_pbs_trace<PBSEpsilon8>(data, "workload_pbs_epsilon_8.trace");
+    //auto replay_baseline = replay_set_trace("workload.trace");
+    //compare_results(replay_baseline, replay_pbs_trace<PBSEpsilon8>("workload_pbs_epsilon_8.trace"));
+
+    // Durable inserts: write-ahead log with group commit of 1 to 4096 records
+    //test_pbs_logged_inserts<PBSEpsilon8>(data, "pbs.wal", {1, 16, 256, 4096});
+    //test_pbs_logged_inserts<PBSPageBearerHashing<epsilon>>(data, "pbs.wal", {1, 16, 256, 4096});
+
+    // Sliding window over increasing timestamps, with whole pages expired in bulk
+    //test_pbs_sliding_window<PBSEpsilon8>(10*n, 1 << 20, 16);
+    //test_pbs_sliding_window<PBSBitTricks<epsilon>>(10*n, 1 << 20, 16);
+
+    // Write buffer for insert-heavy phases: ingest rate and query overhead by buffer size
+    //TestData ingest_data = generate_test_data(universe_size, n, n / 10, 10);
+    //test_pbs_buffered<PBSEpsilon8>(ingest_data, {256, 1024, 4096, 16384});
+    //test_pbs_buffered<PBSBitTricks<epsilon>>(ingest_data, {256, 1024, 4096, 16384});
+    //test_pbs_buffered<PBSPageBearerHashing<epsilon>>(ingest_data, {256, 1024, 4096, 16384});
+
+    // Snapshots for queries during inserts: copy on write segments and pages
+    //TestData snapshot_data = generate_test_data(universe_size, n, n, 4);
+    //test_pbs_snapshot_queries<PBSEpsilon8WithTable<CowLinearProbing>>(snapshot_data, 1 << 16);
+    //test_pbs_snapshot_queries<PBSBitTricks<epsilon, CowLinearProbing>>(snapshot_data, 1 << 16);
+    //test_pbs_snapshot_queries<PBSPageBearerHashing<epsilon, CowLinearProbing>>(snapshot_data, 1 << 16);
+
+    // Bulk union, intersection and difference, page by page vs element by element
+    //test_pbs_set_operations<PBSEpsilon8>(universe_size, n, 4);
+    //test_pbs_set_operations<PBSBitTricks<epsilon>>(universe_size, n, 4);
+
+    // Frozen read-only layouts: minimal perfect hash page index, after one block of insertions
+    //TestData frozen_data = generate_test_data(universe_size, n, n, 1);
+    //compare_results(test_set_data_structure(frozen_data), test_pbs_frozen<PBSEpsilon8>(frozen_data));
+    //compare_results(test_set_data_structure(frozen_data), test_pbs_frozen<PBSBitTricks<epsilon>>(frozen_data));
+    //compare_results(test_set_data_structure(frozen_data), test_pbs_frozen<PBSPageBearerHashing<epsilon>>(frozen_data));
+    //compare_results(test_set_data_structure(frozen_data), test_pbs_frozen<MapAndVecPBS<epsilon>>(frozen_data));
+
+    // Key-value mode: the value of the predecessor from the same page visit
+    // vs a second lookup in a table of values
+    //results.push_back(test_pbs_map<PBSEpsilon8Map<u64>>(data));
+    //results.push_back(test_pbs_map<PBSWithValueTable<PBSEpsilon8, u64>>(data));
+    //results.push_back(test_pbs_map<PBSBitTricksMap<epsilon, u64>>(data));
+    //results.push_back(test_pbs_map<PBSWithValueTable<PBSBitTricks<epsilon>, u64>>(data));
+    //results.push_back(test_pbs_map<PBSPageBearerHashingMap<epsilon, u64>>(data));
+    //results.push_back(test_pbs_map<PBSWithValueTable<PBSPageBearerHashing<epsilon>, u64>>(data));
+
+    // Layout picked from the data vs the fixed layouts it chooses from, here
+    // and on the sparse data below
+    //results.push_back(test_pbs_data_structure<AdaptivePBS>(data));
+    //results.push_back(test_pbs_data_structure<PBSBitTricks<16>>(data));
+
+    // Key width: u32 keys halve the page payload and the page index entries,
+    // u128 keys double them. u32 needs universe_size < 2^32.
+    //results.push_back(test_pbs_data_structure<PBSPageBearerHashing<epsilon, LinearProbing, 0, u32>>(data));
+    //results.push_back(test_pbs_data_structure<PBSPageBearerHashing<epsilon, LinearProbing, 0, u128>>(data));
+    //results.push_back(test_pbs_data_structure<PBSEpsilon8WithTable<LinearProbing, u32>>(data));
+    //results.push_back(test_pbs_data_structure<PBSBitTricks<epsilon, LinearProbing, u32>>(data));
+    //results.push_back(test_pbs_data_structure<MapAndVecPBS<epsilon, u32>>(data));
+    //results.push_back(test_pbs_data_structure<MapAndVecPBS<epsilon, u128>>(data));
+
+    // Plain vectors vs packed cold pages: memory and query cost
+    //results.push_back(test_pbs_data_structure<MapAndVecPBS<epsilon>>(data));
+    //results.push_back(test_pbs_cold_pages<MapAndVecPBS<epsilon>>(data, n/10));
+    //results.push_back(test_pbs_cold_pages<PBSPageBearerHashing<epsilon>>(data, n/10));
+    //results.push_back(test_pbs_cold_pages<PBSPageBearerHashing<epsilon>>(data, 0));
+
+    // Element at a time vs sort-and-merge blocks, on a query-heavy workload
+    //TestData batch_data = generate_test_data(universe_size, n, n, 2);
+    //results.push_back(test_pbs_data_structure<PBSEpsilon8>(batch_data));
+    //results.push_back(test_pbs_data_structure_batched<PBSEpsilon8>(batch_data));
+    //results.push_back(test_pbs_data_structure_batched<PBSBitTricks<epsilon>>(batch_data));
+    //results.push_back(test_pbs_data_structure_batched<PBSPageBearerHashing<epsilon>>(batch_data));
+
+    // Finger vs plain page lookups on sorted, nearly sorted and random query streams
+    //TestData finger_data = generate_test_data(universe_size, n, n, 1);
+    //test_pbs_finger_queries<PBSEpsilon8>(finger_data);
+    //test_pbs_finger_queries<PBSEpsilon8WithTable<FilteredLinearProbing>>(finger_data);
+    //test_pbs_finger_queries<PBSBitTricks<epsilon>>(finger_data);
+    //test_pbs_finger_queries<PBSPageBearerHashing<epsilon>>(finger_data);
+
+    // Read-only query scaling over threads, on a query-heavy workload
+    //TestData query_heavy_data = generate_test_data(universe_size, n, 10*n, 1);
+    //test_pbs_parallel_queries<PBSEpsilon8>(query_heavy_data);
+    //test_pbs_parallel_queries<PBSBitTricks<epsilon>>(query_heavy_data);
+    //test_pbs_parallel_queries<PBSPageBearerHashing<epsilon>>(query_heavy_data);
+    //test_pbs_parallel_queries<MapAndVecPBS<epsilon>>(query_heavy_data);
+
+    // Lock-free inserts against a reader-writer lock, on 1..all cores
+    //test_pbs_parallel_inserts<ConcurrentPBSEpsilon8>(data);
+    //test_pbs_parallel_inserts<MutexPBS<PBSEpsilon8>>(data);
+    //test_pbs_parallel_inserts<ConcurrentPBSBitTricks<epsilon>>(data);
+    //test_pbs_parallel_inserts<MutexPBS<PBSBitTricks<epsilon>>>(data);
+
+    // Scalar queries vs coroutine-interleaved walks
+    //results.push_back(test_pbs_data_structure_interleaved<PBSEpsilon8>(data, 1));
+    //results.push_back(test_pbs_data_structure_interleaved<PBSEpsilon8>(data, 8));
+    //results.push_back(test_pbs_data_structure_interleaved<PBSEpsilon8>(data, 16));
+    //results.push_back(test_pbs_data_structure_interleaved<PBSBitTricks<epsilon>>(data, 16));
+    //results.push_back(test_pbs_data_structure_interleaved<PBSPageBearerHashing<epsilon>>(data, 16));
+
+    // Hash-only splitting vs forced splits above 2 and 4 times epsilon
+    //results.push_back(test_pbs_data_structure<PBSPageBearerHashing<epsilon, LinearProbing, 2>>(data));
+    //results.push_back(test_pbs_data_structure<PBSPageBearerHashing<epsilon, LinearProbing, 4>>(data));
+    //print_page_size_distribution<PBSPageBearerHashing<epsilon>>(data);
+    //print_page_size_distribution<PBSPageBearerHashing<epsilon, LinearProbing, 4>>(data);
+
+    // Footprint of the page index, full keys vs quotiented keys
+    //results.push_back(test_pbs_data_structure<PBSEpsilon8WithTable<CompactLinearProbing>>(data));
+    //print_page_index_footprint<PBSEpsilon8>(data);
+    //print_page_index_footprint<PBSEpsilon8WithTable<CompactLinearProbing>>(data);
+
+    // Allocations and copying in LinearProbing, small and large pages
+    //print_linear_probing_copies<PBSEpsilon8>(data);
+    //print_linear_probing_copies<PBSBitTricks<epsilon>>(data);
+    //print_linear_probing_copies<PBSBitTricks<128>>(data);
+
+    // Doubling LinearProbing on 1..all cores, 2^20 to 2^30 slots (16 GB before the doubling)
+    //test_linear_probing_parallel_resize(20, 30, std::max(1u, std::thread::hardware_concurrency()));
+
+    // Tail latency of the page index, linear probing vs bucketized cuckoo
+    //test_pbs_query_latency<PBSEpsilon8>(data);
+    //test_pbs_query_latency<PBSEpsilon8WithTable<BucketizedCuckoo>>(data);
+
     for (auto res : results){
         compare_results(baseline, res);
     }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <iostream>
+#include <malloc.h>
+#include "util.h"
+
+
+// Footprint of a structure, as returned by memory_usage().
+//
+//   index_table      keys and other per-slot bookkeeping of the page index,
+//                    for all slots, used or not
+//   page_payload     bytes that hold the contents of the pages: inline values
+//                    of used slots, or the used part of page vectors
+//   allocator_slack  bytes that are allocated but hold nothing: the value
+//                    space of empty slots, unused vector capacity, and what
+//                    malloc adds on top of each request
+//   metadata         everything else: the structs themselves, vector and
+//                    page headers, filters, stashes
+struct MemoryUsage {
+    u64 index_table     = 0;
+    u64 page_payload    = 0;
+    u64 allocator_slack = 0;
+    u64 metadata        = 0;
+
+    u64 total() const {
+        return index_table + page_payload + allocator_slack + metadata;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& other){
+        index_table     += other.index_table;
+        page_payload    += other.page_payload;
+        allocator_slack += other.allocator_slack;
+        metadata        += other.metadata;
+        return *this;
+    }
+
+    void print(u64 n_elements) const {
+        const double n = n_elements ? (double)n_elements : 1.0;
+        std::cout << "Memory: " << total() << " bytes, " << total() / n << " bytes per element"
+                  << " (index " << index_table / n
+                  << ", payload " << page_payload / n
+                  << ", slack " << allocator_slack / n
+                  << ", metadata " << metadata / n << ")\n";
+    }
+};
+
+// glibc keeps a size_t header in front of every chunk
+static const u64 MALLOC_CHUNK_HEADER = sizeof(size_t);
+
+// What malloc spent on top of `requested` bytes for the allocation at ptr
+inline u64 malloc_overhead(const void *ptr, u64 requested){
+    if (ptr == nullptr) return 0;
+    return malloc_usable_size((void*)ptr) - requested + MALLOC_CHUNK_HEADER;
+}
+
+// For allocations we cannot get a pointer to, e.g. std::unordered_map nodes.
+// glibc rounds chunks up to 16 bytes, with a minimum of 32.
+inline u64 estimated_malloc_overhead(u64 requested){
+    u64 chunk = (requested + MALLOC_CHUNK_HEADER + 15) & ~(u64)(15);
+    if (chunk < 32) chunk = 32;
+    return chunk - requested;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include "util.h"
+#include "memory_usage.hh"
+#include "key_traits.hh"
+
+
+// Minimal perfect hash function over a fixed set of n keys, PTHash style:
+// the keys are hashed into about n / BUCKET_SIZE buckets, and every bucket
+// gets a small pilot such that the keys of all buckets land on distinct
+// positions in [0, n / ALPHA). Evaluating it is one hash, one load of the
+// pilot, which is a u16 per bucket and small enough to stay in cache, and a
+// second hash. Positions at n and above, about 1 - ALPHA of the keys, are
+// sent to the free positions below n through a small remap table, so the
+// function is minimal.
+//
+// Keys outside the set get some position in [0, n) as well, so the caller
+// keeps the key, or a fingerprint of it, at that position to check.
+template <typename Key = u64>
+struct MinimalPerfectHash {
+
+    static const u64 BUCKET_SIZE = 4;
+    static const u64 MAX_PILOT   = 0xFFFF;
+    static const u64 MAX_SEEDS   = 64;
+    constexpr static const double ALPHA = 0.98;
+
+    u64 n         = 0;
+    u64 n_buckets = 1;
+    u64 table_size = 1;
+    u64 seed      = 0;
+    std::vector<u16> pilots;
+    std::vector<u32> remap;  // remap[p - n] for positions p >= n
+
+    MinimalPerfectHash(){}
+
+    // Builds the function for keys, which must be distinct
+    MinimalPerfectHash(const std::vector<Key>& keys){
+        n          = keys.size();
+        n_buckets  = std::max((u64)(1), (n + BUCKET_SIZE - 1) / BUCKET_SIZE);
+        table_size = std::max((u64)(1), (u64)(n / ALPHA) + 1);
+        for (seed = 0; seed < MAX_SEEDS; seed++){
+            if (try_build(keys)) return;
+        }
+        std::cout << "Could not build MinimalPerfectHash for " << n << " keys. Exiting.\n", exit(1);
+    }
+
+    std::string name(){
+        return "MinimalPerfectHash";
+    }
+
+    // murmur3's finalizer
+    inline static u64 mix(u64 x){
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccd;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // Maps a uniform u64 onto [0, range) without a division
+    inline static u64 reduce(u64 h, u64 range){
+        return (u64)(((u128)(h) * range) >> 64);
+    }
+
+    inline u64 key_hash(Key x) const {
+        return mix(KeyTraits<Key>::fold(x) ^ (seed * 0x9E3779B97F4A7C15));
+    }
+
+    // The pilot only needs to scatter the bucket, so it is hashed with a
+    // multiplication, and h with another one, rather than mixed again
+    inline u64 position(u64 h, u64 pilot) const {
+        return reduce((h * 0xC2B2AE3D27D4EB4F) ^ ((pilot + 1) * 0x9E3779B97F4A7C15), table_size);
+    }
+
+    // Position in [0, n) of x, which must be in the set for the answer to mean anything
+    inline u64 operator()(Key x) const {
+        const u64 h = key_hash(x);
+        const u64 p = position(h, pilots[reduce(h * 0x9E3779B97F4A7C15, n_buckets)]);
+        return p < n ? p : remap[p - n];
+    }
+
+    inline void prefetch(Key x) const {
+        const u64 h = key_hash(x);
+        __builtin_prefetch(pilots.data() + reduce(h * 0x9E3779B97F4A7C15, n_buckets));
+    }
+
+    // Places the buckets from the largest down, each with the first pilot
+    // whose positions are all free. Fails if some bucket needs a pilot
+    // beyond MAX_PILOT.
+    bool try_build(const std::vector<Key>& keys){
+        std::vector<u64> hashes(n);
+        std::vector<u64> bucket_start(n_buckets + 1, 0);
+        for (u64 i = 0; i < n; i++){
+            hashes[i] = key_hash(keys[i]);
+            bucket_start[reduce(hashes[i] * 0x9E3779B97F4A7C15, n_buckets) + 1]++;
+        }
+        u64 max_size = 0;
+        for (u64 b = 0; b < n_buckets; b++){
+            max_size = std::max(max_size, bucket_start[b + 1]);
+            bucket_start[b + 1] += bucket_start[b];
+        }
+
+        // Hashes grouped by bucket, and the buckets ordered by size, largest first
+        std::vector<u64> grouped(n);
+        std::vector<u64> fill(bucket_start.begin(), bucket_start.end() - 1);
+        for (u64 i = 0; i < n; i++) grouped[fill[reduce(hashes[i] * 0x9E3779B97F4A7C15, n_buckets)]++] = hashes[i];
+
+        std::vector<u64> size_start(max_size + 2, 0);
+        for (u64 b = 0; b < n_buckets; b++) size_start[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+        for (u64 s = 0; s <= max_size; s++) size_start[s + 1] += size_start[s];
+        std::vector<u64> order(n_buckets);
+        for (u64 b = 0; b < n_buckets; b++) order[size_start[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+
+        pilots.assign(n_buckets, 0);
+        std::vector<u64> taken((table_size + 63) / 64, 0);
+        std::vector<u64> positions(max_size);
+        for (u64 b : order){
+            const u64 begin = bucket_start[b];
+            const u64 size  = bucket_start[b + 1] - begin;
+            if (size == 0) break;
+            u64 pilot = 0;
+            for (; pilot <= MAX_PILOT; pilot++){
+                u64 placed = 0;
+                for (; placed < size; placed++){
+                    const u64 p = position(grouped[begin + placed], pilot);
+                    if ((taken[p / 64] >> (p % 64)) & 1) break;
+                    taken[p / 64] |= (u64)(1) << (p % 64);
+                    positions[placed] = p;
+                }
+                if (placed == size) break;
+                // Two keys of the bucket on one position, or a position of another bucket
+                for (u64 i = 0; i < placed; i++) taken[positions[i] / 64] &= ~((u64)(1) << (positions[i] % 64));
+            }
+            if (pilot > MAX_PILOT) return false;
+            pilots[b] = pilot;
+        }
+
+        // The positions >= n that are taken go to the free positions below n
+        remap.assign(table_size > n ? table_size - n : 0, 0);
+        u64 free_position = 0;
+        for (u64 p = n; p < table_size; p++){
+            if (!((taken[p / 64] >> (p % 64)) & 1)) continue;
+            while ((taken[free_position / 64] >> (free_position % 64)) & 1) free_position++;
+            remap[p - n] = free_position++;
+        }
+        return true;
+    }
+
+    u64 bytes() const {
+        return pilots.size() * sizeof(u16) + remap.size() * sizeof(u32);
+    }
+
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        usage.index_table     = bytes();
+        usage.allocator_slack = malloc_overhead(pilots.data(), pilots.size() * sizeof(u16))
+                              + malloc_overhead(remap.data(), remap.size() * sizeof(u32));
+        usage.metadata        = sizeof(*this);
+        return usage;
+    }
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+
+
+// Binary operation traces, so that workloads can be generated once (or
+// captured elsewhere) and replayed from disk.
+//
+// Layout, all little-endian u64 words so that everything stays aligned:
+//
+//      header:  magic, version, flags, n_records
+//      record:  tag = (n_pages << 1) | op, key, page_ids[n_pages]
+//
+// op is 1 for insertions and 0 for queries. The page ids are optional
+// (TRACE_HAS_PAGE_IDS), and are the page walk that generate_pbs_test_data
+// computes for the op. They are specific to the get_id / is_id_page_bearer
+// of the structure the trace was written for, and are not checked on replay.
+//
+// A record without page ids takes 16 bytes.
+
+struct TraceHeader {
+    u64 magic;
+    u64 version;
+    u64 flags;
+    u64 n_records;
+};
+
+static const u64 TRACE_MAGIC        = 0x3145434152544250; // "PBTRACE1"
+static const u64 TRACE_VERSION      = 1;
+static const u64 TRACE_HAS_PAGE_IDS = 1;
+
+struct TraceRecord {
+    enum Op {Query = 0, Insert = 1};
+    Op op;
+    u64 key;
+    u64 n_pages;
+    const u64 *page_ids; // points into the mapped file
+};
+
+
+struct TraceWriter {
+
+    static const u64 BUFFER_WORDS = 1 << 16;
+
+    FILE *file;
+    TraceHeader header;
+    u64 *buffer;  // 512KB, too large for the stack writers are created on
+    u64 n_buffered;
+
+    TraceWriter(const std::string& path, bool with_page_ids){
+        file = fopen(path.c_str(), "wb");
+        if (!file) std::cout << "Could not open trace " << path << " for writing. Exiting.\n", exit(1);
+        header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION,
+                  .flags = with_page_ids ? TRACE_HAS_PAGE_IDS : 0, .n_records = 0};
+        buffer = (u64*)malloc(BUFFER_WORDS * sizeof(u64));
+        if (!buffer) std::cout << "Allocation of trace buffer failed.\n", exit(1);
+        n_buffered = 0;
+        // Written again with the right n_records in close()
+        fwrite(&header, sizeof(header), 1, file);
+    }
+
+    ~TraceWriter(){
+        if (file) close();
+        free(buffer);
+    }
+
+    TraceWriter(const TraceWriter& other) = delete;
+    TraceWriter& operator=(const TraceWriter& other) = delete;
+
+    inline void put(u64 word){
+        if (n_buffered == BUFFER_WORDS) flush();
+        buffer[n_buffered++] = word;
+    }
+
+    void flush(){
+        if (fwrite(buffer, sizeof(u64), n_buffered, file) != n_buffered){
+            std::cout << "Writing trace failed. Exiting.\n", exit(1);
+        }
+        n_buffered = 0;
+    }
+
+    inline void write(TraceRecord::Op op, u64 key, const u64 *page_ids = nullptr, u64 n_pages = 0){
+        if (!(header.flags & TRACE_HAS_PAGE_IDS)) n_pages = 0;
+        put((n_pages << 1) | (u64)op);
+        put(key);
+        for (u64 i = 0; i < n_pages; i++) put(page_ids[i]);
+        header.n_records++;
+    }
+
+    void close(){
+        flush();
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, file);
+        fclose(file);
+        file = nullptr;
+    }
+};
+
+
+// Maps the whole trace and hands out one record at a time. Nothing is
+// copied, so traces larger than memory stream through the page cache.
+struct TraceReader {
+
+    int fd;
+    u64 file_size;
+    const u64 *words;
+    const u64 *current;
+    const u64 *end;
+    TraceHeader header;
+
+    TraceReader(const std::string& path){
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) std::cout << "Could not open trace " << path << ". Exiting.\n", exit(1);
+
+        struct stat st;
+        fstat(fd, &st);
+        file_size = st.st_size;
+        if (file_size < sizeof(TraceHeader)) std::cout << "Trace " << path << " is too short. Exiting.\n", exit(1);
+
+        void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) std::cout << "Could not mmap trace " << path << ". Exiting.\n", exit(1);
+        madvise(mapped, file_size, MADV_SEQUENTIAL);
+
+        words = (const u64*)mapped;
+        memcpy(&header, words, sizeof(header));
+        if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION){
+            std::cout << path << " is not a trace of version " << TRACE_VERSION << ". Exiting.\n", exit(1);
+        }
+        current = words + sizeof(TraceHeader) / sizeof(u64);
+        end     = words + file_size / sizeof(u64);
+    }
+
+    ~TraceReader(){
+        munmap((void*)words, file_size);
+        ::close(fd);
+    }
+
+    TraceReader(const TraceReader& other) = delete;
+    TraceReader& operator=(const TraceReader& other) = delete;
+
+    bool has_page_ids(){
+        return header.flags & TRACE_HAS_PAGE_IDS;
+    }
+
+    void rewind(){
+        current = words + sizeof(TraceHeader) / sizeof(u64);
+    }
+
+    // false at the end of the trace
+    inline bool next(TraceRecord& record){
+        if (current + 2 > end) return false;
+        const u64 tag   = current[0];
+        record.op       = (TraceRecord::Op)(tag & 1);
+        record.key      = current[1];
+        record.n_pages  = tag >> 1;
+        record.page_ids = current + 2;
+        current += 2 + record.n_pages;
+        if (current > end) std::cout << "Trace is truncated. Exiting.\n", exit(1);
+        return true;
+    }
+
+    // Looks at the next record without consuming it
+    inline bool peek(TraceRecord& record){
+        const u64 *saved = current;
+        const bool ret = next(record);
+        current = saved;
+        return ret;
+    }
+};
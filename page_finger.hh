@@ -0,0 +1,126 @@
+#pragma once
+
+#include "util.h"
+#include "key_traits.hh"
+
+
+// Finger for the page index of a query stream with locality. Sorted or nearly
+// sorted queries visit the same few pages over and over, so the finger keeps
+// the entries of the last N_PAGES page ids it looked up or read ahead (the
+// pages of the last walk and their neighbours) and only goes to the table for
+// other ids.
+//
+// Caching what was looked up alone misses on every step of a sorted stream
+// from page p to p + 1. So a step to an adjacent id, p + 1 after p (the next
+// page of a sorted stream) or p - 1 after p (the next page of a walk), also
+// caches the id after it in the same direction, p + 2 or p - 2, unless the
+// finger has it. A stream of such steps then only misses on the first. The
+// read-ahead is left out on other steps: random and sparse streams rarely
+// find a page next to the last one, and would pay a table read per miss for
+// an entry they do not use.
+//
+// Entry pointers are only stable while the table does not get a new key:
+// linear probing moves entries when it resizes, cuckoo hashing and the compact
+// table on any new key. The tables only resize when an insertion brings a new
+// key, never on one that finds its key in a full table. Tables that move
+// entries in other ways count those in n_moves: LinearProbing::erase_if(),
+// which rebuilds the table (expired pages, intersections and differences),
+// and CowLinearProbing when it copies a segment a snapshot holds. Erasing
+// lowers n_elements, which later insertions can bring back, so n_elements
+// alone would not do. The finger is valid as long as both n_elements and
+// n_moves are what they were when the entries were cached, and is emptied
+// otherwise. Absent ids are cached as nullptr the same way.
+//
+// One finger per query stream (and thread); the table is only read.
+template <typename Table>
+struct PageFinger {
+
+    using Entry = typename Table::Entry;
+    using Key   = typename Table::KeyType;
+
+    static const u64 N_PAGES = 8;
+    static constexpr Key NO_ID = KeyTraits<Key>::ALL_ONES;
+
+    Key ids[N_PAGES];
+    Entry *entries[N_PAGES];
+    u64 next_victim;
+    u64 last_hit;
+    u64 n_elements_seen;
+    u64 n_moves_seen;
+    Key last_id = NO_ID;
+
+    u64 n_hits   = 0;
+    u64 n_misses = 0;
+    // Lookups of id + 1 or id - 1 right after id, and how many of them hit
+    u64 n_adjacent      = 0;
+    u64 n_adjacent_hits = 0;
+
+    PageFinger(){
+        // No table has this many elements, so the first get() clears again
+        clear(KeyTraits<u64>::ALL_ONES, 0);
+    }
+
+    inline static u64 n_moves(const Table& table){
+        if constexpr (requires { table.n_moves; }) return table.n_moves;
+        else return 0;
+    }
+
+    inline void clear(u64 n_elements, u64 moves){
+        for (u64 i = 0; i < N_PAGES; i++){
+            ids[i]     = NO_ID;
+            entries[i] = nullptr;
+        }
+        next_victim     = 0;
+        last_hit        = 0;
+        last_id         = NO_ID;
+        n_elements_seen = n_elements;
+        n_moves_seen    = moves;
+    }
+
+    // The index of id in the finger, N_PAGES if it is not there
+    inline u64 find(Key id) const {
+        if (ids[last_hit] == id) return last_hit;
+        for (u64 i = 0; i < N_PAGES; i++){
+            if (ids[i] == id) return i;
+        }
+        return N_PAGES;
+    }
+
+    inline u64 cache(Table& table, Key id){
+        const u64 i = next_victim;
+        ids[i]      = id;
+        entries[i]  = table.get(id);
+        next_victim = (next_victim + 1) % N_PAGES;
+        return i;
+    }
+
+    // Same as table.get(id)
+    inline Entry* get(Table& table, Key id){
+        const u64 moves = n_moves(table);
+        if (table.n_elements != n_elements_seen || moves != n_moves_seen) clear(table.n_elements, moves);
+
+        const bool up   = last_id != NO_ID && id == last_id + 1;
+        const bool down = last_id != NO_ID && id + 1 == last_id;
+        last_id = id;
+        n_adjacent += up || down;
+
+        u64 i = find(id);
+        if (i != N_PAGES){
+            n_hits++;
+            n_adjacent_hits += up || down;
+        }
+        else {
+            n_misses++;
+            i = cache(table, id);
+        }
+        last_hit = i;
+
+        // Read-ahead, into any slot but the one of id
+        const Key next = up ? id + 1 : id - 1;
+        if (((up && next != NO_ID) || (down && id != 0)) && find(next) == N_PAGES){
+            if (next_victim == i) next_victim = (next_victim + 1) % N_PAGES;
+            cache(table, next);
+        }
+        return entries[i];
+    }
+};
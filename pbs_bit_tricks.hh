@@ -2,7 +2,15 @@
 
 #include "util.h"
 #include <cstdlib>
+#include <memory>
+#include <bit>
 #include "linear_probing.hh"
+#include "cuckoo_hashing.hh"
+#include "compact_linear_probing.hh"
+#include "cow_linear_probing.hh"
+#include "bloom_filtered_table.hh"
+#include "page_finger.hh"
+#include "bitmap_set_operations.hh"
 #include <sstream>
 
 
@@ -14,7 +22,9 @@
 // However, you can make predecessor fast by adding one more level
 
 
-template <u64 epsilon>
+// HashTable is the page index, see PageIndex in linear_probing.hh.
+// Key is the type of elements and page ids, see key_traits.hh.
+template <u64 epsilon, template <typename> class HashTable = LinearProbing, typename Key = u64>
 struct PBSBitTricks {
 
     static const u64 epsilon_squared      = epsilon*epsilon;
@@ -34,84 +44,180 @@ struct PBSBitTricks {
             words[word_i]  |= ((u64)(1) << remainder);
         }
 
-        inline u64 predecessor(u64 i){
+        inline bool test_bit(u64 i) const {
+            return (words[i / bits_per_word] >> (i % bits_per_word)) & 1;
+        }
+
+        // Does not modify the words, so concurrent readers are fine
+        inline u64 predecessor(u64 i) const {
             const u64 word_i = i / bits_per_word;
             const u64 index  = i % bits_per_word;
 
             const u64 lsh     = (u64)(1) << index;
             const u64 mask    = (lsh - 1) | lsh;
 
-            // NOTE: REMEMBER TO ALWAYS RESET words[word_i]. 
-            const u64 tmp = words[word_i];
-            words[word_i] &= mask;
-
+            const u64 masked_word = words[word_i] & mask;
             i64 best = -1;
-            for(u64 i = 0; i <= word_i; i++){
+            for(u64 i = 0; i < word_i; i++){
                 best = words[i] ? i : best;        
             }
+            if (masked_word) best = word_i;
 
-            if (best == -1) {
-                words[word_i] = tmp;
-                return 0;
-            } 
+            if (best == -1) return 0;
 
+            const u64 word          = best == (i64)word_i ? masked_word : words[best];
             const u64 base          = bits_per_word * best;
-            const u64 pred_in_word  = bits_per_word - 1 - std::__countl_zero(words[best]);
-            words[word_i] = tmp;
+            const u64 pred_in_word  = bits_per_word - 1 - std::countl_zero(word);
             return base + pred_in_word;
         }
 
-        inline u64 get_largest(){
+        inline u64 get_largest() const {
             return predecessor(bits_per_word * words_per_large_word - 1);
         }
+
+        // Number of set bits below bit i
+        inline u64 rank(u64 i) const {
+            const u64 word_i = i / bits_per_word;
+            u64 count = 0;
+            for (u64 w = 0; w < word_i; w++) count += __builtin_popcountll(words[w]);
+            return count + __builtin_popcountll(words[word_i] & (((u64)(1) << (i % bits_per_word)) - 1));
+        }
+
+        inline u64 count() const {
+            u64 count = 0;
+            for (u64 w = 0; w < words_per_large_word; w++) count += __builtin_popcountll(words[w]);
+            return count;
+        }
     };
 
 
-    LinearProbing<LargeWord> table;
-    LargeWord empty_large_word;
+    using Index = PageIndex<HashTable, LargeWord, Key>;
 
-    PBSBitTricks(){
-        empty_large_word = LargeWord();
-    };
+    Index table;
+
+    using Finger = PageFinger<Index>;
+
+    PBSBitTricks(){};
 
 
     std::string name(){
         std::stringstream sstm;
-        sstm << "PBSBitTricks<" << epsilon << ">";
+        sstm << "PBSBitTricks<" << epsilon;
+        if (HashTable<LargeWord>::name() != LinearProbing<LargeWord>::name()) sstm << ", " << HashTable<LargeWord>::name();
+        if (sizeof(Key) != sizeof(u64)) sstm << ", " << KeyTraits<Key>::name() << " keys";
+        sstm << ">";
         return sstm.str();
     }
 
-    inline static u64 get_id(u64 x){
+    inline static Key get_id(Key x){
         return x / (epsilon*epsilon); 
     }
 
-    inline static u64 recover_element(u64 id){
+    inline static Key recover_element(Key id){
         return id * (epsilon * epsilon);
     }
 
-    inline static u64 get_index_in_page(u64 x){
+    inline static u64 get_index_in_page(Key x){
         return x % (epsilon * epsilon);
     }
 
-    inline static bool is_id_page_bearer(u64){
+    inline static bool is_id_page_bearer(Key){
         // we store everything using their respective IDs. 
         return true; 
     }
 
-    inline bool try_insert_in_page(u64 x, u64){
-        u64 x_id = get_id(x);       
-        // 0: initialize with empty bitvector if the page does not exist
-        auto result = table.get_or_insert(x_id, empty_large_word);
+    inline bool try_insert_in_page(Key x, Key){
+        Key x_id = get_id(x);       
+        // 0: initialize with empty bitvector if the page does not exist.
+        // Constructed in place, so we don't copy a whole LargeWord per new page
+        auto result = table.try_emplace(x_id);
         const u64 index = get_index_in_page(x);
         result->value.set_bit(index);
         return true;
     }
 
-    inline u64 try_predecessor_in_page(u64 x, u64 id){
-        auto result = table.get(id);
+    // Inserts xs[0..n), which all have id `id`, with a single table probe
+    inline void insert_batch_in_page(const Key *xs, u64 n, Key id){
+        LargeWord &large_word = table.try_emplace(id)->value;
+        for (u64 i = 0; i < n; i++) large_word.set_bit(get_index_in_page(xs[i]));
+    }
+
+    inline bool contains(Key x){
+        const auto *entry = table.get(get_id(x));
+        return entry != nullptr && entry->value.test_bit(get_index_in_page(x));
+    }
+
+    // Drops every page with an id below id in one sweep of the table, which
+    // shrinks if it is mostly empty afterwards. For windows over increasing
+    // keys, see SlidingWindowPBS. Returns the number of pages dropped.
+    inline u64 expire_pages_below(Key id){
+        return table.erase_if([&](auto& entry){ return entry.key < id; });
+    }
+
+    // Set operations with other, page by page, on n_threads threads. Only
+    // with a LinearProbing page index, see bitmap_set_operations.hh.
+    void union_with(PBSBitTricks& other, u64 n_threads = 1){
+        bitmap_union(table, other.table, n_threads);
+    }
+
+    void intersect_with(PBSBitTricks& other, u64 n_threads = 1){
+        bitmap_intersect(table, other.table, n_threads);
+    }
+
+    void difference_with(PBSBitTricks& other, u64 n_threads = 1){
+        bitmap_difference(table, other.table, n_threads);
+    }
+
+    // A copy to query while this one goes on taking inserts. With a
+    // CowLinearProbing index it costs O(segments) and shares the pages until
+    // either side writes to them; with the other tables it is a full copy.
+    std::shared_ptr<PBSBitTricks> snapshot(){
+        return std::make_shared<PBSBitTricks>(*this);
+    }
+
+    // Calls f(x) for every element, page by page in table order
+    template <typename F>
+    void for_each_element(F f){
+        table.for_each([&](auto& entry){
+            for (u64 w = 0; w < words_per_large_word; w++){
+                for (u64 bits = entry.value.words[w]; bits != 0; bits &= bits - 1){
+                    f(recover_element(entry.key) + w * bits_per_word + std::countr_zero(bits));
+                }
+            }
+        });
+    }
+
+    // The LargeWords live in the table, so a page always costs
+    // sizeof(LargeWord) bytes of payload, however few elements it has
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(table);
+        return usage;
+    }
+
+    inline void prefetch_page(Key id){
+        table.prefetch(id);
+    }
+
+    inline Key try_predecessor_in_page(Key x, Key id){
+        return predecessor_in_entry(x, id, table.get(id));
+    }
+
+    // The same, but the page entry comes from the finger when it has it
+    inline Key try_predecessor_in_page(Key x, Key id, Finger& finger){
+        return predecessor_in_entry(x, id, finger.get(table, id));
+    }
+
+    // Answers the visits of xs[0..n) to page id with a single table probe
+    inline void predecessors_in_page(const Key *xs, u64 n, Key id, Key *results){
+        auto *entry = table.get(id);
+        for (u64 i = 0; i < n; i++) results[i] = predecessor_in_entry(xs[i], id, entry);
+    }
+
+    inline Key predecessor_in_entry(Key x, Key id, typename Index::Entry *result){
         if (result == nullptr) return 0;
 
-        const u64 x_id = get_id(x);
+        const Key x_id = get_id(x);
         u64 index_of_pred = x_id > id ? 
                             result->value.get_largest() :
                             result->value.predecessor(get_index_in_page(x)); 
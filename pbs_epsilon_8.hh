@@ -2,61 +2,208 @@
 
 #include "util.h"
 #include <cstdlib>
+#include <memory>
+#include <bit>
+#include <type_traits>
+#include <immintrin.h>
 #include "linear_probing.hh"
+#include "cuckoo_hashing.hh"
+#include "compact_linear_probing.hh"
+#include "cow_linear_probing.hh"
+#include "bloom_filtered_table.hh"
+#include "page_finger.hh"
+#include "bitmap_set_operations.hh"
 
 
 // The same as pbs_bit_tricks but with epilson=8 fixed. Sorry.
 
 // With epsilon = 8, we have epsilon^2 = 64, and we can
-// store a single 64-bit bitvector word for each 'page'
-struct PBSEpsilon8 {
+// store a single 64-bit bitvector word for each 'page'.
+// HashTable is the page index, see PageIndex in linear_probing.hh.
+// Key is the type of elements and page ids, see key_traits.hh.
+template <template <typename> class HashTable, typename Key = u64>
+struct PBSEpsilon8WithTable {
 
     static const u64 epsilon = 8;
     static const u64 bits_per_word = 64;
     u64 zero = 0;
 
-    LinearProbing<u64> table;
+    using Index = PageIndex<HashTable, u64, Key>;
 
-    PBSEpsilon8(){};
+    Index table;
+
+    using Finger = PageFinger<Index>;
+
+    PBSEpsilon8WithTable(){};
 
 
     std::string name(){
-        return "PBS - fixed epislon 8";
+        std::string suffix = HashTable<u64>::name() == LinearProbing<u64>::name() ? "" : HashTable<u64>::name();
+        if (sizeof(Key) != sizeof(u64)) suffix += (suffix.empty() ? "" : ", ") + KeyTraits<Key>::name() + " keys";
+        if (suffix.empty()) return "PBS - fixed epislon 8";
+        return "PBS - fixed epislon 8 (" + suffix + ")";
     }
 
-    inline static u64 get_id(u64 x){
+    inline static Key get_id(Key x){
         return x / (epsilon*epsilon); 
     }
 
-    inline static u64 recover_element(u64 id){
+    inline static Key recover_element(Key id){
         return id * (epsilon * epsilon);
     }
 
-    inline static u64 get_index_in_page(u64 x){
+    inline static u64 get_index_in_page(Key x){
         return x % (epsilon * epsilon);
     }
 
-    inline static bool is_id_page_bearer(u64){
+    inline static bool is_id_page_bearer(Key){
         // we store everything using their respective IDs. 
         return true; 
     }
 
-    inline bool try_insert_in_page(u64 x, u64){
-        u64 x_id = get_id(x);       
+    inline bool try_insert_in_page(Key x, Key){
+        Key x_id = get_id(x);       
         // 0: initialize with empty bitvector if the page does not exist
         auto result = table.get_or_insert(x_id, zero);
         result->value |= ((u64)(1) << get_index_in_page(x));
         return true;
     }
 
-    inline u64 try_predecessor_in_page(u64 x, u64 id){
-        auto result = table.get(id);
-        if (result == nullptr) return 0;
+    // Inserts xs[0..n), which all have id `id`, with a single table probe
+    inline void insert_batch_in_page(const Key *xs, u64 n, Key id){
+        u64 bits = 0;
+        for (u64 i = 0; i < n; i++) bits |= (u64)(1) << get_index_in_page(xs[i]);
+        table.get_or_insert(id, zero)->value |= bits;
+    }
 
-        
+    // Drops every page with an id below id in one sweep of the table, which
+    // shrinks if it is mostly empty afterwards. For windows over increasing
+    // keys, see SlidingWindowPBS. Returns the number of pages dropped.
+    inline u64 expire_pages_below(Key id){
+        return table.erase_if([&](auto& entry){ return entry.key < id; });
+    }
+
+    // Set operations with other, page by page, on n_threads threads. Only
+    // with a LinearProbing page index, see bitmap_set_operations.hh.
+    void union_with(PBSEpsilon8WithTable& other, u64 n_threads = 1){
+        bitmap_union(table, other.table, n_threads);
+    }
+
+    void intersect_with(PBSEpsilon8WithTable& other, u64 n_threads = 1){
+        bitmap_intersect(table, other.table, n_threads);
+    }
+
+    void difference_with(PBSEpsilon8WithTable& other, u64 n_threads = 1){
+        bitmap_difference(table, other.table, n_threads);
+    }
+
+    // A copy to query while this one goes on taking inserts. With a
+    // CowLinearProbing index it costs O(segments) and shares the pages until
+    // either side writes to them; with the other tables it is a full copy.
+    std::shared_ptr<PBSEpsilon8WithTable> snapshot(){
+        return std::make_shared<PBSEpsilon8WithTable>(*this);
+    }
+
+    // Calls f(x) for every element, page by page in table order
+    template <typename F>
+    void for_each_element(F f){
+        table.for_each([&](auto& entry){
+            for (u64 bits = entry.value; bits != 0; bits &= bits - 1){
+                f(recover_element(entry.key) + std::countr_zero(bits));
+            }
+        });
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(table);
+        return usage;
+    }
+
+    inline void prefetch_page(Key id){
+        table.prefetch(id);
+    }
+
+    // Whether x is in the set: one bit test in the page of x
+    inline bool contains(Key x){
+        const auto *entry = table.get(get_id(x));
+        return entry != nullptr && ((entry->value >> get_index_in_page(x)) & 1);
+    }
+
+    // Membership of xs[0..8): bit i of the result is set if xs[i] is in the set.
+    // With the default LinearProbing<u64> index and AVX-512, the 8 page ids are
+    // hashed and their home slots probed at once, see contains_batch_avx512().
+    inline u8 contains_batch(const Key *xs){
+        if constexpr (std::is_same<Index, LinearProbing<u64, u64>>::value){
+            if (has_avx512) return contains_batch_avx512(xs);
+        }
+        u8 result = 0;
+        for (u64 i = 0; i < 8; i++) result |= (u8)contains(xs[i]) << i;
+        return result;
+    }
+
+    inline static const bool has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+
+    // Gathers the home slot of the page of each of the 8 keys. A lane whose
+    // home slot holds its page id is answered with a bit test of the gathered
+    // bitmap, and one whose home slot is empty is absent; only lanes that hit
+    // another key, and have to probe further, go to contains() one by one.
+    // GCC 12's AVX-512 headers trip -Wuninitialized on their own placeholder vectors
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wuninitialized"
+    __attribute__((target("avx512f,avx512dq")))
+    u8 contains_batch_avx512(const u64 *xs){
+        static_assert(sizeof(typename Index::Entry) == 2 * sizeof(u64), "entries are {key, bitmap}");
+        const long long *words = (const long long*)table.table;
+
+        const __m512i x     = _mm512_loadu_si512((const void*)xs);
+        const __m512i id    = _mm512_srli_epi64(x, 6); // get_id: x / 64
+        const __m512i index = _mm512_and_si512(x, _mm512_set1_epi64(63));
+
+        __m512i slot = _mm512_mullo_epi64(id, _mm512_set1_epi64(KeyTraits<u64>::HASH_A));
+        slot = _mm512_add_epi64(slot, _mm512_set1_epi64(KeyTraits<u64>::HASH_B));
+        slot = _mm512_and_si512(slot, _mm512_set1_epi64(table.mod_capacity_bitmask));
+        const __m512i key_word = _mm512_slli_epi64(slot, 1);
+
+        const __m512i keys   = _mm512_i64gather_epi64(key_word, words, 8);
+        const __mmask8 found = _mm512_cmpeq_epi64_mask(keys, id);
+        const __mmask8 empty = _mm512_cmpeq_epi64_mask(keys, _mm512_set1_epi64(Index::EMPTY_CELL));
+
+        const __m512i value_word = _mm512_add_epi64(key_word, _mm512_set1_epi64(1));
+        const __m512i bitmaps    = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), found, value_word, words, 8);
+        const __m512i bits       = _mm512_srlv_epi64(bitmaps, index);
+        u8 result = _mm512_mask_test_epi64_mask(found, bits, _mm512_set1_epi64(1));
+
+        u8 collided = ~(found | empty);
+        while (collided){
+            const u64 i = __builtin_ctz(collided);
+            result |= (u8)contains(xs[i]) << i;
+            collided &= collided - 1;
+        }
+        return result;
+    }
+    #pragma GCC diagnostic pop
+
+    inline Key try_predecessor_in_page(Key x, Key id){
+        return predecessor_in_entry(x, id, table.get(id));
+    }
+
+    // The same, but the page entry comes from the finger when it has it
+    inline Key try_predecessor_in_page(Key x, Key id, Finger& finger){
+        return predecessor_in_entry(x, id, finger.get(table, id));
+    }
+
+    // Answers the visits of xs[0..n) to page id with a single table probe
+    inline void predecessors_in_page(const Key *xs, u64 n, Key id, Key *results){
+        auto *entry = table.get(id);
+        for (u64 i = 0; i < n; i++) results[i] = predecessor_in_entry(xs[i], id, entry);
+    }
+
+    inline Key predecessor_in_entry(Key x, Key id, typename Index::Entry *result){
+        if (result == nullptr) return 0;
 
         u64 elements = result->value;
-        u64 x_id = get_id(x);
+        Key x_id = get_id(x);
         
         
         // mask out the elements that are not predecessors
@@ -75,10 +222,12 @@ struct PBSEpsilon8 {
         // We might have masked out all the 1-bits in element
         if (elements == 0) return 0;
 
-        const u64 base_element = recover_element(id);
-        const u64 index_of_largest_element = bits_per_word - 1 - std::__countl_zero(elements);
+        const Key base_element = recover_element(id);
+        const u64 index_of_largest_element = bits_per_word - 1 - std::countl_zero(elements);
 
         auto ret =  base_element + index_of_largest_element;
         return ret;
     }
-};
\ No newline at end of file
+};
+
+using PBSEpsilon8 = PBSEpsilon8WithTable<LinearProbing>;
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <unordered_map>
 #include <vector>
 #include "util.h"
+#include "memory_usage.hh"
 #include <cstdlib>
 #include <cstring>
 
@@ -158,6 +159,10 @@ struct PBSLinearProbing {
         return true;
     }
 
+    inline void prefetch_page(u64 id){
+        __builtin_prefetch(table + (hash(id) & mod_capacity_bitmask));
+    }
+
     inline u64 try_predecessor_in_page(u64 x, u64 id){
         u64 best = 0;
         u64 current = hash(id) & mod_capacity_bitmask;
@@ -177,6 +182,17 @@ struct PBSLinearProbing {
     }
 
 
+    // Elements are stored directly in the table, there is no separate index
+    MemoryUsage memory_usage(){
+        u64 n_used = 0;
+        for (u64 i = 0; i < capacity; i++) n_used += table[i] != EMPTY_CELL;
+        MemoryUsage usage;
+        usage.page_payload    = n_used * sizeof(u64);
+        usage.allocator_slack = (capacity - n_used) * sizeof(u64) + malloc_overhead(table, table_size());
+        usage.metadata        = sizeof(*this);
+        return usage;
+    }
+
     u64 length_of_bucket_starting_at(u64 i){
         u64 prev = i == 0? capacity-1 : i-1;
         if (table[prev] != EMPTY_CELL || table[i] == EMPTY_CELL) return 0;
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include "util.h"
+#include "memory_usage.hh"
+#include "linear_probing.hh"
+#include "pbs_bit_tricks.hh"
+#include "pbs_with_page_bearer_hashing.hh"
+
+
+// Map variants of the PBS structures: every element carries a fixed-size
+// value, and a predecessor query returns the key and the value of the
+// predecessor from the same page visit, instead of a second lookup in a
+// table of values afterwards.
+//
+// They follow the same protocol as the sets (get_id, is_id_page_bearer and
+// the page walks of generate_pbs_test_data), with two more calls:
+//
+//      try_insert_in_page(x, id, value)           inserts x, or overwrites its value
+//      try_predecessor_in_page(x, id, key, value) false if the page has nothing <= x
+//
+// try_predecessor_in_page(x, id) answers with the key alone, as for the sets.
+
+
+// PBSBitTricks with a rank-indexed array of values per page: the value of the
+// element at bit i of the page is values[rank(i)], where rank(i) is the
+// number of set bits below i. A query finds the bit of the predecessor as in
+// PBSBitTricks and then reads one value next to the page's bitmap.
+//
+// The array has room for the next power of two of the page's elements, so an
+// insertion reallocates it only when the count reaches a power of two, and
+// shifts the values above the new element up by one.
+template <u64 epsilon, typename Value, template <typename> class HashTable = LinearProbing, typename Key = u64>
+struct PBSBitTricksMap {
+
+    static_assert(std::is_trivially_copyable<Value>::value, "values are moved with memmove and realloc");
+
+    using Set       = PBSBitTricks<epsilon, HashTable, Key>;
+    using LargeWord = typename Set::LargeWord;
+
+    // Copied around by the table as it is; the values belong to the map
+    struct Page {
+        LargeWord bits;
+        Value *values = nullptr;
+    };
+
+    using Index = PageIndex<HashTable, Page, Key>;
+
+    Index table;
+
+    PBSBitTricksMap(){};
+
+    ~PBSBitTricksMap(){
+        table.for_each([](auto& entry){ free(entry.value.values); });
+    }
+
+    PBSBitTricksMap(const PBSBitTricksMap& other) = delete;
+    PBSBitTricksMap& operator=(const PBSBitTricksMap& other) = delete;
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << "PBSBitTricksMap<" << epsilon << ", " << sizeof(Value) << "-byte values";
+        if (HashTable<Page>::name() != LinearProbing<Page>::name()) sstm << ", " << HashTable<Page>::name();
+        if (sizeof(Key) != sizeof(u64)) sstm << ", " << KeyTraits<Key>::name() << " keys";
+        sstm << ">";
+        return sstm.str();
+    }
+
+    inline static Key get_id(Key x){
+        return Set::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(Key id){
+        return Set::is_id_page_bearer(id);
+    }
+
+    // Slots in the values array of a page with n elements
+    inline static u64 capacity_for(u64 n){
+        return n == 0 ? 0 : std::bit_ceil(n);
+    }
+
+    inline bool try_insert_in_page(Key x, Key, const Value& value){
+        Page &page = table.try_emplace(get_id(x))->value;
+        const u64 index = Set::get_index_in_page(x);
+        const u64 rank  = page.bits.rank(index);
+        if (page.bits.test_bit(index)){
+            page.values[rank] = value;
+            return true;
+        }
+
+        const u64 n = page.bits.count();
+        if (n == capacity_for(n)){
+            page.values = (Value*)realloc(page.values, capacity_for(n + 1) * sizeof(Value));
+            if (!page.values) std::cout << "Allocation of PBSBitTricksMap values failed.\n", exit(1);
+        }
+        memmove(page.values + rank + 1, page.values + rank, (n - rank) * sizeof(Value));
+        page.values[rank] = value;
+        page.bits.set_bit(index);
+        return true;
+    }
+
+    inline bool try_predecessor_in_page(Key x, Key id, Key& key, Value& value){
+        const auto *entry = table.get(id);
+        if (entry == nullptr) return false;
+        const Page &page = entry->value;
+
+        const u64 index = get_id(x) > id ? page.bits.get_largest() : page.bits.predecessor(Set::get_index_in_page(x));
+        // predecessor() answers 0 when there is nothing <= x, as well as for bit 0
+        if (!page.bits.test_bit(index)) return false;
+        key   = Set::recover_element(id) + index;
+        value = page.values[page.bits.rank(index)];
+        return true;
+    }
+
+    inline Key try_predecessor_in_page(Key x, Key id){
+        Key key;
+        Value value;
+        return try_predecessor_in_page(x, id, key, value) ? key : 0;
+    }
+
+    inline void prefetch_page(Key id){
+        table.prefetch(id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(table);
+        table.for_each([&](auto& entry){
+            const u64 n        = entry.value.bits.count();
+            const u64 capacity = capacity_for(n);
+            usage.page_payload    += n * sizeof(Value);
+            usage.allocator_slack += (capacity - n) * sizeof(Value) + malloc_overhead(entry.value.values, capacity * sizeof(Value));
+        });
+        return usage;
+    }
+};
+
+template <typename Value, template <typename> class HashTable = LinearProbing, typename Key = u64>
+using PBSEpsilon8Map = PBSBitTricksMap<8, Value, HashTable, Key>;
+
+
+// PBSPageBearerHashing with a value per element. The values of a page are in
+// a vector of their own, in the order of the keys, so the scan for the
+// predecessor reads only keys and then loads one value.
+//
+// This is the plain structure: pages split only at hash-chosen bearers
+// (max_page_factor = 0), and cold pages are not packed.
+template <u64 epsilon, typename Value, template <typename> class HashTable = LinearProbing, typename Key = u64>
+struct PBSPageBearerHashingMap {
+
+    using Set = PBSPageBearerHashing<epsilon, HashTable, 0, Key>;
+
+    struct Page {
+        std::vector<Key> keys;
+        std::vector<Value> values;
+    };
+
+    using Index = PageIndex<HashTable, Page*, Key>;
+
+    Index table;
+    bool zero_inserted = false;
+
+    PBSPageBearerHashingMap(){
+        // The page of id 0 always exists, as in PBSPageBearerHashing. Its
+        // placeholder element 0 is there for the walks and has no value
+        // until 0 is inserted.
+        Page *page = new Page;
+        page->keys.push_back(0);
+        page->values.push_back(Value());
+        table.get_or_insert(0, page);
+    }
+
+    ~PBSPageBearerHashingMap(){
+        table.for_each([](auto& entry){ delete entry.value; });
+    }
+
+    PBSPageBearerHashingMap(const PBSPageBearerHashingMap& other) = delete;
+    PBSPageBearerHashingMap& operator=(const PBSPageBearerHashingMap& other) = delete;
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << "PBSPageBearerHashingMap<" << epsilon << ", " << sizeof(Value) << "-byte values";
+        if (HashTable<Page*>::name() != LinearProbing<Page*>::name()) sstm << ", " << HashTable<Page*>::name();
+        if (sizeof(Key) != sizeof(u64)) sstm << ", " << KeyTraits<Key>::name() << " keys";
+        sstm << ">";
+        return sstm.str();
+    }
+
+    inline static Key get_id(Key x){
+        return Set::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(Key id){
+        return Set::is_id_page_bearer(id);
+    }
+
+    inline Page* get_page(Key page_id){
+        if (!is_id_page_bearer(page_id)) return nullptr;
+        auto *entry = table.get(page_id);
+        return entry == nullptr ? nullptr : entry->value;
+    }
+
+    inline static void insert_or_assign(Page *page, Key x, const Value& value){
+        for (u64 i = 0; i < page->keys.size(); i++){
+            if (page->keys[i] == x){
+                page->values[i] = value;
+                return;
+            }
+        }
+        page->keys.push_back(x);
+        page->values.push_back(value);
+    }
+
+    // Moves every element >= x, with its value, from one page to the other
+    inline static void move_elements_from(Page *from, Page *to, Key x){
+        u64 i = 0;
+        while (i < from->keys.size()){
+            if (from->keys[i] >= x){
+                to->keys.push_back(from->keys[i]);
+                to->values.push_back(from->values[i]);
+                from->keys[i]   = from->keys.back();
+                from->values[i] = from->values.back();
+                from->keys.pop_back();
+                from->values.pop_back();
+            }
+            else i++;
+        }
+    }
+
+    // The same cases as PBSPageBearerHashing::try_insert_in_page
+    inline bool try_insert_in_page(Key x, Key page_id, const Value& value){
+        Page *page = get_page(page_id);
+        if (page == nullptr) return false;
+        if (x == 0) zero_inserted = true;
+
+        const Key x_id = get_id(x);
+        if (!is_id_page_bearer(x_id) || x_id == page_id){
+            insert_or_assign(page, x, value);
+            return true;
+        }
+
+        auto *x_entry = table.get(x_id);
+        if (x_entry != nullptr){
+            insert_or_assign(x_entry->value, x, value);
+            return true;
+        }
+
+        Page *new_page = new Page;
+        move_elements_from(page, new_page, x);
+        insert_or_assign(new_page, x, value);
+        table.get_or_insert(x_id, new_page);
+        return true;
+    }
+
+    inline bool try_predecessor_in_page(Key x, Key page_id, Key& key, Value& value){
+        const Page *page = get_page(page_id);
+        if (page == nullptr) return false;
+        const std::vector<Key> &keys = page->keys;
+        u64 best_i = keys.size();
+        Key best   = 0;
+        for (u64 i = 0; i < keys.size(); i++){
+            if (keys[i] <= x && keys[i] >= best){
+                best   = keys[i];
+                best_i = i;
+            }
+        }
+        if (best_i == keys.size() || (best == 0 && !zero_inserted)) return false;
+        key   = best;
+        value = page->values[best_i];
+        return true;
+    }
+
+    inline Key try_predecessor_in_page(Key x, Key page_id){
+        Key key;
+        Value value;
+        return try_predecessor_in_page(x, page_id, key, value) ? key : 0;
+    }
+
+    inline void prefetch_page(Key page_id){
+        if (!is_id_page_bearer(page_id)) return;
+        table.prefetch(page_id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        // The values in the table are page pointers, which belong to the index
+        usage.index_table  += usage.page_payload;
+        usage.page_payload  = 0;
+        usage.metadata     += sizeof(*this) - sizeof(table);
+
+        table.for_each([&](auto& entry){
+            const Page *page = entry.value;
+            usage.metadata        += sizeof(Page);
+            usage.allocator_slack += malloc_overhead(page, sizeof(Page));
+            usage.page_payload    += page->keys.size() * sizeof(Key) + page->values.size() * sizeof(Value);
+            usage.allocator_slack += (page->keys.capacity() - page->keys.size()) * sizeof(Key)
+                                   + (page->values.capacity() - page->values.size()) * sizeof(Value)
+                                   + malloc_overhead(page->keys.data(), page->keys.capacity() * sizeof(Key))
+                                   + malloc_overhead(page->values.data(), page->values.capacity() * sizeof(Value));
+        });
+        return usage;
+    }
+};
+
+
+// What the maps replace: a set, and the values in a separate LinearProbing
+// keyed by element, looked up after the set has found the predecessor.
+template <typename pbs_structure, typename Value>
+struct PBSWithValueTable {
+
+    pbs_structure pbs;
+    LinearProbing<Value> values;
+
+    PBSWithValueTable(){};
+
+    std::string name(){
+        return pbs.name() + " + value table";
+    }
+
+    inline static u64 get_id(u64 x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    inline bool try_insert_in_page(u64 x, u64 id, const Value& value){
+        values.try_emplace(x)->value = value;
+        return pbs.try_insert_in_page(x, id);
+    }
+
+    inline bool try_predecessor_in_page(u64 x, u64 id, u64& key, Value& value){
+        const u64 res = pbs.try_predecessor_in_page(x, id);
+        // The sets answer 0 when there is no predecessor, and PBSBitTricks
+        // the first key of the page; neither has a value unless inserted
+        const auto *entry = values.get(res);
+        if (entry == nullptr) return false;
+        key   = res;
+        value = entry->value;
+        return true;
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        return pbs.try_predecessor_in_page(x, id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = pbs.memory_usage();
+        MemoryUsage value_usage = values.memory_usage();
+        usage.index_table     += value_usage.index_table;
+        usage.page_payload    += value_usage.page_payload;
+        usage.allocator_slack += value_usage.allocator_slack;
+        usage.metadata        += value_usage.metadata + sizeof(*this) - sizeof(pbs) - sizeof(values);
+        return usage;
+    }
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <random>
 #include <set>
@@ -5,20 +7,30 @@
 #include <vector>
 #include <algorithm>
 #include "util.h"
+#include "memory_usage.hh"
+#include "compressed_page.hh"
+#include "key_traits.hh"
 
 
 // Page bearer structure using std::map and std::vec
-// determines if an element is a page bearer using a hash function
+// determines if an element is a page bearer using a hash function.
+// Cold pages can be packed with compress_cold_pages(), as in PBSPageBearerHashing.
+// Key is the type of elements and page ids, see key_traits.hh.
 
-template <uint64_t epsilon>
+template <uint64_t epsilon, typename Key = u64>
 struct MapAndVecPBS {
 
+    struct Page {
+        std::vector<Key> elements;
+        PackedElements<Key> packed;
+        u64 last_write = 0;
+    };
+
+    std::unordered_map<Key, Page> map;
+    u64 n_page_writes = 0;
 
-    std::unordered_map<u64, std::vector<u64>> map;
     MapAndVecPBS() {
-        std::vector<u64> v; 
-        v.push_back(0);
-        map.insert({0,v});
+        map[0].elements.push_back(0);
     }
 
     // We use normal multiply-shift, which is not sufficient in theory due 
@@ -26,51 +38,53 @@ struct MapAndVecPBS {
     // 64-bit keys, odd inputs are never congruent 0 mod epsilon. We force
     // each input to be even for this reason. Note that a must be a uniformly
     // chosen integer at runtime for theoretical guarantees. 
-    static u64 pbHash(u64 x) {
+    static u64 pbHash(Key x) {
         //x &= 0xFFFFFFFE; 
         const u64 a = 2187650952262969439;
         //const u64 b = 2349073786287317910;
-        return (a * x); // + b;
+        return (a * KeyTraits<Key>::fold(x)); // + b;
     }
 
-    static u64 get_id(u64 x){
+    static Key get_id(Key x){
         return x/epsilon;
     }
 
-    static bool is_id_page_bearer(u64 id){
+    static bool is_id_page_bearer(Key id){
         return pbHash(id) % epsilon == 0;
     }
 
     std::string name(){
+        if (sizeof(Key) != sizeof(u64)) return "Map-And-Vec PBS (" + KeyTraits<Key>::name() + " keys)";
         return "Map-And-Vec PBS";
     }
 
-    inline bool try_insert_in_page(u64 x, u64 id){
+    inline bool try_insert_in_page(Key x, Key id){
         if (!is_id_page_bearer(id)) return false;
         auto pt = map.find(id);
         if (pt == map.end()) return false;
+        make_writable(pt->second);
+        std::vector<Key> &elements = pt->second.elements;
 
-        u64 xid = x / epsilon;
+        Key xid = x / epsilon;
         if (!is_id_page_bearer(xid) || xid == id){
             // x is not a page bearer, or x is a page bearer but xid == id 
-            for (auto e : pt->second){
+            for (auto e : elements){
                 if (e == x) return true;
             }
-            pt->second.push_back(x);
+            elements.push_back(x);
         }
         else {
             // x is a page bearer different from id; we split the page ID and create a new one
-            std::vector<u64> x_page;
-            map.insert({xid, x_page});
-            auto xpt = map.find(xid);
+            Page &x_page = map[xid];
+            x_page.last_write = n_page_writes;
 
-            xpt->second.push_back(x);
+            x_page.elements.push_back(x);
             u64 i = 0; 
-            while (i < pt->second.size()){
-                if (pt->second[i] >= x) {
-                    xpt->second.push_back(pt->second[i]);
-                    pt->second[i] = pt->second.back();
-                    pt->second.pop_back();
+            while (i < elements.size()){
+                if (elements[i] >= x) {
+                    x_page.elements.push_back(elements[i]);
+                    elements[i] = elements.back();
+                    elements.pop_back();
                 }
                 else {
                     i++;
@@ -82,29 +96,83 @@ struct MapAndVecPBS {
         return true;
     }
 
-    inline u64 try_predecessor_in_page(u64 x, u64 id){
+    inline Key try_predecessor_in_page(Key x, Key id){
         if (pbHash(id) % epsilon != 0) return 0;
         
         auto pt = map.find(id);
         if (pt == map.end()) return 0;
+        if (pt->second.packed.is_packed()) return pt->second.packed.predecessor(x);
         
         // elements is never empty
-        auto elements = pt->second;
-        u64 best = 0;
+        auto elements = pt->second.elements;
+        Key best = 0;
         for (auto e : elements){
             if (e >= best && e <= x) best = e;
         }
         return best;
     }
 
-    bool tryDeleteInPage(u64 x, u64 id){
+    inline void make_writable(Page& page){
+        if (page.packed.is_packed()) page.packed.unpack(page.elements);
+        page.last_write = ++n_page_writes;
+    }
+
+    // Packs every page with at least min_size elements that has not been
+    // written to in the last min_idle_writes page writes
+    u64 compress_cold_pages(u64 min_idle_writes, u64 min_size = 8){
+        u64 n_packed = 0;
+        for (auto& [key, page] : map){
+            if (page.packed.is_packed() || page.elements.size() < min_size) continue;
+            if (n_page_writes - page.last_write < min_idle_writes) continue;
+            n_packed += page.packed.pack(page.elements);
+        }
+        return n_packed;
+    }
+
+    // Calls f(id, elements) for every page, with the elements of packed
+    // pages unpacked into a copy
+    template <typename F>
+    void for_each_page(F f){
+        for (auto& [id, page] : map){
+            if (!page.packed.is_packed()){
+                f(id, page.elements);
+                continue;
+            }
+            std::vector<Key> elements;
+            for (u64 i = 0; i < page.packed.n; i++) elements.push_back(page.packed.base + page.packed.offset(i));
+            f(id, elements);
+        }
+    }
+
+    bool tryDeleteInPage(Key x, Key id){
         std::cout << "Delete not implemented\n";
         exit(1);
     }
 
+    // The node layout is libstdc++'s: a next pointer followed by the pair.
+    // We can't get at the node pointers, so their malloc overhead is estimated.
+    MemoryUsage memory_usage(){
+        using Node = std::pair<void*, std::pair<const Key, Page>>;
+        MemoryUsage usage;
+        usage.metadata        = sizeof(*this);
+        usage.index_table     = map.bucket_count() * sizeof(void*);
+        usage.allocator_slack = estimated_malloc_overhead(map.bucket_count() * sizeof(void*));
+        for (auto& [key, val] : map){
+            usage.index_table     += sizeof(void*) + sizeof(key);
+            const std::vector<Key> &elements = val.elements;
+            usage.metadata        += sizeof(val);
+            usage.allocator_slack += estimated_malloc_overhead(sizeof(Node));
+            usage.page_payload    += elements.size() * sizeof(Key) + val.packed.payload_bytes();
+            usage.allocator_slack += (elements.capacity() - elements.size()) * sizeof(Key)
+                                   + malloc_overhead(elements.data(), elements.capacity() * sizeof(Key))
+                                   + malloc_overhead(val.packed.bytes, val.packed.payload_bytes());
+        }
+        return usage;
+    }
+
     u64 size(){
         u64 total_size = 0;
-        for (auto& [key,val] : map) total_size += val.size();
+        for (auto& [key,val] : map) total_size += val.elements.size() + val.packed.n;
         return total_size;
     }
 
@@ -113,7 +181,8 @@ struct MapAndVecPBS {
 
         for (auto& [key,val] : map){
             std::cout << key << ": ";
-            for (auto e : val) std::cout << e << ", ";
+            for (auto e : val.elements) std::cout << e << ", ";
+            for (u64 i = 0; i < val.packed.n; i++) std::cout << val.packed.base + val.packed.offset(i) << ", ";
             std::cout << "\n";
         }
         std::cout << "\n-------------------------\n";
@@ -128,7 +197,7 @@ struct MapAndVecPBS {
         std::cout << "the ratio is " << ((double)map.size())/((double)ratio) << "\n";
 
         std::vector<u64> bucket_lengths; 
-        for (auto& [key,val] : map) bucket_lengths.push_back(val.size());
+        for (auto& [key,val] : map) bucket_lengths.push_back(val.elements.size() + val.packed.n);
         std::sort(bucket_lengths.begin(), bucket_lengths.end());
 
 
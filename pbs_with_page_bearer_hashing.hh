@@ -1,25 +1,120 @@
 #pragma once
 
 #include <sstream>
+#include <algorithm>
+#include <memory>
 
 #include "util.h"
 #include "linear_probing.hh"
+#include "cuckoo_hashing.hh"
+#include "compact_linear_probing.hh"
+#include "cow_linear_probing.hh"
+#include "bloom_filtered_table.hh"
+#include "page_finger.hh"
+#include "compressed_page.hh"
+
+
+
+// Linear probing hash table where each entry is (key, ptr_to_page)
+// determines if an element is a page bearer using a hash function.
+// HashTable is the page index, see PageIndex in linear_probing.hh.
+//
+// With max_page_factor > 0, a page that grows beyond max_page_factor * epsilon
+// elements is split by promoting an extra bearer: the upper part of the page
+// moves to a new page keyed by the id of its smallest element (the pivot).
+// The walk in generate_pbs_test_data visits the id of every element <= x until
+// it reaches a hash-chosen bearer, so the pivot's id is visited whenever
+// pivot <= x. Each page then only answers for the keys below split_limit, the
+// pivot of the page promoted out of it, and exactly one visited page answers.
+// With max_page_factor = 0 we only split at hash-chosen bearers as before.
+//
+// compress_cold_pages() packs the pages that have not been written to for a
+// while into PackedElements. A packed page answers queries from the packed
+// offsets and is unpacked into its vector on the next write to it.
+//
+// snapshot() gives a read-only view of the pages as they are, to query while
+// the structure takes inserts. Pages are stamped with the epoch they were
+// written in, and a write to a page that a live snapshot may hold goes to a
+// copy of it instead. The old version is freed once the snapshots that can
+// see it are released. With a CowLinearProbing index the snapshot shares
+// the index too, segment by segment, and costs O(segments).
+//
+// Key is the type of elements and page ids (u32, u64 or u128, see
+// key_traits.hh). With u32 keys a cache line of a page holds 16 elements.
+template <u64 epsilon, template <typename> class HashTable = LinearProbing, u64 max_page_factor = 0, typename Key = u64>
+struct PBSPageBearerHashing {
 
+    using VEC = std::vector<Key>;
 
+    static constexpr Key NO_LIMIT = KeyTraits<Key>::ALL_ONES;
 
-// Linear probing hash table where each entry is (key, ptr_to_vector)
-// determines if an element is a page bearer using a hash function
-template <u64 epsilon>
-struct PBSPageBearerHashing {
+    // A page owns the keys in [first, split_limit). first is 0 for the pages
+    // of hash-chosen bearers, and the pivot for promoted pages. The elements
+    // are either in the vector or, for cold pages, packed.
+    struct Page {
+        VEC elements;
+        PackedElements<Key> packed;
+        Key first = 0;
+        Key split_limit = NO_LIMIT;
+        u64 size_at_failed_split = 0;
+        u64 last_write = 0;
+        u64 epoch = 0;
+
+        u64 size() const {
+            return elements.size() + packed.n;
+        }
+    };
+
+    using Index = PageIndex<HashTable, Page*, Key>;
+
+    Index table;
+
+    // Writes to pages so far, the clock for how long a page has been cold
+    u64 n_page_writes = 0;
+
+    // The pages at the time of snapshot(), see the top of the file
+    struct Snapshot {
+        Index table;
+        u64 epoch;
+
+        static std::string name(){
+            return "Snapshot of " + PBSPageBearerHashing::name();
+        }
+
+        inline static Key get_id(Key x){
+            return PBSPageBearerHashing::get_id(x);
+        }
+
+        inline static bool is_id_page_bearer(Key id){
+            return PBSPageBearerHashing::is_id_page_bearer(id);
+        }
 
-    using VEC = std::vector<u64>;
+        inline Key try_predecessor_in_page(Key x, Key page_id){
+            if (max_page_factor == 0 && !is_id_page_bearer(page_id)) return 0;
+            auto *entry = table.get(page_id);
+            return predecessor_in_page(x, entry == nullptr ? nullptr : entry->value);
+        }
+    };
+
+    // A page replaced by its copy, which the snapshots of epochs [first, last) see
+    struct RetiredPage {
+        Page *page;
+        u64 first;
+        u64 last;
+    };
 
-    LinearProbing<VEC*> table;
+    u64 epoch = 0;
+    u64 shared_below = 0; // pages of earlier epochs may be in a live snapshot
+    std::vector<std::pair<u64, std::weak_ptr<Snapshot>>> snapshots;
+    std::vector<RetiredPage> retired;
+    u64 n_pages_copied = 0;
+
+    using Finger = PageFinger<Index>;
 
     PBSPageBearerHashing(){
-        VEC *vec = new VEC;
-        vec->push_back(0);
-        table.get_or_insert(0, vec);
+        Page *page = new Page;
+        page->elements.push_back(0);
+        table.get_or_insert(0, page);
     }
 
     ~PBSPageBearerHashing(){
@@ -39,26 +134,30 @@ struct PBSPageBearerHashing {
         } else return *this;
     }
 
-    std::string name(){
+    static std::string name(){
         std::stringstream sstm;
-        sstm << "PBSPageBearerHashing<" << epsilon << ">";
+        sstm << "PBSPageBearerHashing<" << epsilon;
+        if (HashTable<Page*>::name() != LinearProbing<Page*>::name()) sstm << ", " << HashTable<Page*>::name();
+        if (max_page_factor > 0) sstm << ", split above " << max_page_factor << "*epsilon";
+        if (sizeof(Key) != sizeof(u64)) sstm << ", " << KeyTraits<Key>::name() << " keys";
+        sstm << ">";
         return sstm.str();
     }
 
-    inline static u64 pb_hash(u64 x){
+    inline static u64 pb_hash(Key x){
         uint64_t a = 8163375249528611521;
-        return a * x;
+        return a * KeyTraits<Key>::fold(x);
     }
 
-    inline static u64 get_id(u64 x){
+    inline static Key get_id(Key x){
         return x/epsilon;
     }
 
-    inline static bool is_id_page_bearer(u64 id){
+    inline static bool is_id_page_bearer(Key id){
         return pb_hash(id) % epsilon == 0;
     }
 
-    inline void insert_if_not_present(std::vector<u64> *vec, u64 x){
+    inline void insert_if_not_present(VEC *vec, Key x){
         bool already_present = false;
         for (auto e : *vec){
             if (e == x) {
@@ -69,49 +168,244 @@ struct PBSPageBearerHashing {
         if (!already_present) vec->push_back(x);
     }
 
-    inline bool try_insert_in_page(u64 x, u64 page_id){
-        if(!is_id_page_bearer(page_id)) return false;
+    // Moves every element >= x from one page to the other
+    inline static void move_elements_from(VEC &from, VEC &to, Key x){
+        Key tmp;
+        u64 i = 0;
+        while (i < from.size()){
+            tmp = from[i];
+            if (tmp >= x){
+                to.push_back(tmp);
+                from[i] = from.back();
+                from.pop_back();
+            }
+            else i++;
+        }
+    }
 
+    inline Page* get_page(Key page_id){
+        // Only hash-chosen bearers have pages unless we promote
+        if (max_page_factor == 0 && !is_id_page_bearer(page_id)) return nullptr;
         auto *entry = table.get(page_id);
-        if (entry == nullptr) return false;
+        if (entry == nullptr) return nullptr;
+        return entry->value;
+    }
 
-        VEC *vec = entry->value;
+    inline bool try_insert_in_page(Key x, Key page_id){
+        Page *page = get_page(page_id);
+        if (page == nullptr) return false;
+        if (x < page->first || x >= page->split_limit) return false;
+        page = make_writable(page, page_id);
 
-        const u64 x_id = get_id(x);
+        const Key x_id = get_id(x);
         bool should_split_page = is_id_page_bearer(x_id) && x_id != page_id;
 
-        if (!should_split_page) insert_if_not_present(vec, x);            
-        else {
-            VEC *new_page = new VEC;
-            new_page->push_back(x);
-
-            VEC &vec_ref = *vec;
-            u64 tmp;
-            u64 i = 0;
-            while (i < vec_ref.size()){
-                tmp = vec_ref[i];
-                if (tmp >= x){
-                    new_page->push_back(tmp);
-                    vec_ref[i] = vec_ref.back();
-                    vec_ref.pop_back();
-                }
-                else i++;
-            }
-            table.get_or_insert(x_id, new_page);
+        if (!should_split_page) {
+            insert_if_not_present(&page->elements, x);
+            promote_if_too_large(page, page_id);
+            return true;
+        }
+
+        // x's own page exists if smaller elements with x's id were inserted
+        // after the page was created. Those walks never reach x_id.
+        auto *x_entry = table.get(x_id);
+        if (x_entry != nullptr){
+            Page *x_page = make_writable(x_entry->value, x_id);
+            insert_if_not_present(&x_page->elements, x);
+            promote_if_too_large(x_page, x_id);
+            return true;
         }
+
+        Page *new_page = new Page;
+        new_page->last_write = n_page_writes;
+        new_page->epoch      = epoch;
+        new_page->elements.push_back(x);
+        move_elements_from(page->elements, new_page->elements, x);
+        // Pages promoted out of this one above x now follow the new page
+        new_page->split_limit = page->split_limit;
+        table.get_or_insert(x_id, new_page);
+        promote_if_too_large(new_page, x_id);
         return true;
     }
 
-    inline u64 try_predecessor_in_page(u64 x, u64 page_id){
-        if(!is_id_page_bearer(page_id)) return 0;
+    // The page to write to instead of page, which is the page of page_id:
+    // page itself, or its copy if a snapshot may hold it
+    inline Page* make_writable(Page *page, Key page_id){
+        if (page->epoch < shared_below) page = copy_page(page, page_id);
+        if (page->packed.is_packed()) page->packed.unpack(page->elements);
+        page->last_write = ++n_page_writes;
+        return page;
+    }
+
+    // Puts an unpacked copy of page in the table and retires page
+    Page* copy_page(Page *page, Key page_id){
+        Page *copy = new Page;
+        copy->elements = page->elements;
+        for (u64 i = 0; i < page->packed.n; i++) copy->elements.push_back(page->packed.base + page->packed.offset(i));
+        copy->first                = page->first;
+        copy->split_limit          = page->split_limit;
+        copy->size_at_failed_split = page->size_at_failed_split;
+        copy->last_write           = page->last_write;
+        copy->epoch                = epoch;
+        table.get_or_insert(page_id, copy)->value = copy;
+        retired.push_back({.page = page, .first = page->epoch, .last = epoch});
+        n_pages_copied++;
+        return copy;
+    }
+
+    // Must be called on the thread that inserts. The snapshot may be queried
+    // and released on any thread.
+    std::shared_ptr<Snapshot> snapshot(){
+        release_retired_pages();
+        auto taken = std::make_shared<Snapshot>(Snapshot{.table = table, .epoch = epoch});
+        snapshots.push_back({epoch, taken});
+        shared_below = ++epoch;
+        return taken;
+    }
+
+    // Frees the retired pages that no live snapshot sees, and stops copying
+    // pages that only released snapshots held. Called by snapshot(); call it
+    // as well if snapshots are taken rarely. Returns the number of pages freed.
+    u64 release_retired_pages(){
+        std::erase_if(snapshots, [](const auto& s){ return s.second.expired(); });
+        // Orders the frees after the reads of the snapshots released on other threads
+        std::atomic_thread_fence(std::memory_order_acquire);
+        shared_below = snapshots.empty() ? 0 : snapshots.back().first + 1;
+
+        auto is_seen = [&](const RetiredPage& r){
+            for (const auto& s : snapshots){
+                if (s.first >= r.first && s.first < r.last) return true;
+            }
+            return false;
+        };
+        const u64 n_before = retired.size();
+        std::erase_if(retired, [&](const RetiredPage& r){
+            if (is_seen(r)) return false;
+            delete r.page;
+            return true;
+        });
+        return n_before - retired.size();
+    }
+
+    // Packs every page with at least min_size elements that has not been
+    // written to in the last min_idle_writes page writes. Returns how many
+    // pages were packed.
+    u64 compress_cold_pages(u64 min_idle_writes, u64 min_size = 8){
+        u64 n_packed = 0;
+        table.for_each([&](auto& entry){
+            Page *page = entry.value;
+            if (page->packed.is_packed() || page->elements.size() < min_size) return;
+            if (page->epoch < shared_below) return; // a snapshot may be reading it
+            if (n_page_writes - page->last_write < min_idle_writes) return;
+            n_packed += page->packed.pack(page->elements);
+        });
+        return n_packed;
+    }
+
+    inline bool can_be_promoted(Key id, Key page_id){
+        return id != page_id && !is_id_page_bearer(id) && table.get(id) == nullptr;
+    }
+
+    // Splits the page roughly in half if it has grown too large. The pivot must
+    // be the smallest element of its id in the page, and the id must not have
+    // a page already.
+    void promote_if_too_large(Page *page, Key page_id){
+        if (max_page_factor == 0) return;
+        const u64 size = page->elements.size();
+        if (size <= max_page_factor * epsilon || size < 2 * page->size_at_failed_split) return;
+
+        VEC sorted = page->elements;
+        std::sort(sorted.begin(), sorted.end());
+
+        Key pivot = NO_LIMIT;
+        for (u64 i = size / 2; i < size && pivot == NO_LIMIT; i++){
+            const Key id = get_id(sorted[i]);
+            if (get_id(sorted[i-1]) != id && can_be_promoted(id, page_id)) pivot = sorted[i];
+        }
+        for (u64 i = size / 2 - 1; i > 0 && pivot == NO_LIMIT; i--){
+            const Key id = get_id(sorted[i]);
+            if (get_id(sorted[i-1]) != id && can_be_promoted(id, page_id)) pivot = sorted[i];
+        }
+        if (pivot == NO_LIMIT){
+            page->size_at_failed_split = size;
+            return;
+        }
+
+        Page *new_page = new Page;
+        new_page->last_write  = n_page_writes;
+        new_page->epoch       = epoch;
+        new_page->first       = pivot;
+        new_page->split_limit = page->split_limit;
+        move_elements_from(page->elements, new_page->elements, pivot);
+        page->split_limit = pivot;
+        page->size_at_failed_split = 0;
+        table.get_or_insert(get_id(pivot), new_page);
+    }
+
+    // Calls f(id, split_limit, elements) for every page, with the elements
+    // of packed pages unpacked into a copy
+    template <typename F>
+    void for_each_page(F f){
+        table.for_each([&](auto& entry){
+            Page *page = entry.value;
+            if (!page->packed.is_packed()) return f(entry.key, page->split_limit, page->elements);
+            VEC elements;
+            for (u64 i = 0; i < page->packed.n; i++) elements.push_back(page->packed.base + page->packed.offset(i));
+            f(entry.key, page->split_limit, elements);
+        });
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        // The values in the table are page pointers, which belong to the index
+        usage.index_table  += usage.page_payload;
+        usage.page_payload  = 0;
+        usage.metadata     += sizeof(*this) - sizeof(table);
+
+        table.for_each([&](auto& entry){
+            const Page *page = entry.value;
+            const VEC &elements = page->elements;
+            usage.metadata        += sizeof(Page);
+            usage.allocator_slack += malloc_overhead(page, sizeof(Page));
+            usage.page_payload    += page->packed.payload_bytes();
+            usage.allocator_slack += malloc_overhead(page->packed.bytes, page->packed.payload_bytes());
+            usage.page_payload    += elements.size() * sizeof(Key);
+            usage.allocator_slack += (elements.capacity() - elements.size()) * sizeof(Key)
+                                   + malloc_overhead(elements.data(), elements.capacity() * sizeof(Key));
+        });
+        return usage;
+    }
+
+    inline void prefetch_page(Key page_id){
+        if (max_page_factor == 0 && !is_id_page_bearer(page_id)) return;
+        table.prefetch(page_id);
+    }
+
+    inline Key try_predecessor_in_page(Key x, Key page_id){
+        return predecessor_in_page(x, get_page(page_id));
+    }
 
-        auto entry = table.get(page_id);
-        if (entry == nullptr) return 0;
+    // The same, but the page comes from the finger when it has it
+    inline Key try_predecessor_in_page(Key x, Key page_id, Finger& finger){
+        if (max_page_factor == 0 && !is_id_page_bearer(page_id)) return 0;
+        auto *entry = finger.get(table, page_id);
+        return predecessor_in_page(x, entry == nullptr ? nullptr : entry->value);
+    }
 
-        VEC *vec = entry->value;
+    // Answers the visits of xs[0..n) to page_id with a single table probe.
+    // There is no insert_batch_in_page: walks depend on the order of insertions.
+    inline void predecessors_in_page(const Key *xs, u64 n, Key page_id, Key *results){
+        Page *page = get_page(page_id);
+        for (u64 i = 0; i < n; i++) results[i] = predecessor_in_page(xs[i], page);
+    }
 
-        VEC &vec_ref = *vec;
-        u64 best = 0;
+    inline static Key predecessor_in_page(Key x, Page *page){
+        if (page == nullptr) return 0;
+        if (x >= page->split_limit) return 0;
+        if (page->packed.is_packed()) return page->packed.predecessor(x);
+
+        VEC &vec_ref = page->elements;
+        Key best = 0;
         for (auto e : vec_ref){
             if (e <= x && e > best) best = e;
         }
@@ -120,7 +414,6 @@ struct PBSPageBearerHashing {
 
 
     void print_statistics(){
-        using LPTable = typeof(table);
         u64 n_pages = table.n_elements;
         
         const u64 MAX_BUCKET_SIZE = 1000;
@@ -129,14 +422,12 @@ struct PBSPageBearerHashing {
 
         u64 total_elements = 0;
         u64 max_seen = 0;
-        for(u64 i = 0; i < table.capacity; i++){
-            if (table.table[i].key != LPTable::EMPTY_CELL){
-                const u64 size = table.table[i].value->size();
-                total_elements += size;
-                if (size > max_seen) max_seen = size;
-                if (size < MAX_BUCKET_SIZE) bucket_size[size]++;
-            }
-        }
+        table.for_each([&](auto& entry){
+            const u64 size = entry.value->size();
+            total_elements += size;
+            if (size > max_seen) max_seen = size;
+            if (size < MAX_BUCKET_SIZE) bucket_size[size]++;
+        });
         
 
         const double avg_elements_per_page = (double)total_elements / n_pages;
@@ -152,7 +443,7 @@ struct PBSPageBearerHashing {
         
         
         double density[MAX_BUCKET_SIZE];
-        for (u64 i = 1; i < MAX_BUCKET_SIZE; i++) density[i] = (double)bucket_size_running[i] / n_pages;
+        for (u64 i = 0; i < MAX_BUCKET_SIZE; i++) density[i] = (double)bucket_size_running[i] / n_pages;
         
         std::cout << "The density is \n";
         for(u64 i = 0; i < 3*epsilon; i++){
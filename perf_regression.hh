@@ -0,0 +1,155 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include "util.h"
+
+
+// Stored baselines for the performance regression suite, and the test that
+// decides whether a new set of runs is slower than them.
+//
+// Every case (a structure on a workload) is run several times. Each run is
+// timed against a reference, std::set on the same workload, timed in the
+// same round of the same invocation, and only the ratio of the two is kept:
+// absolute times move with the machine, its load and its clock, ratios much
+// less. The baseline file keeps, per case, the sum of the query answers and
+// the insertion and query ratio of every run, one case per line with
+// tab-separated fields:
+//
+//      case name   sum   insertion ratios   query ratios
+//
+// with the ratios separated by spaces. Lines starting with # are comments.
+//
+// Ratios still depend on the cache sizes and the compiler, so the file is
+// regenerated with --update-baseline when either changes.
+
+struct RegressionRecord {
+    std::string case_name;
+    u64 sum;
+    std::vector<double> insertion_ratios;
+    std::vector<double> query_ratios;
+};
+
+inline std::vector<double> parse_ratios(const std::string& field){
+    std::vector<double> ratios;
+    std::stringstream sstm(field);
+    double r;
+    while (sstm >> r) ratios.push_back(r);
+    return ratios;
+}
+
+// Records by case name. A missing baseline is an error: the suite would
+// otherwise pass without comparing anything.
+inline std::map<std::string, RegressionRecord> load_regression_baseline(const std::string& path){
+    std::map<std::string, RegressionRecord> records;
+    std::ifstream file(path);
+    if (!file) std::cout << "Could not read baseline " << path << ". Exiting.\n", exit(1);
+    std::string line;
+    while (std::getline(file, line)){
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> fields;
+        std::stringstream sstm(line);
+        std::string field;
+        while (std::getline(sstm, field, '\t')) fields.push_back(field);
+        if (fields.size() != 4){
+            std::cout << "Malformed line in baseline " << path << ": " << line << "\n";
+            continue;
+        }
+        RegressionRecord record = {.case_name = fields[0], .sum = std::stoull(fields[1]),
+                                   .insertion_ratios = parse_ratios(fields[2]), .query_ratios = parse_ratios(fields[3])};
+        records[record.case_name] = record;
+    }
+    return records;
+}
+
+inline void save_regression_baseline(const std::string& path, const std::vector<RegressionRecord>& records){
+    std::ofstream file(path);
+    if (!file) std::cout << "Could not write baseline " << path << ". Exiting.\n", exit(1);
+    file << "# Baseline of the performance regression suite: PageBearer regression --update-baseline\n";
+    file << "# case\tsum\tinsertion time / std::set's\tquery time / std::set's\n";
+    file << std::setprecision(4);
+    for (const auto& record : records){
+        file << record.case_name << "\t" << record.sum << "\t";
+        for (u64 i = 0; i < record.insertion_ratios.size(); i++) file << (i ? " " : "") << record.insertion_ratios[i];
+        file << "\t";
+        for (u64 i = 0; i < record.query_ratios.size(); i++) file << (i ? " " : "") << record.query_ratios[i];
+        file << "\n";
+    }
+}
+
+
+// Quantile q of xs, interpolating between the two nearest runs
+inline double quantile(std::vector<double> xs, double q){
+    std::sort(xs.begin(), xs.end());
+    const double pos = q * (xs.size() - 1);
+    const u64 i = (u64)pos;
+    if (i + 1 >= xs.size()) return xs.back();
+    return xs[i] + (pos - i) * (xs[i + 1] - xs[i]);
+}
+
+// One-sided Mann-Whitney U test of whether the runs of xs tend to be larger
+// than those of ys, by the normal approximation with a continuity correction
+// (fine from about 8 runs each). Returns z; ties count half.
+inline double mann_whitney_z(const std::vector<double>& xs, const std::vector<double>& ys){
+    double u = 0;
+    for (double x : xs){
+        for (double y : ys) u += x > y ? 1 : x == y ? 0.5 : 0;
+    }
+    const double n1 = xs.size(), n2 = ys.size();
+    const double mean = n1 * n2 / 2;
+    const double sd   = std::sqrt(n1 * n2 * (n1 + n2 + 1) / 12);
+    return sd > 0 ? (u - mean - 0.5) / sd : 0;
+}
+
+// A case is slower if its ratios are larger than the baseline's scaled by
+// 1 + threshold, by a one-sided Mann-Whitney U test at level ALPHA: the
+// test is of a slowdown beyond the threshold, not of any slowdown. Faster
+// is the same against the baseline scaled by 1 - threshold. The test only
+// uses the order of the runs, so the few runs that the machine disturbs
+// (the timings have long right tails) weigh no more than any other, which
+// a t-test on means does not give. ALPHA is 1%, as the suite makes 20
+// comparisons. Medians and quartiles are kept for the report.
+static const double REGRESSION_ALPHA   = 0.01;
+static const double REGRESSION_Z_ALPHA = 2.326;  // one-sided normal quantile for REGRESSION_ALPHA
+
+struct RegressionComparison {
+    enum Verdict {Unchanged, Slower, Faster};
+    double baseline_median;
+    double baseline_low;  // quartiles
+    double baseline_high;
+    double median;
+    double low;
+    double high;
+    double z_slower;  // Mann-Whitney z of the slowdown beyond the threshold
+    double z_faster;
+    Verdict verdict;
+};
+
+inline RegressionComparison compare_timings(const std::vector<double>& baseline, const std::vector<double>& current, double threshold){
+    RegressionComparison res;
+    res.baseline_median = quantile(baseline, 0.5);
+    res.baseline_low    = quantile(baseline, 0.25);
+    res.baseline_high   = quantile(baseline, 0.75);
+    res.median          = quantile(current, 0.5);
+    res.low             = quantile(current, 0.25);
+    res.high            = quantile(current, 0.75);
+
+    std::vector<double> slower_bound, faster_bound;
+    for (double b : baseline){
+        slower_bound.push_back(b * (1 + threshold));
+        faster_bound.push_back(b * (1 - threshold));
+    }
+    res.z_slower = mann_whitney_z(current, slower_bound);
+    res.z_faster = mann_whitney_z(faster_bound, current);
+    res.verdict = res.z_slower > REGRESSION_Z_ALPHA ? RegressionComparison::Slower :
+                  res.z_faster > REGRESSION_Z_ALPHA ? RegressionComparison::Faster :
+                                                      RegressionComparison::Unchanged;
+    return res;
+}
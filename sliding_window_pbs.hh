@@ -0,0 +1,93 @@
+#pragma once
+
+#include <sstream>
+#include <algorithm>
+#include "util.h"
+#include "memory_usage.hh"
+#include "pbs_epsilon_8.hh"
+#include "pbs_bit_tricks.hh"
+
+
+// A bitmap PBS structure (PBSEpsilon8, PBSBitTricks) over a sliding window
+// of increasing keys such as timestamps: only the keys in
+// [newest - window, newest] count, where newest is the largest key inserted.
+//
+// Since page ids are x / epsilon^2, old keys are in whole pages below a
+// low-water mark, get_id(newest - window). Nothing is deleted one key at a
+// time; once the low-water mark has moved SWEEP_FRACTION of the window past
+// the last sweep, every page below it is dropped in one pass over the table
+// with expire_pages_below(), and the table shrinks with it. The structure
+// thus never holds more than about 1 + 1 / SWEEP_FRACTION windows of pages,
+// however long the stream, and a sweep costs O(1) per page it drops.
+//
+// Queries never answer with a key below the window, even if its page is
+// still there, so the answers are exact for the window. Insertions below
+// the window are ignored.
+template <typename pbs_structure>
+struct SlidingWindowPBS {
+
+    static const u64 SWEEP_FRACTION = 4;
+
+    pbs_structure pbs;
+    u64 window;
+    u64 newest      = 0;
+    u64 swept_below = 0; // pages below this id are gone
+    u64 sweep_step;      // page ids the low-water mark moves between sweeps
+    u64 n_sweeps        = 0;
+    u64 n_pages_expired = 0;
+
+    SlidingWindowPBS(u64 window) : window(window) {
+        sweep_step = std::max((u64)(1), pbs_structure::get_id(window) / SWEEP_FRACTION);
+    }
+
+    std::string name(){
+        std::stringstream sstm;
+        sstm << pbs.name() << " (window of " << window << ")";
+        return sstm.str();
+    }
+
+    inline static u64 get_id(u64 x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    // Smallest key in the window
+    inline u64 window_start() const {
+        return newest > window ? newest - window : 0;
+    }
+
+    inline bool try_insert_in_page(u64 x, u64 id){
+        if (x < window_start()) return false;
+        if (x > newest){
+            newest = x;
+            const u64 low_water = get_id(window_start());
+            if (low_water >= swept_below + sweep_step) sweep(low_water);
+        }
+        return pbs.try_insert_in_page(x, id);
+    }
+
+    void sweep(u64 low_water){
+        n_pages_expired += pbs.expire_pages_below(low_water);
+        swept_below = low_water;
+        n_sweeps++;
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        if (id < swept_below) return 0;
+        const u64 res = pbs.try_predecessor_in_page(x, id);
+        return res < window_start() ? 0 : res;
+    }
+
+    inline void prefetch_page(u64 id){
+        pbs.prefetch_page(id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = pbs.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(pbs);
+        return usage;
+    }
+};
@@ -75,6 +75,12 @@ struct TestLinearProbingPBS {
         return true;        
     }
 
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = table.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(table);
+        return usage;
+    }
+
     inline u64 try_predecessor_in_page(u64 x, u64 id){
         auto res = table.get(id);
         if (res == nullptr) return 0;
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+#include "memory_usage.hh"
+
+
+// Append-only log of the writes to a PBS structure, for rebuilding it after
+// a crash. Every try_insert_in_page / try_delete_in_page call is logged with
+// its page id before it is applied, so replaying the log repeats the same
+// calls in the same order and gives the same structure.
+//
+// Layout, little-endian u64 words like the traces in op_trace.hh:
+//
+//      header:  magic, version
+//      record:  tag = (check << 8) | op, key, page_id
+//
+// check is a hash of op, key and page_id, seeded so that an all-zero record
+// does not pass. A crash can leave a torn record at the end of the file, or
+// records of zeros where the file was extended but the data never made it to
+// disk; replay stops at the first record whose op is unknown or whose check
+// fails.
+//
+// append() copies the record into a preallocated ring buffer and does not
+// allocate. A background thread writes the ring to the file and calls
+// fdatasync once at least commit_batch records are waiting for it (group
+// commit), when sync() asks for it, or when no records came in for
+// COMMIT_INTERVAL. Every commit_batch-th append() notifies the writer,
+// which is a futex wake system call when the writer is parked: with a
+// commit_batch of 1 that is every append(). Records are durable once
+// durable_records() has passed them. append() waits only when the ring is
+// full.
+
+struct WalHeader {
+    u64 magic;
+    u64 version;
+};
+
+struct WalRecord {
+    enum Op {Insert = 1, Delete = 2};
+    u64 tag;
+    u64 key;
+    u64 page_id;
+};
+
+static const u64 WAL_MAGIC      = 0x31304c4157534250; // "PBSWAL01"
+static const u64 WAL_VERSION    = 2; // 1 had an unseeded check
+static const u64 WAL_CHECK_SEED = 0x5B3A6E0C41D2F897;
+
+constexpr u64 wal_check(u64 op, u64 key, u64 page_id){
+    u64 h = (op ^ WAL_CHECK_SEED) * 0x9E3779B97F4A7C15;
+    h = (h ^ key)     * 0xC2B2AE3D27D4EB4F;
+    h = (h ^ page_id) * 0x165667B19E3779F9;
+    return (h ^ (h >> 29)) >> 8;
+}
+
+static_assert(wal_check(0, 0, 0) != 0, "A record of zeros must not pass the check");
+
+inline WalRecord make_wal_record(WalRecord::Op op, u64 key, u64 page_id){
+    return {.tag = (wal_check(op, key, page_id) << 8) | (u64)op, .key = key, .page_id = page_id};
+}
+
+
+struct WriteAheadLog {
+
+    static const u64 RING_RECORDS = 1 << 16;
+    static constexpr auto COMMIT_INTERVAL = std::chrono::milliseconds(1);
+
+    int fd;
+    u64 commit_batch;
+    WalRecord *ring;
+
+    alignas(64) std::atomic<u64> head    = 0; // records appended
+    alignas(64) std::atomic<u64> tail    = 0; // records written to the file
+    alignas(64) std::atomic<u64> durable = 0; // records synced
+    std::atomic<u64> sync_requested      = 0;
+    std::atomic<bool> stopping           = false;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread writer;
+
+    // Written by the background thread, read after close()
+    u64 n_syncs = 0;
+
+    // Appends to the log at path, creating it if needed. valid_bytes is the
+    // length of the valid prefix from replay_log(); anything after it is a
+    // torn record and is cut off.
+    WriteAheadLog(const std::string& path, u64 commit_batch, u64 valid_bytes = 0){
+        this->commit_batch = std::max((u64)(1), commit_batch);
+        fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) std::cout << "Could not open log " << path << ". Exiting.\n", exit(1);
+        if (valid_bytes < sizeof(WalHeader)){
+            const WalHeader header = {.magic = WAL_MAGIC, .version = WAL_VERSION};
+            if (ftruncate(fd, 0) != 0) std::cout << "Could not truncate log " << path << ". Exiting.\n", exit(1);
+            write_all(&header, sizeof(header));
+            valid_bytes = sizeof(header);
+        }
+        else if (ftruncate(fd, valid_bytes) != 0) std::cout << "Could not truncate log " << path << ". Exiting.\n", exit(1);
+        lseek(fd, valid_bytes, SEEK_SET);
+
+        ring = (WalRecord*)malloc(RING_RECORDS * sizeof(WalRecord));
+        if (!ring) std::cout << "Allocation of log ring failed.\n", exit(1);
+        writer = std::thread([this]{ run(); });
+    }
+
+    ~WriteAheadLog(){
+        if (writer.joinable()) close();
+        free(ring);
+    }
+
+    WriteAheadLog(const WriteAheadLog& other) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog& other) = delete;
+
+    // Returns the number of records appended so far, including this one.
+    // Only one thread may append.
+    inline u64 append(WalRecord::Op op, u64 key, u64 page_id){
+        const u64 h = head.load(std::memory_order_relaxed);
+        while (h - tail.load(std::memory_order_acquire) >= RING_RECORDS){
+            wake.notify_one();
+            std::this_thread::yield();
+        }
+        ring[h % RING_RECORDS] = make_wal_record(op, key, page_id);
+        head.store(h + 1, std::memory_order_release);
+        if ((h + 1) % commit_batch == 0) wake.notify_one();
+        return h + 1;
+    }
+
+    inline u64 durable_records(){
+        return durable.load(std::memory_order_acquire);
+    }
+
+    // Waits until everything appended so far is on disk
+    void sync(){
+        const u64 n = head.load(std::memory_order_relaxed);
+        sync_requested.store(n);
+        wake.notify_one();
+        u64 d = durable.load();
+        while (d < n){
+            durable.wait(d);
+            d = durable.load();
+        }
+    }
+
+    // Syncs everything and stops the background thread
+    void close(){
+        stopping.store(true);
+        wake.notify_one();
+        writer.join();
+        ::close(fd);
+    }
+
+    void write_all(const void *data, u64 n_bytes){
+        const char *bytes = (const char*)data;
+        while (n_bytes > 0){
+            const ssize_t written = ::write(fd, bytes, n_bytes);
+            if (written < 0) std::cout << "Writing log failed. Exiting.\n", exit(1);
+            bytes   += written;
+            n_bytes -= written;
+        }
+    }
+
+    // Writes records [from, to) of the ring, in up to two pieces if they wrap
+    void write_records(u64 from, u64 to){
+        while (from < to){
+            const u64 begin = from % RING_RECORDS;
+            const u64 n     = std::min(to - from, RING_RECORDS - begin);
+            write_all(ring + begin, n * sizeof(WalRecord));
+            from += n;
+        }
+    }
+
+    // The background thread. A notify that comes between the check for new
+    // records and the wait is missed, which only delays the writer by one
+    // COMMIT_INTERVAL; append() never takes the mutex.
+    void run(){
+        bool idle = false;
+        while (true){
+            const u64 h = head.load(std::memory_order_acquire);
+            const u64 t = tail.load(std::memory_order_relaxed);
+            if (h != t){
+                write_records(t, h);
+                tail.store(h, std::memory_order_release);
+                idle = false;
+            }
+
+            const u64 d = durable.load(std::memory_order_relaxed);
+            const bool stop = stopping.load();
+            const bool commit = h - d >= commit_batch || sync_requested.load() > d || idle || stop;
+            if (h > d && commit){
+                if (fdatasync(fd) != 0) std::cout << "Syncing log failed. Exiting.\n", exit(1);
+                n_syncs++;
+                durable.store(h, std::memory_order_release);
+                durable.notify_all();
+            }
+
+            if (stop && head.load() == h) break;
+            if (head.load(std::memory_order_acquire) == h && sync_requested.load() <= h){
+                std::unique_lock<std::mutex> lock(mutex);
+                idle = wake.wait_for(lock, COMMIT_INTERVAL) == std::cv_status::timeout;
+            }
+        }
+    }
+};
+
+
+// Replays the log at path into pbs. Returns the length of its valid prefix
+// (header and whole records with a good check), and the number of records
+// replayed in n_records. Returns 0, which has WriteAheadLog start a new log,
+// only if there is no log yet: no file, an empty one, or the start of a
+// header that a crash cut short. Any other file exits rather than being
+// cut back to nothing.
+template <typename pbs_structure>
+u64 replay_log(pbs_structure& pbs, const std::string& path, u64 *n_records = nullptr){
+    if (n_records) *n_records = 0;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    fstat(fd, &st);
+    const u64 file_size = st.st_size;
+    const WalHeader expected = {.magic = WAL_MAGIC, .version = WAL_VERSION};
+    WalHeader header;
+    const u64 n_header_bytes = std::min(file_size, (u64)sizeof(header));
+    if (pread(fd, &header, n_header_bytes, 0) != (ssize_t)n_header_bytes){
+        std::cout << "Could not read log " << path << ". Exiting.\n", exit(1);
+    }
+    if (file_size < sizeof(header) && memcmp(&header, &expected, n_header_bytes) == 0){
+        ::close(fd);
+        return 0;
+    }
+    if (file_size < sizeof(header) || header.magic != WAL_MAGIC){
+        std::cout << "File " << path << " is not a log (bad magic). Exiting.\n", exit(1);
+    }
+    if (header.version != WAL_VERSION){
+        std::cout << "Log " << path << " has version " << header.version << ", expected " << WAL_VERSION << ". Exiting.\n", exit(1);
+    }
+
+    const u64 n_whole = (file_size - sizeof(header)) / sizeof(WalRecord);
+    u64 n_valid = 0;
+    if (n_whole > 0){
+        void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) std::cout << "Could not mmap log " << path << ". Exiting.\n", exit(1);
+        madvise(mapped, file_size, MADV_SEQUENTIAL);
+        const WalRecord *records = (const WalRecord*)((const char*)mapped + sizeof(header));
+
+        for (; n_valid < n_whole; n_valid++){
+            const WalRecord &record = records[n_valid];
+            const u64 op = record.tag & 0xFF;
+            if (op != WalRecord::Insert && op != WalRecord::Delete) break;
+            if ((record.tag >> 8) != wal_check(op, record.key, record.page_id)) break;
+            if (op == WalRecord::Insert) pbs.try_insert_in_page(record.key, record.page_id);
+            else if constexpr (requires { pbs.try_delete_in_page(record.key, record.page_id); }){
+                pbs.try_delete_in_page(record.key, record.page_id);
+            }
+            else std::cout << "Log " << path << " has deletes, which " << pbs.name() << " does not support. Exiting.\n", exit(1);
+        }
+        munmap(mapped, file_size);
+    }
+    ::close(fd);
+    if (n_records) *n_records = n_valid;
+    return sizeof(header) + n_valid * sizeof(WalRecord);
+}
+
+
+// A PBS structure whose writes go through a WriteAheadLog. The constructor
+// replays an existing log at path first, so constructing it again after a
+// crash gives back the structure as of the last durable record.
+template <typename pbs_structure>
+struct LoggedPBS {
+
+    pbs_structure pbs;
+    u64 n_replayed = 0;
+    WriteAheadLog log;
+
+    LoggedPBS(const std::string& path, u64 commit_batch)
+        : pbs(), log(path, commit_batch, replay_log(pbs, path, &n_replayed)) {}
+
+    std::string name(){
+        return pbs.name() + " (logged, group commit of " + std::to_string(log.commit_batch) + ")";
+    }
+
+    inline static u64 get_id(u64 x){
+        return pbs_structure::get_id(x);
+    }
+
+    inline static bool is_id_page_bearer(u64 id){
+        return pbs_structure::is_id_page_bearer(id);
+    }
+
+    inline bool try_insert_in_page(u64 x, u64 id){
+        log.append(WalRecord::Insert, x, id);
+        return pbs.try_insert_in_page(x, id);
+    }
+
+    inline bool try_delete_in_page(u64 x, u64 id) requires requires (pbs_structure& p) { p.try_delete_in_page(x, id); } {
+        log.append(WalRecord::Delete, x, id);
+        return pbs.try_delete_in_page(x, id);
+    }
+
+    inline u64 try_predecessor_in_page(u64 x, u64 id){
+        return pbs.try_predecessor_in_page(x, id);
+    }
+
+    MemoryUsage memory_usage(){
+        MemoryUsage usage = pbs.memory_usage();
+        usage.metadata += sizeof(*this) - sizeof(pbs) + WriteAheadLog::RING_RECORDS * sizeof(WalRecord);
+        return usage;
+    }
+};